@@ -32,11 +32,111 @@ extern "C" {
 #define PN_MAX_IP_LEN           64
 #define PN_MAX_CAPS_LEN         128
 #define PN_MAX_SERVICES         32
+#define PN_MAX_PEERS            64
+#define PN_MAX_PROXIED          64
+#define PN_MAX_RESOLVE          16    /* Service types resolved concurrently */
+#define PN_MAX_RESERVATIONS     32    /* Held slots / outstanding requests */
+#define PN_INGEST_SLOTS         128   /* Datagrams drained per listener cycle */
+#define PN_RECV_BUFFER_BYTES    (256 * 1024)
+#define PN_MAX_FILTERS          16    /* Accepted service types */
+#define PN_MAX_IFACES           8     /* Broadcast interface allow-list */
+#define PN_CONTROL_MAX_REPLY    8192  /* Longest control command reply */
 
-/* Announce interval (randomized between these values) */
+/* Ingest priority classes (lower is more important) */
+#define PN_INGEST_BYE           0     /* Departures */
+#define PN_INGEST_NEW           1     /* Ids not yet in the registry */
+#define PN_INGEST_QUERY         2     /* Queries and other requests */
+#define PN_INGEST_CHANGE        3     /* Descriptor changes of known ids */
+#define PN_INGEST_KEEPALIVE     4     /* Repeat heartbeats (shed first) */
+#define PN_INGEST_CLASSES       5
+
+/* Outbound priority classes (lower goes first when the budget is short) */
+#define PN_TX_BYE               0     /* Departures (never deferred) */
+#define PN_TX_ANSWER            1     /* Query answers, reservation replies */
+#define PN_TX_REQUEST           2     /* Queries, reservations, capacity changes */
+#define PN_TX_CHANGE            3     /* First and reactive announcements */
+#define PN_TX_KEEPALIVE         4     /* Periodic heartbeats (merged while waiting) */
+#define PN_TX_CLASSES           5
+#define PN_TX_QUEUE             32    /* Datagrams held back by the pacer */
+#define PN_MAX_BURST            64    /* Datagrams per pn_send_burst() call */
+
+/* Log levels (runtime, see "log" control command) */
+#define PN_LOG_QUIET            0
+#define PN_LOG_INFO             1     /* Default */
+#define PN_LOG_DEBUG            2
+
+/* What a child inherits across fork() (see pn_set_fork_mode) */
+#define PN_FORK_SNAPSHOT        0     /* Frozen registry copy, engine stopped (default) */
+#define PN_FORK_RESTART         1     /* Registry copy, listener restarted */
+#define PN_FORK_ATTACH          2     /* Live read-only view of the parent's registry */
+
+/* What gives way when the registry is full (see pn_set_eviction) */
+#define PN_EVICT_NONE           0     /* Newcomers are turned away (default) */
+#define PN_EVICT_LRU            1     /* Least recently heard from */
+#define PN_EVICT_PRIORITY       2     /* Lowest service-type priority, then LRU */
+#define PN_EVICT_RELEVANCE      3     /* Types nobody asked for, then LRU */
+#define PN_EVICT_CLASSES        8     /* Service-type priorities 0..7 */
+#define PN_PRIORITY_DEFAULT     4
+#define PN_MAX_PRIORITIES       16    /* Types with an explicit priority */
+
+/* Announce interval range; heartbeats run at its midpoint */
 #define PN_ANNOUNCE_MIN_SEC     30
 #define PN_ANNOUNCE_MAX_SEC     60
 
+/* Learned unicast peers are forgotten after this much silence */
+#define PN_PEER_TIMEOUT_SEC     (PN_ANNOUNCE_MAX_SEC * 3)
+
+/*
+ * Demand-driven announcing: with no listener interested in its type an
+ * announcer drops to one beacon per PN_BEACON_SEC. Interest not re-advertised
+ * for PN_INTEREST_TTL_SEC lapses.
+ */
+#define PN_BEACON_SEC           300
+#define PN_INTEREST_TTL_SEC     (PN_ANNOUNCE_MAX_SEC * 3)
+
+/*
+ * Registry leases: an entry silent (no helo, no pn_note_alive) this long is
+ * suspected and probed every PN_PROBE_INTERVAL_SEC; at PN_LEASE_SEC it expires.
+ * An announcer whose heartbeats are further apart asks for three periods,
+ * up to PN_LEASE_MAX_SEC; its suspect point scales in proportion.
+ */
+#define PN_SUSPECT_SEC          (PN_ANNOUNCE_MAX_SEC * 2)
+#define PN_PROBE_INTERVAL_SEC   20
+#define PN_LEASE_SEC            (PN_ANNOUNCE_MAX_SEC * 3)
+#define PN_LEASE_MAX_SEC        3600
+
+/* Byes are remembered this long so late helos cannot resurrect an id */
+#define PN_TOMBSTONE_SEC        120
+
+/* Slot reservations: how long a granted slot waits for the client */
+#define PN_RESERVE_HOLD_SEC     10
+#define PN_RESERVE_RETRY_MS     250
+
+/* Registry bootstrap: resend the request if the transfer is incomplete */
+#define PN_BOOTSTRAP_RETRY_MS   500
+
+/* Visibility confirmation: peers tracked, first helo resend (doubles per resend) */
+#define PN_VISIBLE_MAX_PEERS    64
+#define PN_VISIBLE_RETRY_MS     500
+#define PN_VISIBLE_COORDINATOR  (-1)  /* pn_announce_wait_visible(): wait for a coordinator */
+
+/* Racing connect: delay between attempts, addresses raced per call */
+#define PN_CONNECT_STAGGER_MS   250
+#define PN_MAX_CONNECT_ATTEMPTS 16
+
+/* TCP coordinator: subscriber sessions, unsent bytes before one is dropped */
+#define PN_COORD_MAX_SESSIONS   16384
+#define PN_COORD_MAX_BACKLOG    (256 * 1024)
+
+/* Negative cache for pn_resolve_service() misses (doubles per miss) */
+#define PN_NEG_CACHE_MIN_MS     1000
+#define PN_NEG_CACHE_MAX_MS     60000
+
+/* Known-answer filter carried in "find" queries (bits, multiple of 8) */
+#define PN_KA_MIN_BITS          64
+#define PN_KA_MAX_BITS          2048
+#define PN_KA_BITS_PER_ENTRY    10
+
 /* Service types */
 #define PN_SVC_SDR_SERVER       "sdr_server"
 #define PN_SVC_SIGNAL_SPLITTER  "signal_splitter"
@@ -54,9 +154,108 @@ typedef struct {
     int  data_port;                   /* Data port (0 if none) */
     char caps[PN_MAX_CAPS_LEN];       /* Capabilities string */
     uint32_t last_seen;               /* Unix timestamp of last announcement */
+    uint32_t incarnation;             /* Announcer incarnation (0 if not sent) */
+    int  slots;                       /* Free client slots (-1 if not advertised) */
+    uint64_t hlc;                     /* Hybrid logical clock of this version (0 if not sent) */
+    uint32_t lease;                   /* Lease asked for in seconds (0 = PN_LEASE_SEC) */
+    bool pinned;                      /* Static entry: updated live, never evicted */
     bool active;                      /* Entry in use */
 } pn_service_t;
 
+/* Listener ingest counters, indexed by PN_INGEST_* class */
+typedef struct {
+    uint64_t received[PN_INGEST_CLASSES];  /* Datagrams classified */
+    uint64_t dropped[PN_INGEST_CLASSES];   /* Datagrams shed under overload */
+    uint64_t overload_cycles;              /* Drain cycles that hit the limit */
+    uint64_t duplicates;                   /* Copies of the version we hold */
+    uint64_t stale;                        /* Versions older than we hold */
+    uint64_t coalesced;                    /* Datagrams split out of GRO buffers */
+    uint64_t evicted;                      /* Entries evicted to make room */
+    uint64_t rejected;                     /* New ids turned away, registry full */
+    uint64_t probes;                       /* Suspected entries probed */
+    uint64_t expired;                      /* Entries whose lease ran out */
+} pn_ingest_stats_t;
+
+/* Connect outcomes and liveness of a registry entry (see pn_connect_service) */
+typedef struct {
+    uint32_t connects;                     /* Attempts that established */
+    uint32_t failures;                     /* Attempts refused or unreachable */
+    int      streak;                       /* Failures since the last success */
+    int      rtt_ms;                       /* Last connect time (-1 if unknown) */
+    uint32_t alive;                        /* Unix time of the last sign of life */
+    int      probes;                       /* Probes sent since then */
+} pn_health_t;
+
+/*
+ * Event history file (see pn_history_open): one pn_history_header_t followed
+ * by `capacity` fixed-size records used as a ring. Record n lives in slot
+ * n % capacity; the oldest surviving record is max(0, total - capacity).
+ */
+#define PN_HISTORY_MAGIC        0x48454E50u   /* "PNEH" */
+#define PN_HISTORY_VERSION      1
+#define PN_HISTORY_ID_LEN       40            /* Id copy kept per record (truncated) */
+
+/* Event types */
+#define PN_EVENT_ADDED          1
+#define PN_EVENT_UPDATED        2
+#define PN_EVENT_REMOVED        3
+#define PN_EVENT_EVICTED        4     /* Removed to make room for a newcomer */
+#define PN_EVENT_EXPIRED        5     /* Removed when its lease ran out */
+
+/* Changed-field bits (PN_EVENT_UPDATED) */
+#define PN_FIELD_SERVICE        0x0001
+#define PN_FIELD_IP             0x0002
+#define PN_FIELD_PORTS          0x0004
+#define PN_FIELD_CAPS           0x0008
+#define PN_FIELD_INCARNATION    0x0010
+#define PN_FIELD_SLOTS          0x0020
+
+typedef struct {
+    uint32_t magic;                   /* PN_HISTORY_MAGIC */
+    uint32_t version;                 /* PN_HISTORY_VERSION */
+    uint32_t record_size;             /* sizeof(pn_history_record_t) */
+    uint32_t capacity;                /* Records in the ring */
+    volatile uint64_t total;          /* Records ever written */
+    uint8_t  reserved[40];
+} pn_history_header_t;                /* 64 bytes */
+
+typedef struct {
+    uint64_t ts_ms;                   /* Unix time in milliseconds (never decreases) */
+    uint32_t id_handle;               /* pn_history_id_handle(id) */
+    uint8_t  type;                    /* PN_EVENT_* */
+    uint8_t  reserved;
+    uint16_t changed;                 /* PN_FIELD_* bits */
+    uint32_t src_ip;                  /* Address heard from (network order) */
+    uint16_t src_port;                /* Port heard from (host order) */
+    int16_t  slots;                   /* Free slots after the event (-1 if none) */
+    char     id[PN_HISTORY_ID_LEN];   /* Id, NUL-terminated, may be truncated */
+} pn_history_record_t;                /* 64 bytes */
+
+/* Outbound pacer counters, indexed by PN_TX_* class */
+typedef struct {
+    uint64_t sent[PN_TX_CLASSES];          /* Submissions put on the wire */
+    uint64_t deferred[PN_TX_CLASSES];      /* Held back for budget */
+    uint64_t merged[PN_TX_CLASSES];        /* Superseded while held back */
+    uint64_t dropped[PN_TX_CLASSES];       /* Pushed out of a full queue */
+    uint64_t bytes_sent;
+    uint64_t bytes_deferred;
+    uint64_t last_deferred_ms;             /* Unix ms of the latest deferral (0 = never) */
+    uint32_t max_delay_ms;                 /* Longest wait of a deferred datagram */
+    uint64_t segmented;                    /* Datagrams sent in GSO bursts */
+} pn_tx_stats_t;
+
+/* TCP coordinator counters (see pn_coordinator_open) */
+typedef struct {
+    uint32_t sessions;                     /* Subscribers connected now */
+    uint64_t accepted;                     /* Sessions accepted */
+    uint64_t refused;                      /* Closed at once, PN_COORD_MAX_SESSIONS reached */
+    uint64_t dropped;                      /* Closed PN_COORD_MAX_BACKLOG behind */
+    uint64_t snapshots;                    /* Full registry snapshots sent */
+    uint64_t resyncs;                      /* Snapshots re-sent after a lost change */
+    uint64_t deltas;                       /* Registry changes fanned out */
+    uint64_t bytes_out;                    /* Bytes written to sessions */
+} pn_coord_stats_t;
+
 /*
  * Service discovery callback
  * Called when a service is discovered or leaves the network.
@@ -74,6 +273,24 @@ typedef void (*pn_service_cb)(const char *id, const char *service,
                               const char *ip, int ctrl_port, int data_port,
                               const char *caps, bool is_bye, void *userdata);
 
+/*
+ * Batched registry change callback
+ * Called once per coalescing window with every change gathered in it.
+ * Arrays are valid only for the duration of the call.
+ * 
+ * @param added      Services that appeared
+ * @param n_added    Number of entries in added
+ * @param updated    Services whose descriptor changed
+ * @param n_updated  Number of entries in updated
+ * @param removed    Services that left
+ * @param n_removed  Number of entries in removed
+ * @param userdata   User-provided context
+ */
+typedef void (*pn_batch_cb)(const pn_service_t *added, int n_added,
+                            const pn_service_t *updated, int n_updated,
+                            const pn_service_t *removed, int n_removed,
+                            void *userdata);
+
 /*
  * Initialize discovery system
  * 
@@ -84,7 +301,7 @@ int pn_discovery_init(int udp_port);
 
 /*
  * Start announcing this service
- * Broadcasts immediately, then every 30-60 seconds (randomized).
+ * Broadcasts immediately, then every 45 seconds on the phase grid.
  * 
  * @param id        Unique instance ID (e.g., "KY4OLB-SDR1")
  * @param service   Service type (e.g., PN_SVC_SDR_SERVER)
@@ -111,15 +328,483 @@ void pn_announce_stop(void);
  */
 int pn_listen(pn_service_cb callback, void *userdata);
 
+/*
+ * Announce a service on its behalf (proxy role)
+ * For nodes that front many services (e.g. signal_splitter outputs, sleeping
+ * remote services). All proxied services share one heartbeat schedule and are
+ * packed into as few full-MTU "phelo" datagrams as possible. The proxy also
+ * answers "find" queries for them. Registering an existing id updates it.
+ * 
+ * @param id        Unique instance ID of the proxied service
+ * @param service   Service type
+ * @param ip        IP address of the service (NULL for our local IP)
+ * @param ctrl_port Control port
+ * @param data_port Data port (0 if none)
+ * @param caps      Capabilities string (can be NULL)
+ * @return 0 on success, -1 on error
+ */
+int pn_proxy_register(const char *id, const char *service, const char *ip,
+                      int ctrl_port, int data_port, const char *caps);
+
+/*
+ * Stop announcing one proxied service (sends a "pbye" for it)
+ * 
+ * @param id  Instance ID passed to pn_proxy_register()
+ * @return 0 on success, -1 if not initialized or not registered
+ */
+int pn_proxy_unregister(const char *id);
+
+/*
+ * Stop proxying
+ * Withdraws every proxied service with a single aggregated "pbye".
+ */
+void pn_proxy_stop(void);
+
+/*
+ * Coalesce registry changes into batch events
+ * The first change opens a window of window_ms; every change seen until it
+ * closes is delivered in one callback, so bursts (e.g. a site power-up)
+ * cost subscribers one rebuild. Independent of the pn_listen() callback.
+ * 
+ * @param callback   Batch callback (NULL to disable)
+ * @param window_ms  Coalescing window in milliseconds
+ * @param userdata   User context passed to callback
+ * @return 0 on success, -1 on error
+ */
+int pn_set_batch_callback(pn_batch_cb callback, int window_ms, void *userdata);
+
+/*
+ * Get listener ingest statistics
+ * The listener drains the socket, classifies each datagram right after
+ * header decode and processes byes, new ids, queries, descriptor changes
+ * and keepalives in that order. Under overload only keepalives are shed.
+ * 
+ * @param out  Receives the counters
+ * @return 0 on success, -1 on error
+ */
+int pn_get_ingest_stats(pn_ingest_stats_t *out);
+
+/*
+ * Cap outbound discovery traffic
+ * Every datagram goes through a token bucket. When the budget runs low,
+ * byes and query answers go first, then queries, announcements and last
+ * heartbeats; a waiting heartbeat is replaced by a newer one rather than
+ * queued twice. Byes are never held back (they borrow against the bucket),
+ * so the cap holds on average over any interval longer than a burst.
+ * 
+ * @param bytes_per_sec  Budget (0 = unlimited, the default)
+ * @param burst_bytes    Bucket depth (at least one full datagram)
+ * @return 0 on success, -1 on error
+ */
+int pn_set_bandwidth(int bytes_per_sec, int burst_bytes);
+
+/*
+ * Get outbound pacer counters
+ * 
+ * @param out  Receives a snapshot
+ * @return 0 on success, -1 if not initialized
+ */
+int pn_get_tx_stats(pn_tx_stats_t *out);
+
+/*
+ * Send a burst of discovery datagrams
+ * For callers that re-send many records at once (e.g. a coordinator
+ * re-broadcasting bridged services). The datagrams go to every broadcast
+ * address or unicast peer, paced like announcements. With UDP offload
+ * each run of equal-size datagrams to one destination leaves in a single
+ * syscall; datagrams up to 64 bytes shorter than the first of a run are
+ * padded with trailing spaces to join it.
+ * 
+ * @param msgs  Complete protocol messages (JSON, at most 1472 bytes each)
+ * @param lens  Length of each message
+ * @param n     Number of messages (at most PN_MAX_BURST)
+ * @return 0 on success, -1 on error
+ */
+int pn_send_burst(const char *const *msgs, const int *lens, int n);
+
+/*
+ * Enable or disable UDP segmentation offload (Linux)
+ * On by default where the kernel supports it: bursts to one destination go
+ * out as one UDP_SEGMENT send, and the listener takes UDP_GRO coalesced
+ * buffers and splits them back into datagrams. Sends fall back to one
+ * datagram per syscall if the kernel refuses.
+ * 
+ * @param enable  true to use GSO/GRO, false for plain datagram I/O
+ * @return 0 on success, -1 if not initialized or unsupported on this platform
+ */
+int pn_set_udp_offload(bool enable);
+
+/*
+ * Advertise client capacity (server side)
+ * Free slots (total - connected - held reservations) go out in every helo,
+ * and in an immediate "cap" message whenever the count changes, so clients
+ * skip a saturated server instead of overloading it.
+ * 
+ * @param total_slots  Clients we can feed (-1 to stop advertising)
+ * @return 0 on success, -1 on error
+ */
+int pn_set_capacity(int total_slots);
+
+/*
+ * Report how many clients are connected (server side)
+ * Each newly connected client uses up the oldest held reservation.
+ * 
+ * @param clients  Currently connected clients
+ * @return 0 on success, -1 on error
+ */
+int pn_capacity_in_use(int clients);
+
+/*
+ * Reserve a slot on a server before connecting (client side)
+ * Unicast reserve/confirm exchange with the server. A granted slot is held
+ * for PN_RESERVE_HOLD_SEC waiting for the connection.
+ * 
+ * @param id          Instance ID of the server
+ * @param timeout_ms  How long to wait for the answer
+ * @param token       Receives the reservation token (can be NULL)
+ * @return 0 if granted, -1 if denied, saturated or no answer
+ */
+int pn_reserve_slot(const char *id, int timeout_ms, uint32_t *token);
+
+/*
+ * Query the network for services
+ * Broadcasts a "find" query carrying a Bloom filter of the (id, incarnation)
+ * pairs already in our registry. Matching peers we already know stay silent;
+ * the others answer with a unicast "helo" that lands in the registry.
+ * 
+ * @param service_type  Service type to find (NULL or "" for all types)
+ * @return 0 on success, -1 on error
+ */
+int pn_query(const char *service_type);
+
+/*
+ * Enable unicast seed-list mode
+ * For networks where broadcast is blocked or expensive (Wi-Fi, client-isolated
+ * APs, cloud VPCs). Announcements and queries go by unicast to the seed peers
+ * plus every peer we hear from; nothing is broadcast.
+ * 
+ * @param enable  true for unicast, false for broadcast (default)
+ * @return 0 on success, -1 on error
+ */
+int pn_set_unicast_mode(bool enable);
+
+/*
+ * Add a seed peer for unicast mode
+ * Seeds are never aged out. Peers learned from traffic expire after
+ * PN_PEER_TIMEOUT_SEC of silence.
+ * 
+ * @param addr  "ip" or "ip:port" (port defaults to the discovery UDP port)
+ * @return 0 on success, -1 on error
+ */
+int pn_add_peer(const char *addr);
+
+/*
+ * Bootstrap the registry from an established peer
+ * Asks one peer for its whole registry by unicast instead of waiting for
+ * every node's next heartbeat. The answer is a burst of packed "snap"
+ * datagrams stamped with the peer's registry generation; records merge by
+ * version like any helo, and normal tracking carries on from there. Asking
+ * the same peer again transfers only entries changed since the generation
+ * last received from it. A peer that has not heard from us before may ask
+ * for a cookie round trip first. Needs pn_listen().
+ * 
+ * @param peer        "ip" or "ip:port", or NULL for the first unicast peer,
+ *                    else the node heard from most recently
+ * @param timeout_ms  How long to wait for the whole transfer
+ * @return Records received, -1 on timeout or if there is no peer to ask
+ */
+int pn_bootstrap(const char *peer, int timeout_ms);
+
+/*
+ * Wait until peers hold our current descriptor
+ * While waiting, our helos ask for an acknowledgement: a listener that holds
+ * our id at the current incarnation answers with a unicast "ack", and a
+ * coordinator says so in its ack. Only acks count: a known-answer filter
+ * in a "find" can match by accident. The helo is resent with backoff from
+ * PN_VISIBLE_RETRY_MS until enough distinct peers have confirmed. Peers
+ * older than this version never ack and are not counted.
+ * Needs pn_announce() and pn_listen().
+ * 
+ * @param min_peers   Distinct peers to wait for (1..PN_VISIBLE_MAX_PEERS), or
+ *                    PN_VISIBLE_COORDINATOR to wait for a coordinator's ack
+ * @param timeout_ms  How long to wait
+ * @return Peers confirmed so far, -1 on timeout or error
+ */
+int pn_announce_wait_visible(int min_peers, int timeout_ms);
+
+/*
+ * Serve the registry to TCP subscribers (coordinator role)
+ * For signal_splitter and signal_relay only. Each session gets the whole
+ * registry as newline-terminated "snap" messages (the last carries "parts"),
+ * then every change as it is committed: a one-record "phelo" for an added
+ * or changed entry, a one-record "pbye" for a removed one. A session that
+ * receives a new snapshot replaces its view. Sessions send nothing; one
+ * that falls PN_COORD_MAX_BACKLOG bytes behind is closed. All sessions are
+ * served by one thread. Linux only.
+ * 
+ * Listens on the address chosen with pn_set_coordinator_addr().
+ * 
+ * @param tcp_port  Port to listen on (0 = PN_DISCOVERY_TCP_PORT)
+ * @return 0 on success, -1 on error
+ */
+int pn_coordinator_open(int tcp_port);
+
+/*
+ * Choose the address the coordinator listens on
+ * Takes effect at the next pn_coordinator_open(). By default it listens on
+ * the first address of the configured broadcast interfaces, or on loopback
+ * when none are configured, so it is not exposed by accident.
+ * 
+ * @param ip  IPv4 address, "0.0.0.0" for every interface, NULL for the default
+ * @return 0 on success, -1 if ip is not an IPv4 address
+ */
+int pn_set_coordinator_addr(const char *ip);
+
+/*
+ * Close every session and stop serving
+ */
+void pn_coordinator_close(void);
+
+/*
+ * Get coordinator counters
+ * 
+ * @param out  Receives a snapshot
+ * @return 0 on success, -1 if the coordinator is not running
+ */
+int pn_get_coord_stats(pn_coord_stats_t *out);
+
+/*
+ * Record registry events to a memory-mapped history file
+ * Adds, changes and removals are appended as fixed records from the registry
+ * commit path (a memory copy, no system call per record). The file is a ring
+ * of max_records, so it never grows; an existing file of the same size is
+ * appended to. Read it with the pn_history tool. Not available on Windows.
+ * 
+ * @param path         History file
+ * @param max_records  Ring capacity (records are 64 bytes)
+ * @return 0 on success, -1 on error
+ */
+int pn_history_open(const char *path, int max_records);
+
+/*
+ * Stop recording and unmap the history file
+ */
+void pn_history_close(void);
+
+/*
+ * Id handle stored in history records (FNV-1a 32 of the full id)
+ */
+uint32_t pn_history_id_handle(const char *id);
+
+/*
+ * Choose what forked children inherit
+ * Fork handlers keep the child's copy of the registry consistent and drop the
+ * parent's threads and socket, so lookups work immediately. SNAPSHOT leaves
+ * the engine stopped (call pn_listen / pn_announce as needed); RESTART also
+ * restarts the listener with the parent's callback in
+ * pn_discovery_after_fork(); ATTACH keeps lookups in sync with the parent's
+ * registry through shared memory, without a listener of its own. Set before
+ * forking. Only SNAPSHOT on Windows.
+ * 
+ * @param mode  PN_FORK_SNAPSHOT, PN_FORK_RESTART or PN_FORK_ATTACH
+ * @return 0 on success, -1 on error
+ */
+int pn_set_fork_mode(int mode);
+
+/*
+ * Finish setting up a forked child
+ * The fork handler only does what is safe in the child of a threaded
+ * process. This opens the child's own socket, releases the parent's
+ * coordinator sessions and mappings and, in RESTART mode, restarts the
+ * listener. pn_listen, pn_announce, pn_proxy_register and pn_query do the
+ * same setup themselves (without the restart) if it has not run yet.
+ * 
+ * @return 0 on success (or not a forked child), -1 on error
+ */
+int pn_discovery_after_fork(void);
+
+/*
+ * Run the engine on one shared thread
+ * By default the announcer, the proxy schedule and the listener each have a
+ * thread of their own. With the shared engine one thread steps both
+ * schedules and waits on the discovery socket until the earliest of them is
+ * due, so a process doing all three costs one thread instead of three.
+ * Timing is unchanged; callbacks run on the engine thread and may start or
+ * stop the announcer and proxied services (not pn_discovery_shutdown), but
+ * a slow callback delays announcements. Set before
+ * pn_announce / pn_proxy_register / pn_listen.
+ * 
+ * @param enable  true for one shared thread, false for a thread per role
+ * @return 0 on success, -1 if not initialized or a role is running
+ */
+int pn_set_shared_engine(bool enable);
+
+/*
+ * Open the local control socket
+ * Serves a line-based command protocol on a Unix-domain stream socket so
+ * scheduling, subscriptions and interface policy can be changed without
+ * restarting the process. Changes apply atomically to the running threads.
+ * Not available on Windows.
+ * 
+ * @param path  Socket path (an existing socket file is replaced)
+ * @return 0 on success, -1 on error
+ */
+int pn_control_open(const char *path);
+
+/*
+ * Close the control socket and remove its file
+ */
+void pn_control_close(void);
+
+/*
+ * Execute one control command in-process
+ * Same commands as the control socket:
+ *   interval <min> <max>   announce interval in seconds (max up to PN_LEASE_MAX_SEC / 3)
+ *   log <0|1|2>            quiet, info, debug
+ *   filter <type,...|*>    accept only these service types
+ *   iface <name,...|*>     broadcast only on these interfaces
+ *   evict <none|lru|priority|relevance> [max]
+ *                          eviction policy and entry budget (pn_set_eviction)
+ *   priority <type> <0-7>  eviction priority of a service type
+ *   budget <bytes/s|0> [burst]
+ *                          transmit budget, 0 = unlimited (pn_set_bandwidth)
+ *   demand <on|off>        demand-driven announcing (pn_set_demand_announce)
+ *   stats                  ingest and registry counters
+ *   dump                   one line per registry entry
+ *   resync                 re-announce now and query everything
+ *   help
+ * The reply ends with "ok" or "error: <reason>".
+ * 
+ * @param cmd     Command line
+ * @param out     Reply buffer (may be NULL)
+ * @param maxlen  Size of reply buffer
+ * @return 0 on success, -1 on error
+ */
+int pn_control_exec(const char *cmd, char *out, int maxlen);
+
+/*
+ * Load pinned static entries
+ * For infrastructure that never moves, so lookups resolve before (or without)
+ * any heartbeat. One entry per line, '#' starts a comment:
+ *   id service ip ctrl_port [data_port [caps]]
+ * Live announcements update pinned entries, but byes and expiry never remove
+ * them. Call after pn_discovery_init().
+ * 
+ * @param path  Config file
+ * @return Number of entries loaded, -1 if the file cannot be read
+ */
+int pn_load_static_services(const char *path);
+
+/*
+ * Choose what gives way when the registry is full
+ * By default a new id is dropped when every slot is taken. With a policy
+ * the newcomer evicts an entry instead: the least recently heard from
+ * (PN_EVICT_LRU), the lowest service-type priority (PN_EVICT_PRIORITY), or
+ * a type the application never subscribed to or looked up
+ * (PN_EVICT_RELEVANCE), least recently heard from first within a class.
+ * A newcomer never evicts an entry of a higher class than its own, and
+ * pinned entries are never evicted. Evictions are reported like byes
+ * (callback with is_bye, batch removal, PN_EVENT_EVICTED in the history)
+ * and counted in the ingest stats.
+ * 
+ * @param policy       PN_EVICT_*
+ * @param max_entries  Registry budget in entries (0 = PN_MAX_SERVICES);
+ *                     lowering it evicts down to the new budget at once
+ * @return 0 on success, -1 on error
+ */
+int pn_set_eviction(int policy, int max_entries);
+
+/*
+ * Announce only as often as someone listens
+ * Listening nodes advertise the types they accept (all, or the configured
+ * filter) on their helos, or in a small "want" when they announce nothing
+ * themselves. With demand mode on, our own service and proxied services
+ * whose types nobody wants fall back to a beacon every PN_BEACON_SEC, and
+ * return to the normal schedule within a couple of seconds when interest
+ * appears. Interest is heard by the listener, so an announcer that does
+ * not call pn_listen() keeps the normal schedule. Beacons ask for a lease
+ * of three beacons, so idle entries are not swept between them. Listeners
+ * send "want" only while they hear announcers in demand mode (or have it
+ * on themselves). Listeners should filter
+ * to the types they use: an unfiltered one wants everything. Off by
+ * default: listeners older than this version send no interest and would
+ * only see the beacon.
+ * 
+ * @param enable  true for demand-driven announcing
+ * @return 0 on success, -1 on error
+ */
+int pn_set_demand_announce(bool enable);
+
+/*
+ * Set the eviction priority of a service type (PN_EVICT_PRIORITY)
+ * Higher priorities are kept longer; unlisted types have PN_PRIORITY_DEFAULT.
+ * 
+ * @param service_type  Service type (e.g., PN_SVC_SDR_SERVER)
+ * @param priority      0 to PN_EVICT_CLASSES - 1
+ * @return 0 on success, -1 on error or if the table is full
+ */
+int pn_set_service_priority(const char *service_type, int priority);
+
 /*
  * Find a discovered service by type
  * Returns first matching active service, or NULL if not found.
+ * Services advertising zero free slots are skipped.
  * 
  * @param service_type  Service type to find (e.g., PN_SVC_SDR_SERVER)
  * @return Pointer to service info (valid until next discovery call), or NULL
  */
 const pn_service_t* pn_find_service(const char *service_type);
 
+/*
+ * Resolve a service type, asking the network if it isn't known yet
+ * Concurrent calls for the same type share one in-flight "find" query.
+ * A miss is cached with exponential backoff (PN_NEG_CACHE_MIN_MS doubling
+ * up to PN_NEG_CACHE_MAX_MS), so tight retry loops return immediately
+ * without touching the wire; a matching helo clears the cached miss.
+ * 
+ * @param service_type  Service type to resolve (e.g., PN_SVC_SDR_SERVER)
+ * @param out           Receives a copy of the service info (can be NULL)
+ * @param timeout_ms    How long to wait for an answer
+ * @return 0 if found, -1 if not found
+ */
+int pn_resolve_service(const char *service_type, pn_service_t *out, int timeout_ms);
+
+/*
+ * Connect to a service type, racing the candidates
+ * Ranks the instances of the type (free slots, connect health, freshness),
+ * resolves each advertised address to its IPv4/IPv6 addresses and starts
+ * non-blocking TCP connects PN_CONNECT_STAGGER_MS apart, alternating address
+ * families; a failed attempt starts the next one at once. The first to
+ * establish wins and the rest are closed. Every finished attempt is recorded
+ * in the instance's health, which also orders pn_find_service().
+ * 
+ * @param service_type  Service type to connect to
+ * @param timeout_ms    Overall deadline
+ * @param chosen        Receives the winning instance (can be NULL)
+ * @return Connected blocking socket (a SOCKET on Windows), or -1
+ */
+int pn_connect_service(const char *service_type, int timeout_ms, pn_service_t *chosen);
+
+/*
+ * Get the connect health recorded for an instance
+ * 
+ * @param id   Instance ID
+ * @param out  Receives the counters
+ * @return 0 on success, -1 if not in the registry
+ */
+int pn_get_health(const char *id, pn_health_t *out);
+
+/*
+ * Note data-plane traffic from an instance
+ * Call from the data path whenever something arrives from a peer: one hash
+ * of the id and one atomic store, no lock. The next lease sweep counts it
+ * like a helo, so a peer we are talking to is never suspected, probed or
+ * expired, however rare its announcements.
+ * 
+ * @param id  Instance ID of the peer
+ */
+void pn_note_alive(const char *id);
+
 /*
  * Find a discovered service by ID
  * 
@@ -128,6 +813,18 @@ const pn_service_t* pn_find_service(const char *service_type);
  */
 const pn_service_t* pn_find_service_by_id(const char *id);
 
+/*
+ * List discovered services whose ID starts with a prefix
+ * Served from a radix tree over IDs (O(prefix + matches), no full scan),
+ * e.g. "KY4OLB-" for everything at station KY4OLB. Results are in ID order.
+ * 
+ * @param prefix    ID prefix ("" lists everything)
+ * @param out       Array to fill with service info
+ * @param max_count Maximum number of services to return
+ * @return Number of services copied to array
+ */
+int pn_find_by_id_prefix(const char *prefix, pn_service_t *out, int max_count);
+
 /*
  * Get all discovered services
  * 
@@ -147,6 +844,8 @@ int pn_get_service_count(void);
 /*
  * Shutdown discovery system
  * Sends "bye" if announcing, stops listener thread, frees resources.
+ * Not from a callback: it would have to join the thread running it, so
+ * it is ignored there.
  */
 void pn_discovery_shutdown(void);
 
@@ -5,11 +5,17 @@
  * License: MIT
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE     /* sendmmsg() */
+#endif
+
 #include "pn_discovery.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
+#include <limits.h>
 
 #ifdef _WIN32
     #define WIN32_LEAN_AND_MEAN
@@ -29,15 +35,28 @@
     #define mutex_lock(m) EnterCriticalSection(m)
     #define mutex_unlock(m) LeaveCriticalSection(m)
     #define mutex_destroy(m) DeleteCriticalSection(m)
+    typedef CONDITION_VARIABLE cond_t;
+    #define cond_init(c) InitializeConditionVariable(c)
+    #define cond_broadcast(c) WakeAllConditionVariable(c)
+    #define cond_destroy(c) ((void)(c))
+    #define atomic_store_u64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+    #define atomic_load_u64(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+    #define atomic_add_u64(p, v) ((uint64_t)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)) + (v))
 #else
     #include <unistd.h>
     #include <sys/socket.h>
     #include <sys/types.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <net/if.h>
+    #include <sys/un.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
     #include <ifaddrs.h>
     #include <pthread.h>
     #include <errno.h>
+    #include <poll.h>
     typedef int socket_t;
     typedef pthread_t thread_t;
     typedef pthread_mutex_t mutex_t;
@@ -48,12 +67,204 @@
     #define mutex_lock(m) pthread_mutex_lock(m)
     #define mutex_unlock(m) pthread_mutex_unlock(m)
     #define mutex_destroy(m) pthread_mutex_destroy(m)
+    typedef pthread_cond_t cond_t;
+    #define cond_init(c) pthread_cond_init(c, NULL)
+    #define cond_broadcast(c) pthread_cond_broadcast(c)
+    #define cond_destroy(c) pthread_cond_destroy(c)
+    #define atomic_store_u64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+    #define atomic_load_u64(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+    #define atomic_add_u64(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#endif
+
+#ifdef __linux__
+    #include <netinet/udp.h>
+    #include <sys/uio.h>
+    #ifndef SOL_UDP
+        #define SOL_UDP     17
+    #endif
+    #ifndef UDP_SEGMENT
+        #define UDP_SEGMENT 103     /* Linux 4.18 */
+    #endif
+    #ifndef UDP_GRO
+        #define UDP_GRO     104     /* Linux 5.0 */
+    #endif
+    #include <netinet/tcp.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#endif
+
+/* Monotonic milliseconds (for timeouts, not timestamps) */
+static uint64_t now_ms(void) {
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Wall-clock Unix milliseconds (for timestamps) */
+static uint64_t wall_ms(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return t / 10000 - 11644473600000ULL;   /* 100 ns since 1601 -> ms since 1970 */
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Wait on a condition variable for at most ms milliseconds */
+static void cond_wait_ms(cond_t *c, mutex_t *m, int ms) {
+#ifdef _WIN32
+    SleepConditionVariableCS(c, m, (DWORD)ms);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(c, m, &ts);
 #endif
+}
 
 /* Protocol constants */
 #define PN_MAGIC        "PNSD"
 #define PN_VERSION      1
-#define PN_MAX_MSG_LEN  1024
+#define PN_MAX_MSG_LEN  1472    /* One full 1500-byte Ethernet MTU datagram */
+
+/* UDP segmentation offload */
+#define GSO_PAD_MAX     64      /* Shortfall a datagram may be padded by to join a run */
+#define GSO_MAX_BYTES   65000   /* Payload of one segmented send */
+#define GRO_BUF_BYTES   65536   /* One coalesced receive */
+
+/* Ingest queue: one pool, a FIFO of slot indices per priority class */
+typedef struct {
+    char buf[PN_MAX_MSG_LEN];
+    int len;
+    struct sockaddr_in sender;
+    bool parsed;                      /* helo: descriptor below decoded by ingest_classify() */
+    pn_service_t helo;
+} ingest_msg_t;
+
+/* Runtime configuration (replaced as a whole under cfg_mutex) */
+#define CFG_IFNAME_LEN  32
+
+typedef struct {
+    int announce_min_sec;
+    int announce_max_sec;
+    int log_level;
+    char filters[PN_MAX_FILTERS][PN_MAX_SERVICE_LEN];  /* Accepted types (none = all) */
+    int n_filters;
+    char ifaces[PN_MAX_IFACES][CFG_IFNAME_LEN];         /* Broadcast interfaces (none = all) */
+    int n_ifaces;
+} config_t;
+
+/*
+ * Hybrid logical clock: wall-clock milliseconds in the high 48 bits, a
+ * logical counter in the low 16. Remote stamps further ahead than this are
+ * compared but not folded into our clock.
+ */
+#define HLC_MAX_DRIFT_MS    60000
+#define TOMB_SLOTS          64      /* Power of two */
+#define TOMB_PROBE          8       /* Bounded probe window */
+
+/* Radix tree node over instance ids (pool in g_discovery.radix_nodes) */
+#define RADIX_NODES     (PN_MAX_SERVICES * 2 + 1)
+#define RADIX_NONE      (-1)
+
+typedef struct {
+    char label[PN_MAX_ID_LEN];        /* Edge label from parent */
+    int len;
+    int slot;                         /* Registry slot, RADIX_NONE if inner */
+    int child;                        /* First child */
+    int next;                         /* Next sibling */
+} radix_node_t;
+
+/* Registry image shared with forked children (PN_FORK_ATTACH) */
+typedef struct {
+    volatile uint32_t seq;            /* Seqlock: odd while a slot is being written */
+    pn_service_t services[PN_MAX_SERVICES];
+} shared_registry_t;
+
+/* Outbound pacer queue entry */
+typedef struct {
+    int cls;                          /* PN_TX_* */
+    int key;                          /* Merge key (0 = never merged) */
+    bool unicast;
+    struct sockaddr_in dest;          /* Unicast destination */
+    uint64_t queued;                  /* now_ms() when deferred */
+    uint32_t seq;
+    int len;
+    char buf[PN_MAX_MSG_LEN];
+    bool used;
+} tx_msg_t;
+
+/* Pacer merge keys: a newer datagram replaces a queued one with the same key */
+#define TX_KEY_HELO         1
+#define TX_KEY_CAP          2
+#define TX_KEY_WANT         3
+#define TX_KEY_RSV          32      /* + reservation slot (retries of one request) */
+#define TX_KEY_PROXY        64      /* + datagram index within a proxy round */
+
+/* Registry transfers: answers per second per source, room for the "snap" trailer */
+#define SYNC_PER_SEC        4
+#define SYNC_SOURCES        16      /* Sources whose answer rate is tracked */
+#define SYNC_AMPLIFY        3       /* Answer-to-request size cap for unverified sources */
+#define SNAP_TRAILER_LEN    32
+#define SNAP_MAX_PARTS      64      /* Bits in the requester's part mask */
+#define BOOT_NONCES         4       /* Recent "sync" nonces whose answers we accept */
+
+/* Interest mask: one bit per type-name hash, "im" in helo/want as hex */
+#define INTEREST_BITS       64
+
+/* pn_note_alive() hints: (id handle << 32 | unix second), indexed by handle */
+#define ALIVE_SLOTS         256     /* Power of two */
+
+/* Service types remembered as asked for (PN_EVICT_RELEVANCE) */
+#define EVICT_WANTED        16
+
+/* Client reservation states */
+#define RSV_PENDING     0
+#define RSV_GRANTED     1
+#define RSV_DENIED      2
+
+/* Batch change kinds */
+#define BATCH_ADDED     0
+#define BATCH_UPDATED   1
+#define BATCH_REMOVED   2
+
+/* TCP coordinator: changes queued at commit for the serving thread */
+#define COORD_ADD           0
+#define COORD_REMOVE        1
+
+#ifdef __linux__
+#define COORD_EVENTS        256
+#define COORD_EPOLL_BATCH   64
+
+typedef struct {
+    int kind;                         /* COORD_ADD / COORD_REMOVE */
+    uint32_t gen;                     /* registry_gen the change committed at */
+    pn_service_t d;
+} coord_event_t;
+
+/* One subscriber (coordinator thread only) */
+typedef struct coord_session {
+    int fd;
+    uint32_t since;                   /* Generation its last snapshot reached */
+    char *out;                        /* Unsent bytes, NULL when caught up */
+    int out_off, out_len, out_cap;
+    bool want_write;                  /* EPOLLOUT armed */
+    struct coord_session *prev, *next;
+} coord_session_t;
+#endif
 
 /* Global state */
 static struct {
@@ -65,40 +276,324 @@ static struct {
     bool announcing;
     pn_service_t my_service;
     thread_t announce_thread;
-    bool announce_running;
+    volatile bool announce_running;
     
     /* Reactive re-announce (when we see new services) */
     volatile bool reannounce_pending;
     volatile int reannounce_delay_sec;
     
+    /* Private random stream (see rng_next) */
+    volatile uint64_t rng_state;
+    
+    /* Demand-driven announcing: who on the segment wants which types */
+    bool demand;
+    uint32_t interest_seen[INTEREST_BITS]; /* Unix second each bit was last advertised */
+    uint32_t interest_sent;           /* Last "want" we sent */
+    uint32_t interest_tag;            /* Recognizes our own "want" looping back */
+    uint32_t demand_heard;            /* Last helo from an announcer in demand mode */
+    volatile bool announce_idle;      /* Own service on the slow beacon */
+    volatile bool proxy_idle;         /* Proxied services on the slow beacon */
+    
+    /* Proxy: services we announce on behalf of others */
+    bool proxying;
+    pn_service_t proxied[PN_MAX_PROXIED];
+    mutex_t proxy_mutex;
+    thread_t proxy_thread;
+    volatile bool proxy_running;
+    volatile bool proxy_dirty;        /* Registrations waiting for next tick */
+    
+    /* Coalesced resolution with negative caching */
+    struct {
+        char service[PN_MAX_SERVICE_LEN];
+        bool in_flight;               /* One query on the wire for this type */
+        bool answered;                /* A matching helo arrived */
+        int waiters;
+        int backoff_ms;               /* Current negative-cache backoff */
+        uint64_t neg_until;           /* now_ms() until which misses are cached */
+        uint64_t last_used;
+    } resolve[PN_MAX_RESOLVE];
+    mutex_t resolve_mutex;
+    cond_t resolve_cond;
+    
+    /* Coalesced registry change events */
+    pn_batch_cb batch_callback;
+    void *batch_userdata;
+    int batch_window_ms;
+    volatile uint64_t batch_deadline; /* 0 when nothing is pending */
+    pn_service_t batch_added[PN_MAX_SERVICES];
+    pn_service_t batch_updated[PN_MAX_SERVICES];
+    pn_service_t batch_removed[PN_MAX_SERVICES];
+    int batch_n_added, batch_n_updated, batch_n_removed;
+    mutex_t batch_mutex;
+    
+    /* Prioritized ingest (listener thread only, stats under stats_mutex) */
+    ingest_msg_t ingest_pool[PN_INGEST_SLOTS];
+    ingest_msg_t ingest_spare;        /* Reads while the pool is full */
+    int ingest_free[PN_INGEST_SLOTS];
+    int ingest_n_free;
+    int ingest_queue[PN_INGEST_CLASSES][PN_INGEST_SLOTS];
+    int ingest_head[PN_INGEST_CLASSES];
+    int ingest_count[PN_INGEST_CLASSES];
+    pn_ingest_stats_t ingest_stats;
+    mutex_t stats_mutex;
+    
+    /* UDP offload: GSO flag and counters (under tx_mutex), GRO buffer being split (listener) */
+    bool offload;                     /* Wanted (pn_set_udp_offload) */
+    bool udp_gso;                     /* Cleared if the kernel refuses */
+    volatile bool udp_gro;            /* Socket delivers coalesced buffers */
+#ifdef __linux__
+    char gro_buf[GRO_BUF_BYTES];
+    int gro_len, gro_off, gro_seg;
+    struct sockaddr_in gro_sender;
+#endif
+    
+    /* Capacity we advertise (server side) */
+    int capacity_total;               /* -1 if not advertised */
+    int capacity_in_use;              /* Clients the application reports */
+    int capacity_last_sent;           /* Last remaining count announced */
+    struct {
+        uint32_t token;
+        uint64_t expires;             /* now_ms() at which an unused hold lapses */
+        struct sockaddr_in client;    /* Requester and its nonce: retries reuse the hold */
+        uint32_t nonce;
+        bool active;
+    } holds[PN_MAX_RESERVATIONS];
+    uint32_t next_token;
+    mutex_t capacity_mutex;
+    
+    /* Registry transfer we requested (under boot_mutex) */
+    struct {
+        uint32_t nonces[BOOT_NONCES]; /* A fresh one per "sync" sent */
+        int sent;
+        bool pinned;                  /* Assembling one answer: */
+        uint32_t answer;              /* ...its nonce */
+        uint64_t gen;                 /* ...and the epoch and generation it carries */
+        uint64_t parts_seen;          /* Bit per part received */
+        int parts;                    /* Total, once the last part arrived (0 = unknown) */
+        int received;                 /* Records merged */
+        bool progress;                /* A part of it arrived since the last look */
+        uint64_t cookie;              /* From the peer's "synck", echoed as "ck" */
+        bool done;
+        bool active;
+    } boot;
+    struct sockaddr_in boot_peer;     /* Peer of the last completed transfer */
+    uint64_t boot_gen;                /* ...the generation it reached */
+    uint64_t boot_cookie;             /* ...and the cookie it gave us */
+    mutex_t boot_mutex;
+    cond_t boot_cond;
+    
+    /* Peers confirmed to hold our descriptor (under vis_mutex) */
+    struct {
+        uint32_t incarnation;         /* Incarnation being confirmed */
+        struct sockaddr_in peers[PN_VISIBLE_MAX_PEERS];
+        int n_peers;
+        bool coordinator;             /* A coordinator acked */
+        bool active;                  /* pn_announce_wait_visible() is waiting */
+    } vis;
+    mutex_t vis_mutex;
+    cond_t vis_cond;
+    
+    /* Registry transfers we answer (listener thread only) */
+    struct {
+        struct sockaddr_in addr;
+        uint32_t window;              /* Unix second being counted */
+        int answered;
+    } sync_srcs[SYNC_SOURCES];
+    uint64_t sync_secret;             /* Keys the "synck" cookies */
+    
+    /* Leases: data-plane hints, swept once a second by the listener */
+    volatile uint64_t alive_hints[ALIVE_SLOTS];
+    uint32_t lease_swept;             /* Unix second of the last sweep */
+    
+    /* Our outstanding reserve requests (client side) */
+    struct {
+        uint32_t nonce;
+        int state;                    /* RSV_PENDING / RSV_GRANTED / RSV_DENIED */
+        uint32_t token;
+        bool active;
+    } reserve[PN_MAX_RESERVATIONS];
+    mutex_t reserve_mutex;
+    cond_t reserve_cond;
+    
     /* Listening */
     bool listening;
     pn_service_cb callback;
     void *callback_userdata;
     thread_t listen_thread;
-    bool listen_running;
+    volatile bool listen_running;
+    
+    /* Announce and proxy schedules, stepped by their threads or the engine thread */
+    struct {
+        bool started;                 /* First announcement sent */
+        int gen;                      /* sched_gen the interval was computed for */
+        uint64_t last;                /* now_ms() of the last send */
+        uint64_t due;                 /* ...of the next one (0 = not computed) */
+        uint64_t chore;               /* ...of the next once-a-second chores */
+    } ann, prx;
+    
+    /* Shared engine: one thread runs every role (see pn_set_shared_engine) */
+    bool shared_engine;
+    thread_t engine_thread;
+    volatile bool engine_running;
+    mutex_t engine_mutex;             /* Held while stepping schedules */
+    cond_t engine_cond;
     
     /* Service registry */
     pn_service_t services[PN_MAX_SERVICES];
     mutex_t services_mutex;
     
+    /* Per-slot bookkeeping that is not part of the public descriptor */
+    struct {
+        struct sockaddr_in src;       /* Discovery socket the entry was heard from */
+        int lru_prev, lru_next;       /* Eviction list links (-1 = end) */
+        int lru_class;                /* Eviction class, -1 if not evictable */
+        uint32_t gen;                 /* registry_gen of the last change */
+        pn_health_t health;           /* Connect outcomes (pn_connect_service) */
+    } svc_meta[PN_MAX_SERVICES];
+    uint32_t registry_gen;            /* Bumped on every registry change */
+    uint32_t registry_epoch;          /* Random per run: high half of transfer generations */
+    
+    /* Id index: radix tree, node 0 is the root (under services_mutex) */
+    radix_node_t radix_nodes[RADIX_NODES];
+    int radix_free_list;
+    
+    /* Eviction when full (under services_mutex) */
+    int evict_policy;                 /* PN_EVICT_* */
+    int evict_limit;                  /* Entry budget, 0 = PN_MAX_SERVICES */
+    int lru_head[PN_EVICT_CLASSES];   /* Least recently heard from per class */
+    int lru_tail[PN_EVICT_CLASSES];
+    struct {
+        char service[PN_MAX_SERVICE_LEN];
+        int priority;
+    } priorities[PN_MAX_PRIORITIES];
+    int n_priorities;
+    char wanted[EVICT_WANTED][PN_MAX_SERVICE_LEN];  /* Types the application asked for */
+    int wanted_next;
+    
+    /* Unicast peers (seeds and peers learned from traffic) */
+    bool unicast_mode;
+    struct {
+        struct sockaddr_in addr;
+        uint32_t last_heard;          /* 0 if never heard from */
+        bool seed;
+        bool active;
+    } peers[PN_MAX_PEERS];
+    mutex_t peers_mutex;
+    
+    /* TCP coordinator: the queue is filled under services_mutex, sessions under coord_mutex */
+    bool coordinating;
+#ifdef __linux__
+    coord_event_t coord_events[COORD_EVENTS];
+    int coord_head, coord_count;
+    bool coord_lost;                  /* Queue overflowed: sessions need a new snapshot */
+    bool coord_kick;                  /* Queued since the last wake-up (signalled unlocked) */
+    struct in_addr coord_addr;        /* Listen address set by pn_set_coordinator_addr() */
+    bool coord_addr_set;
+    int coord_sock, coord_epoll, coord_wake;
+    coord_session_t *coord_sessions;
+    pn_coord_stats_t coord_counts;    /* Serving thread's running counters */
+    pn_coord_stats_t coord_stats;     /* Last published copy (under stats_mutex) */
+    mutex_t coord_mutex;
+    pthread_t coord_thread;
+    volatile bool coord_running;
+#endif
+    
+    /* Runtime configuration and control socket */
+    config_t cfg;
+    mutex_t cfg_mutex;
+    volatile int sched_gen;           /* Bumped when intervals change */
+    socket_t control_sock;
+    char control_path[108];
+    thread_t control_thread;
+    volatile bool control_running;
+    bool controlling;
+    
+    /* Outbound pacer (token bucket, under tx_mutex) */
+    int tx_rate;                      /* Bytes per second, 0 = unlimited */
+    int tx_burst;
+    double tx_tokens;
+    uint64_t tx_refilled;             /* now_ms() of the last refill */
+    uint64_t tx_due;                  /* now_ms() the first held datagram can go, 0 = none */
+    tx_msg_t txq[PN_TX_QUEUE];
+    uint32_t tx_seq;
+    pn_tx_stats_t tx_stats;
+    mutex_t tx_mutex;
+    cond_t tx_cond;                   /* Signalled when tx_due moves earlier */
+    
+    /* Hybrid logical clock stamping our descriptor versions */
+    uint64_t hlc_last;
+    mutex_t hlc_mutex;
+    
+    /* Bye tombstones: versions a late helo must beat (under services_mutex) */
+    struct {
+        char id[PN_MAX_ID_LEN];
+        uint32_t incarnation;
+        uint64_t hlc;
+        uint32_t expires;             /* Unix time the tombstone lapses */
+    } tombs[TOMB_SLOTS];
+    
+    /* Event history (appended under services_mutex) */
+    pn_history_header_t *history;
+    size_t history_len;
+    
+    /* Fork handling */
+    int fork_mode;                    /* PN_FORK_* */
+    shared_registry_t *shared;        /* MAP_SHARED image (attach mode) */
+    bool attached;                    /* Child mirroring the parent's registry */
+    uint32_t shared_seen;             /* Last seq copied in (attached child) */
+    
+    /* Forked child: work the fork handler may not do, left for fork_settle() */
+    bool forked;
+    bool fork_restart;                /* PN_FORK_RESTART and the parent was listening */
+    pn_history_header_t *fork_history;    /* Parent's mappings to drop */
+    shared_registry_t *fork_shared;
+#ifdef __linux__
+    coord_session_t *fork_sessions;   /* Parent's session copies to free */
+#endif
+    
     /* Local IP */
     char local_ip[PN_MAX_IP_LEN];
 } g_discovery = {0};
 
+/* Logging, gated by the runtime log level */
+#define log_info(...) \
+    do { if (g_discovery.cfg.log_level >= PN_LOG_INFO) printf(__VA_ARGS__); } while (0)
+#define log_debug(...) \
+    do { if (g_discovery.cfg.log_level >= PN_LOG_DEBUG) printf(__VA_ARGS__); } while (0)
+
 /* Forward declarations */
 static int build_helo_message(char *buf, int maxlen);
 static int build_bye_message(char *buf, int maxlen);
-static int parse_message(const char *buf, int len, const char *sender_ip);
-static void broadcast_message(const char *msg, int len);
-static int get_random_interval(void);
+static int build_find_message(char *buf, int maxlen, const char *svc);
+static int build_proxy_helo_message(char *buf, int maxlen, const pn_service_t *svcs,
+                                    int count, int *next);
+static int parse_message(const char *buf, int len, const struct sockaddr_in *sender,
+                         const pn_service_t *helo);
+static int send_discovery(const char *msg, int len);
+static uint64_t rng_next(void);
 static int get_reannounce_delay(void);
+static uint32_t lease_request(bool idle);
+static void batch_record(int kind, const pn_service_t *d);
+static void radix_reset(void);
+static void lru_reset(void);
+static void shared_publish(int idx);
+static void history_append(int type, uint16_t changed, int idx);
+static void coord_record(int kind, const pn_service_t *d);
+static void coord_local(int kind, const pn_service_t *d);
+static void services_unlock(void);
+static int capacity_remaining(void);
 #ifdef _WIN32
+typedef DWORD (WINAPI *thread_fn_t)(LPVOID);
 static DWORD WINAPI announce_thread_func(LPVOID param);
 static DWORD WINAPI listen_thread_func(LPVOID param);
+static DWORD WINAPI proxy_thread_func(LPVOID param);
+static DWORD WINAPI engine_thread_func(LPVOID param);
 #else
+typedef void* (*thread_fn_t)(void*);
 static void* announce_thread_func(void *param);
 static void* listen_thread_func(void *param);
+static void* proxy_thread_func(void *param);
+static void* engine_thread_func(void *param);
 #endif
 
 /* Simple JSON helpers (no external dependency) */
@@ -112,6 +607,12 @@ static int json_add_int(char *buf, int pos, int maxlen, const char *key, int val
     return (n > 0 && pos + n < maxlen) ? pos + n : -1;
 }
 
+static int json_add_u64(char *buf, int pos, int maxlen, const char *key, uint64_t val, bool comma) {
+    int n = snprintf(buf + pos, maxlen - pos, "%s\"%s\":%llu", comma ? "," : "", key,
+                     (unsigned long long)val);
+    return (n > 0 && pos + n < maxlen) ? pos + n : -1;
+}
+
 static const char* json_get_string(const char *json, const char *key, char *out, int maxlen) {
     char search[128];
     snprintf(search, sizeof(search), "\"%s\":\"", key);
@@ -136,73 +637,384 @@ static int json_get_int(const char *json, const char *key) {
     return atoi(start);
 }
 
-/* Initialize discovery system */
-int pn_discovery_init(int udp_port) {
-    if (g_discovery.initialized) {
-        return 0;  /* Already initialized */
-    }
-    
-    memset(&g_discovery, 0, sizeof(g_discovery));
-    g_discovery.udp_port = (udp_port > 0) ? udp_port : PN_DISCOVERY_UDP_PORT;
-    
-#ifdef _WIN32
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        fprintf(stderr, "pn_discovery: WSAStartup failed\n");
-        return -1;
-    }
-#endif
-    
-    /* Create UDP socket */
-    g_discovery.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (g_discovery.sock == INVALID_SOCK) {
+static uint64_t json_get_u64(const char *json, const char *key) {
+    char search[128];
+    snprintf(search, sizeof(search), "\"%s\":", key);
+    const char *start = strstr(json, search);
+    if (!start) return 0;
+    return (uint64_t)strtoull(start + strlen(search), NULL, 10);
+}
+
+static int json_get_int_def(const char *json, const char *key, int def) {
+    char search[128];
+    snprintf(search, sizeof(search), "\"%s\":", key);
+    const char *start = strstr(json, search);
+    if (!start) return def;
+    return atoi(start + strlen(search));
+}
+
+/* Create the discovery UDP socket, bound to port (0 for ephemeral) */
+static socket_t open_discovery_socket(int port) {
+    socket_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCK) {
         fprintf(stderr, "pn_discovery: socket() failed\n");
-        return -1;
+        return INVALID_SOCK;
     }
     
     /* Enable broadcast */
     int broadcast = 1;
-    if (setsockopt(g_discovery.sock, SOL_SOCKET, SO_BROADCAST, 
+    if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, 
                    (const char*)&broadcast, sizeof(broadcast)) < 0) {
         fprintf(stderr, "pn_discovery: setsockopt(SO_BROADCAST) failed\n");
-        close_socket(g_discovery.sock);
-        return -1;
+        close_socket(sock);
+        return INVALID_SOCK;
     }
     
     /* Enable address reuse */
     int reuse = 1;
-    setsockopt(g_discovery.sock, SOL_SOCKET, SO_REUSEADDR, 
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 
                (const char*)&reuse, sizeof(reuse));
     
+    /* Deep receive buffer so bursts wait for the ingest classifier */
+    int rcvbuf = PN_RECV_BUFFER_BYTES;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+               (const char*)&rcvbuf, sizeof(rcvbuf));
+    
+#ifdef __linux__
+    /* Take a burst from one sender as one coalesced buffer */
+    int gro = 1;
+    g_discovery.udp_gro = g_discovery.offload &&
+        setsockopt(sock, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) == 0;
+#endif
+    
     /* Bind to port */
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(g_discovery.udp_port);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = INADDR_ANY;
     
-    if (bind(g_discovery.sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "pn_discovery: bind() failed on port %d\n", g_discovery.udp_port);
-        close_socket(g_discovery.sock);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "pn_discovery: bind() failed on port %d\n", port);
+        close_socket(sock);
+        return INVALID_SOCK;
+    }
+    
+    return sock;
+}
+
+/*
+ * Every mutex, in lock order: a thread holding one may only take those
+ * after it. The coordinator and engine threads hold theirs across registry,
+ * proxy and pacer work; the pacer reads the peer list and config; the rest
+ * are never held while taking another.
+ */
+static mutex_t *const all_mutexes[] = {
+#ifdef __linux__
+    &g_discovery.coord_mutex,
+#endif
+    &g_discovery.engine_mutex,
+    &g_discovery.proxy_mutex,
+    &g_discovery.services_mutex,
+    &g_discovery.tx_mutex,
+    &g_discovery.peers_mutex,
+    &g_discovery.cfg_mutex,
+    &g_discovery.hlc_mutex,
+    &g_discovery.capacity_mutex,
+    &g_discovery.stats_mutex,
+    &g_discovery.batch_mutex,
+    &g_discovery.resolve_mutex,
+    &g_discovery.reserve_mutex,
+    &g_discovery.boot_mutex,
+    &g_discovery.vis_mutex,
+};
+#define N_MUTEXES   ((int)(sizeof(all_mutexes) / sizeof(all_mutexes[0])))
+
+/* Create every condition variable */
+static void init_conds(void) {
+    cond_init(&g_discovery.resolve_cond);
+    cond_init(&g_discovery.reserve_cond);
+    cond_init(&g_discovery.boot_cond);
+    cond_init(&g_discovery.engine_cond);
+    cond_init(&g_discovery.vis_cond);
+    cond_init(&g_discovery.tx_cond);
+}
+
+/* Create every mutex and condition variable */
+static void init_locks(void) {
+    for (int i = 0; i < N_MUTEXES; i++) {
+        mutex_init(all_mutexes[i]);
+    }
+    init_conds();
+}
+
+#ifndef _WIN32
+/*
+ * Fork handling. prepare takes every lock in lock order so no other thread
+ * is inside the library at the fork and the child's copy-on-write image is
+ * consistent. The child starts with only the forking thread, which owns
+ * those locks and releases them; waits on the condition variables died with
+ * the parent's threads, so those are created afresh. The child handler only
+ * resets state and closes descriptors: the new socket, unmapping and freeing
+ * wait for fork_settle(), run by pn_discovery_after_fork() or the next
+ * pn_listen / pn_announce / pn_proxy_register / pn_query.
+ */
+static void fork_prepare(void) {
+    if (!g_discovery.initialized) return;
+    for (int i = 0; i < N_MUTEXES; i++) {
+        mutex_lock(all_mutexes[i]);
+    }
+}
+
+static void fork_parent(void) {
+    if (!g_discovery.initialized) return;
+    for (int i = N_MUTEXES - 1; i >= 0; i--) {
+        mutex_unlock(all_mutexes[i]);
+    }
+}
+
+static void fork_child(void) {
+    if (!g_discovery.initialized) return;
+    
+    for (int i = N_MUTEXES - 1; i >= 0; i--) {
+        mutex_unlock(all_mutexes[i]);
+    }
+    init_conds();
+    
+    /* The parent's threads did not come along */
+    bool was_listening = g_discovery.listening;
+    g_discovery.announcing = false;
+    g_discovery.announce_running = false;
+    g_discovery.reannounce_pending = false;
+    g_discovery.proxying = false;
+    g_discovery.proxy_running = false;
+    g_discovery.proxy_dirty = false;
+    memset(g_discovery.proxied, 0, sizeof(g_discovery.proxied));
+    g_discovery.listening = false;
+    g_discovery.listen_running = false;
+    g_discovery.engine_running = false;
+    if (g_discovery.controlling) {
+        close(g_discovery.control_sock);   /* The parent still owns the path */
+        g_discovery.control_sock = INVALID_SOCK;
+        g_discovery.controlling = false;
+        g_discovery.control_running = false;
+    }
+#ifdef __linux__
+    if (g_discovery.coordinating) {
+        /* Sessions stay with the parent: drop our copies so its closes take effect */
+        for (coord_session_t *s = g_discovery.coord_sessions; s; s = s->next) {
+            close(s->fd);
+        }
+        g_discovery.fork_sessions = g_discovery.coord_sessions;
+        g_discovery.coord_sessions = NULL;
+        close(g_discovery.coord_sock);
+        close(g_discovery.coord_epoll);
+        g_discovery.coord_count = 0;
+        g_discovery.coordinating = false;
+        g_discovery.coord_running = false;
+    }
+#endif
+    
+    /* Per-process state that belongs to the parent */
+    g_discovery.rng_state ^= (uint64_t)getpid() << 32;
+    g_discovery.registry_epoch = (uint32_t)rng_next();   /* Our generations diverge from here */
+    memset(g_discovery.resolve, 0, sizeof(g_discovery.resolve));
+    memset(&g_discovery.vis, 0, sizeof(g_discovery.vis));
+    g_discovery.batch_deadline = 0;
+    g_discovery.batch_n_added = g_discovery.batch_n_updated = g_discovery.batch_n_removed = 0;
+    memset(g_discovery.holds, 0, sizeof(g_discovery.holds));
+    memset(g_discovery.reserve, 0, sizeof(g_discovery.reserve));
+    g_discovery.capacity_total = -1;
+    g_discovery.capacity_in_use = 0;
+    g_discovery.capacity_last_sent = -1;
+    memset(&g_discovery.ingest_stats, 0, sizeof(g_discovery.ingest_stats));
+    
+    /* The parent's socket: ours comes from fork_settle() */
+    close_socket(g_discovery.sock);
+    g_discovery.sock = INVALID_SOCK;
+    g_discovery.fork_restart = (g_discovery.fork_mode == PN_FORK_RESTART && was_listening);
+    
+    /* The parent keeps writing the history; never interleave with it */
+    g_discovery.fork_history = g_discovery.history;
+    g_discovery.history = NULL;
+    
+    if (g_discovery.fork_mode == PN_FORK_ATTACH && g_discovery.shared) {
+        g_discovery.attached = true;
+        g_discovery.shared_seen = g_discovery.shared->seq;
+    } else {
+        g_discovery.fork_shared = g_discovery.shared;
+        g_discovery.shared = NULL;
+    }
+    
+    g_discovery.forked = true;
+}
+
+/* Install the fork handlers once per process */
+static void fork_register(void) {
+    static bool registered = false;
+    if (registered) return;
+    if (pthread_atfork(fork_prepare, fork_parent, fork_child) == 0) {
+        registered = true;
+    }
+}
+#endif
+
+/* Free the parent's coordinator sessions and drop its mappings (forked child) */
+static void fork_release(void) {
+#ifdef __linux__
+    while (g_discovery.fork_sessions) {
+        coord_session_t *s = g_discovery.fork_sessions;
+        g_discovery.fork_sessions = s->next;
+        free(s->out);
+        free(s);
+    }
+#endif
+#ifndef _WIN32
+    if (g_discovery.fork_history) {
+        munmap(g_discovery.fork_history, g_discovery.history_len);
+        g_discovery.fork_history = NULL;
+    }
+    if (g_discovery.fork_shared) {
+        munmap(g_discovery.fork_shared, sizeof(*g_discovery.fork_shared));
+        g_discovery.fork_shared = NULL;
+    }
+#endif
+}
+
+/*
+ * Finish what the fork handler left in a child: release the parent's
+ * resources and open our own socket. Unicast to a shared port reaches only
+ * one of the sockets bound to it, so only a listener to be restarted in
+ * broadcast mode (where every socket gets a copy) takes the discovery port;
+ * the rest use an ephemeral port and never steal the parent's datagrams.
+ */
+static int fork_settle(void) {
+    if (!g_discovery.forked) return 0;
+    g_discovery.forked = false;
+    
+    fork_release();
+    g_discovery.sock = open_discovery_socket(
+        (g_discovery.fork_restart && !g_discovery.unicast_mode) ? g_discovery.udp_port : 0);
+    return (g_discovery.sock == INVALID_SOCK) ? -1 : 0;
+}
+
+/* Initialize discovery system */
+int pn_discovery_init(int udp_port) {
+    if (g_discovery.initialized) {
+        return 0;  /* Already initialized */
+    }
+    
+    memset(&g_discovery, 0, sizeof(g_discovery));
+    g_discovery.udp_port = (udp_port > 0) ? udp_port : PN_DISCOVERY_UDP_PORT;
+    g_discovery.cfg.announce_min_sec = PN_ANNOUNCE_MIN_SEC;
+    g_discovery.cfg.announce_max_sec = PN_ANNOUNCE_MAX_SEC;
+    g_discovery.cfg.log_level = PN_LOG_INFO;
+    g_discovery.control_sock = INVALID_SOCK;
+#ifdef __linux__
+    g_discovery.offload = true;
+    g_discovery.udp_gso = true;
+    
+    /* Lives as long as the library, so a commit may signal it after unlocking */
+    g_discovery.coord_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+    
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        fprintf(stderr, "pn_discovery: WSAStartup failed\n");
+        return -1;
+    }
+#endif
+    
+    /* Create and bind the UDP socket */
+    g_discovery.sock = open_discovery_socket(g_discovery.udp_port);
+    if (g_discovery.sock == INVALID_SOCK) {
         return -1;
     }
     
     /* Get local IP */
     pn_get_local_ip(g_discovery.local_ip, sizeof(g_discovery.local_ip));
     
-    /* Initialize mutex */
-    mutex_init(&g_discovery.services_mutex);
+    /* Empty id index and eviction lists */
+    radix_reset();
+    lru_reset();
+    
+    /* Initialize mutexes */
+    init_locks();
+#ifndef _WIN32
+    fork_register();
+#endif
+    g_discovery.capacity_total = -1;
+    g_discovery.capacity_last_sent = -1;
     
-    /* Seed random for announce intervals */
-    srand((unsigned int)time(NULL));
+    /* Private random stream: differs per host, port and start time */
+    g_discovery.rng_state = wall_ms() ^ ((uint64_t)g_discovery.udp_port << 48) ^
+                            ((uint64_t)pn_history_id_handle(g_discovery.local_ip) << 16);
+    g_discovery.interest_tag = (uint32_t)rng_next();
+    g_discovery.registry_epoch = (uint32_t)rng_next();
+    g_discovery.sync_secret = rng_next();
     
     g_discovery.initialized = true;
-    printf("pn_discovery: initialized on port %d, local IP %s\n", 
-           g_discovery.udp_port, g_discovery.local_ip);
+    log_info("pn_discovery: initialized on port %d, local IP %s\n", 
+             g_discovery.udp_port, g_discovery.local_ip);
     
     return 0;
 }
 
+/* Stamp a new descriptor version */
+static uint64_t hlc_now(void) {
+    uint64_t pt = wall_ms() << 16;
+    mutex_lock(&g_discovery.hlc_mutex);
+    uint64_t t = (pt > g_discovery.hlc_last) ? pt : g_discovery.hlc_last + 1;
+    g_discovery.hlc_last = t;
+    mutex_unlock(&g_discovery.hlc_mutex);
+    return t;
+}
+
+/* Fold a received stamp into our clock so our next version orders after it */
+static void hlc_observe(uint64_t remote) {
+    if (remote == 0) return;
+    if ((remote >> 16) > wall_ms() + HLC_MAX_DRIFT_MS) return;
+    mutex_lock(&g_discovery.hlc_mutex);
+    if (remote > g_discovery.hlc_last) g_discovery.hlc_last = remote;
+    mutex_unlock(&g_discovery.hlc_mutex);
+}
+
+/* Interest bit of a service type */
+static int interest_bit(const char *service) {
+    return (int)(pn_history_id_handle(service) % INTEREST_BITS);
+}
+
+/* Types we would accept as a mask: all if unfiltered, none if not listening */
+static uint64_t interest_mask(void) {
+    if (!g_discovery.listening) return 0;
+    
+    uint64_t mask = 0;
+    mutex_lock(&g_discovery.cfg_mutex);
+    if (g_discovery.cfg.n_filters == 0) mask = ~0ULL;
+    for (int i = 0; i < g_discovery.cfg.n_filters; i++) {
+        mask |= 1ULL << interest_bit(g_discovery.cfg.filters[i]);
+    }
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return mask;
+}
+
+/* Append our interest ("im") to a message being built, if we listen */
+static int interest_add(char *buf, int pos, int maxlen) {
+    uint64_t mask = interest_mask();
+    if (mask == 0) return pos;
+    
+    char hex[INTEREST_BITS / 4 + 1];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)mask);
+    return json_add_string(buf, pos, maxlen, "im", hex, true);
+}
+
+/* Has a listener advertised interest in this type lately? */
+static bool interest_wanted(const char *service) {
+    uint32_t seen = g_discovery.interest_seen[interest_bit(service)];
+    return seen != 0 && (uint32_t)time(NULL) - seen < PN_INTEREST_TTL_SEC;
+}
+
 /* Build "helo" JSON message */
 static int build_helo_message(char *buf, int maxlen) {
     int pos = 0;
@@ -239,6 +1051,39 @@ static int build_helo_message(char *buf, int maxlen) {
         if (pos < 0) return -1;
     }
     
+    pos = json_add_int(buf, pos, maxlen, "inc", (int)g_discovery.my_service.incarnation, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_u64(buf, pos, maxlen, "hlc", hlc_now(), true);
+    if (pos < 0) return -1;
+    
+    int slots = capacity_remaining();
+    if (slots >= 0) {
+        pos = json_add_int(buf, pos, maxlen, "slots", slots, true);
+        if (pos < 0) return -1;
+    }
+    
+    uint32_t lease = lease_request(g_discovery.announce_idle);
+    if (lease > 0) {
+        pos = json_add_int(buf, pos, maxlen, "ls", (int)lease, true);
+        if (pos < 0) return -1;
+    }
+    
+    /* Tells listeners their interest is worth advertising */
+    if (g_discovery.demand) {
+        pos = json_add_int(buf, pos, maxlen, "dm", 1, true);
+        if (pos < 0) return -1;
+    }
+    
+    pos = interest_add(buf, pos, maxlen);
+    if (pos < 0) return -1;
+    
+    /* Someone is waiting in pn_announce_wait_visible() */
+    if (g_discovery.vis.active) {
+        pos = json_add_int(buf, pos, maxlen, "ack", 1, true);
+        if (pos < 0) return -1;
+    }
+    
     pos = json_add_int(buf, pos, maxlen, "ts", (int)time(NULL), true);
     if (pos < 0) return -1;
     
@@ -266,6 +1111,12 @@ static int build_bye_message(char *buf, int maxlen) {
     pos = json_add_string(buf, pos, maxlen, "id", g_discovery.my_service.id, true);
     if (pos < 0) return -1;
     
+    pos = json_add_int(buf, pos, maxlen, "inc", (int)g_discovery.my_service.incarnation, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_u64(buf, pos, maxlen, "hlc", hlc_now(), true);
+    if (pos < 0) return -1;
+    
     pos = json_add_int(buf, pos, maxlen, "ts", (int)time(NULL), true);
     if (pos < 0) return -1;
     
@@ -276,36 +1127,312 @@ static int build_bye_message(char *buf, int maxlen) {
     return pos;
 }
 
-/* Broadcast message to all interfaces */
-static void broadcast_message(const char *msg, int len) {
-#ifdef _WIN32
-    /* Windows: Get adapter addresses and broadcast on each */
-    ULONG buflen = 15000;
-    PIP_ADAPTER_ADDRESSES addrs = (PIP_ADAPTER_ADDRESSES)malloc(buflen);
-    if (!addrs) return;
+/* Start a message: magic, version, command, our id (if any), timestamp */
+static int build_msg_header(char *buf, int maxlen, const char *cmd) {
+    int pos = 0;
+    buf[pos++] = '{';
     
-    ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
-    if (GetAdaptersAddresses(AF_INET, flags, NULL, addrs, &buflen) == ERROR_SUCCESS) {
-        PIP_ADAPTER_ADDRESSES adapter = addrs;
-        while (adapter) {
-            if (adapter->OperStatus == IfOperStatusUp) {
-                PIP_ADAPTER_UNICAST_ADDRESS unicast = adapter->FirstUnicastAddress;
-                while (unicast) {
-                    struct sockaddr_in *sin = (struct sockaddr_in*)unicast->Address.lpSockaddr;
-                    if (sin->sin_family == AF_INET) {
-                        /* Calculate broadcast address */
-                        ULONG mask = 0xFFFFFFFF << (32 - unicast->OnLinkPrefixLength);
-                        ULONG ip = ntohl(sin->sin_addr.s_addr);
-                        ULONG broadcast_ip = ip | ~mask;
-                        
-                        struct sockaddr_in dest;
-                        memset(&dest, 0, sizeof(dest));
-                        dest.sin_family = AF_INET;
-                        dest.sin_port = htons(g_discovery.udp_port);
+    pos = json_add_string(buf, pos, maxlen, "m", PN_MAGIC, false);
+    if (pos < 0) return -1;
+    
+    pos = json_add_int(buf, pos, maxlen, "v", PN_VERSION, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_string(buf, pos, maxlen, "cmd", cmd, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_string(buf, pos, maxlen, "id",
+                          g_discovery.announcing ? g_discovery.my_service.id : "", true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_u64(buf, pos, maxlen, "hlc", hlc_now(), true);
+    if (pos < 0) return -1;
+    
+    return json_add_int(buf, pos, maxlen, "ts", (int)time(NULL), true);
+}
+
+/* Close a message started with build_msg_header() */
+static int build_msg_end(char *buf, int pos, int maxlen) {
+    if (pos < 0 || pos + 1 >= maxlen) return -1;
+    buf[pos++] = '}';
+    buf[pos] = '\0';
+    return pos;
+}
+
+/* Finish a packed proxy message: record count goes last */
+static int build_proxy_trailer(char *buf, int pos, int maxlen, int count) {
+    pos = json_add_int(buf, pos, maxlen, "n", count, true);
+    return build_msg_end(buf, pos, maxlen);
+}
+
+/* Room left for the trailer: ,"n":NN} */
+#define PROXY_TRAILER_LEN 16
+
+/* Pack one descriptor as record n of a packed message; returns its length */
+static int build_record(char *rec, int maxlen, const pn_service_t *s, int n) {
+    char key[16];
+    int rpos = 0;
+    
+    snprintf(key, sizeof(key), "id%d", n);
+    rpos = json_add_string(rec, rpos, maxlen, key, s->id, true);
+    snprintf(key, sizeof(key), "svc%d", n);
+    if (rpos >= 0) rpos = json_add_string(rec, rpos, maxlen, key, s->service, true);
+    snprintf(key, sizeof(key), "ip%d", n);
+    if (rpos >= 0) rpos = json_add_string(rec, rpos, maxlen, key, s->ip, true);
+    snprintf(key, sizeof(key), "port%d", n);
+    if (rpos >= 0) rpos = json_add_int(rec, rpos, maxlen, key, s->ctrl_port, true);
+    if (rpos >= 0 && s->data_port > 0) {
+        snprintf(key, sizeof(key), "data%d", n);
+        rpos = json_add_int(rec, rpos, maxlen, key, s->data_port, true);
+    }
+    if (rpos >= 0 && s->slots >= 0) {
+        snprintf(key, sizeof(key), "slots%d", n);
+        rpos = json_add_int(rec, rpos, maxlen, key, s->slots, true);
+    }
+    if (rpos >= 0 && s->caps[0]) {
+        snprintf(key, sizeof(key), "caps%d", n);
+        rpos = json_add_string(rec, rpos, maxlen, key, s->caps, true);
+    }
+    if (rpos >= 0 && s->lease > 0) {
+        snprintf(key, sizeof(key), "ls%d", n);
+        rpos = json_add_int(rec, rpos, maxlen, key, (int)s->lease, true);
+    }
+    snprintf(key, sizeof(key), "inc%d", n);
+    if (rpos >= 0) rpos = json_add_int(rec, rpos, maxlen, key, (int)s->incarnation, true);
+    return rpos;
+}
+
+/*
+ * Build "phelo": pack as many descriptors as fit, starting at *next.
+ * Advances *next past the packed records.
+ */
+static int build_proxy_helo_message(char *buf, int maxlen, const pn_service_t *svcs,
+                                    int count, int *next) {
+    int pos = build_msg_header(buf, maxlen, "phelo");
+    if (pos >= 0 && g_discovery.demand) pos = json_add_int(buf, pos, maxlen, "dm", 1, true);
+    if (pos < 0) return -1;
+    
+    int packed = 0;
+    while (*next < count) {
+        char rec[PN_MAX_MSG_LEN];
+        int rpos = build_record(rec, sizeof(rec), &svcs[*next], packed);
+        if (rpos < 0) return -1;
+        
+        if (pos + rpos + PROXY_TRAILER_LEN >= maxlen) {
+            if (packed == 0) return -1;  /* Single record too large */
+            break;
+        }
+        memcpy(buf + pos, rec, rpos);
+        pos += rpos;
+        packed++;
+        (*next)++;
+    }
+    
+    return build_proxy_trailer(buf, pos, maxlen, packed);
+}
+
+/* Build "pbye": pack as many ids as fit, starting at *next */
+static int build_proxy_bye_message(char *buf, int maxlen, const pn_service_t *svcs,
+                                   int count, int *next) {
+    int pos = build_msg_header(buf, maxlen, "pbye");
+    if (pos < 0) return -1;
+    
+    int packed = 0;
+    while (*next < count) {
+        char rec[PN_MAX_ID_LEN + 16], key[16];
+        snprintf(key, sizeof(key), "id%d", packed);
+        int rpos = json_add_string(rec, 0, sizeof(rec), key, svcs[*next].id, true);
+        snprintf(key, sizeof(key), "inc%d", packed);
+        if (rpos >= 0) rpos = json_add_int(rec, rpos, sizeof(rec), key,
+                                           (int)svcs[*next].incarnation, true);
+        if (rpos < 0) return -1;
+        
+        if (pos + rpos + PROXY_TRAILER_LEN >= maxlen) {
+            if (packed == 0) return -1;
+            break;
+        }
+        memcpy(buf + pos, rec, rpos);
+        pos += rpos;
+        packed++;
+        (*next)++;
+    }
+    
+    return build_proxy_trailer(buf, pos, maxlen, packed);
+}
+
+/* Check a name against a configured list (an empty list accepts all) */
+static bool cfg_list_accepts(const char *list, int count, int stride, const char *name) {
+    if (count == 0) return true;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(list + (size_t)i * stride, name) == 0) return true;
+    }
+    return false;
+}
+
+/* Is this service type in the subscription filter? */
+static bool cfg_accepts_service(const char *service) {
+    mutex_lock(&g_discovery.cfg_mutex);
+    bool ok = cfg_list_accepts(&g_discovery.cfg.filters[0][0], g_discovery.cfg.n_filters,
+                               PN_MAX_SERVICE_LEN, service);
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return ok;
+}
+
+/* Is broadcasting allowed on this interface? */
+static bool cfg_accepts_iface(const char *name) {
+    mutex_lock(&g_discovery.cfg_mutex);
+    bool ok = cfg_list_accepts(&g_discovery.cfg.ifaces[0][0], g_discovery.cfg.n_ifaces,
+                               CFG_IFNAME_LEN, name);
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return ok;
+}
+
+/* Is an interface allow-list in force? */
+static bool cfg_iface_restricted(void) {
+    mutex_lock(&g_discovery.cfg_mutex);
+    bool restricted = g_discovery.cfg.n_ifaces > 0;
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return restricted;
+}
+
+/*
+ * Send datagrams to one destination. With GSO each run of equal-size
+ * datagrams (the last may be shorter) leaves in one UDP_SEGMENT send; one
+ * slightly shorter than the run is padded with spaces, which JSON readers
+ * skip, and the padding is charged to the budget here. A run the kernel
+ * fails to send for any other reason is sent again one datagram at a time.
+ */
+static void burst_sendto(const struct sockaddr_in *dest, const char *const *msgs,
+                         const int *lens, int n) {
+    int i = 0;
+
+#ifdef __linux__
+    char pad[GSO_PAD_MAX];
+    memset(pad, ' ', sizeof(pad));
+    
+    mutex_lock(&g_discovery.tx_mutex);
+    bool gso = g_discovery.udp_gso;
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    uint64_t segmented = 0;
+    int padded = 0;                   /* Pad bytes that left with segmented runs */
+    int refused = 0;                  /* errno of a send the kernel would not segment */
+    while (gso && i < n) {
+        /* Extend the run while datagrams fit the first one's segment size */
+        int seg = lens[i], j = i + 1;
+        while (j < n && j - i < PN_MAX_BURST && lens[j] <= seg &&
+               (j - i + 1) * seg <= GSO_MAX_BYTES) {
+            if (seg - lens[j++] > GSO_PAD_MAX) break;   /* Too short to pad: ends the run */
+        }
+        if (j - i == 1) {
+            sendto(g_discovery.sock, msgs[i], lens[i], 0, (const struct sockaddr*)dest, sizeof(*dest));
+            i++;
+            continue;
+        }
+        
+        struct iovec iov[2 * PN_MAX_BURST];
+        int niov = 0, run_pad = 0;
+        for (int k = i; k < j; k++) {
+            iov[niov].iov_base = (void*)msgs[k];
+            iov[niov++].iov_len = (size_t)lens[k];
+            if (k < j - 1 && lens[k] < seg) {
+                iov[niov].iov_base = pad;
+                iov[niov++].iov_len = (size_t)(seg - lens[k]);
+                run_pad += seg - lens[k];
+            }
+        }
+        
+        char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        memset(ctrl, 0, sizeof(ctrl));
+        mh.msg_name = (void*)dest;
+        mh.msg_namelen = sizeof(*dest);
+        mh.msg_iov = iov;
+        mh.msg_iovlen = (size_t)niov;
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        uint16_t gso_size = (uint16_t)seg;
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        
+        if (sendmsg(g_discovery.sock, &mh, 0) < 0) {
+            if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+                /* No segmentation on this kernel or device: one datagram per send */
+                refused = errno;
+                break;
+            }
+            
+            /* Anything else (ENOBUFS, EAGAIN, ...): retry this run singly */
+            for (; i < j; i++) {
+                sendto(g_discovery.sock, msgs[i], lens[i], 0, (const struct sockaddr*)dest, sizeof(*dest));
+            }
+            continue;
+        }
+        segmented += (uint64_t)(j - i);
+        padded += run_pad;
+        i = j;
+    }
+    
+    if (segmented || refused) {
+        mutex_lock(&g_discovery.tx_mutex);
+        g_discovery.tx_stats.segmented += segmented;
+        
+        /* Callers charge each datagram's own length: the padding is ours to charge */
+        if (g_discovery.tx_rate > 0) g_discovery.tx_tokens -= padded;
+        g_discovery.tx_stats.bytes_sent += (uint64_t)padded;
+        bool first = refused && g_discovery.udp_gso;
+        if (refused) g_discovery.udp_gso = false;
+        mutex_unlock(&g_discovery.tx_mutex);
+        
+        if (first) {
+            log_info("pn_discovery: UDP GSO unavailable (%s), sending singly\n", strerror(refused));
+        }
+    }
+#endif
+    
+    for (; i < n; i++) {
+        sendto(g_discovery.sock, msgs[i], lens[i], 0, (const struct sockaddr*)dest, sizeof(*dest));
+    }
+}
+
+/* Broadcast messages to all interfaces */
+static int broadcast_burst(const char *const *msgs, const int *lens, int n) {
+    int count = 0;
+    
+#ifdef _WIN32
+    /* Windows: Get adapter addresses and broadcast on each */
+    ULONG buflen = 15000;
+    PIP_ADAPTER_ADDRESSES addrs = (PIP_ADAPTER_ADDRESSES)malloc(buflen);
+    if (!addrs) return 0;
+    
+    ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+    if (GetAdaptersAddresses(AF_INET, flags, NULL, addrs, &buflen) == ERROR_SUCCESS) {
+        PIP_ADAPTER_ADDRESSES adapter = addrs;
+        while (adapter) {
+            if (adapter->OperStatus == IfOperStatusUp &&
+                cfg_accepts_iface(adapter->AdapterName)) {
+                PIP_ADAPTER_UNICAST_ADDRESS unicast = adapter->FirstUnicastAddress;
+                while (unicast) {
+                    struct sockaddr_in *sin = (struct sockaddr_in*)unicast->Address.lpSockaddr;
+                    if (sin->sin_family == AF_INET) {
+                        /* Calculate broadcast address */
+                        ULONG mask = 0xFFFFFFFF << (32 - unicast->OnLinkPrefixLength);
+                        ULONG ip = ntohl(sin->sin_addr.s_addr);
+                        ULONG broadcast_ip = ip | ~mask;
+                        
+                        struct sockaddr_in dest;
+                        memset(&dest, 0, sizeof(dest));
+                        dest.sin_family = AF_INET;
+                        dest.sin_port = htons(g_discovery.udp_port);
                         dest.sin_addr.s_addr = htonl(broadcast_ip);
                         
-                        sendto(g_discovery.sock, msg, len, 0,
-                               (struct sockaddr*)&dest, sizeof(dest));
+                        burst_sendto(&dest, msgs, lens, n);
+                        count += n;
                     }
                     unicast = unicast->Next;
                 }
@@ -315,26 +1442,29 @@ static void broadcast_message(const char *msg, int len) {
     }
     free(addrs);
     
-    /* Also send to 255.255.255.255 */
+    /* Also send to 255.255.255.255 (leaves by the default route) */
+    if (cfg_iface_restricted()) return count;
     struct sockaddr_in dest;
     memset(&dest, 0, sizeof(dest));
     dest.sin_family = AF_INET;
     dest.sin_port = htons(g_discovery.udp_port);
     dest.sin_addr.s_addr = INADDR_BROADCAST;
-    sendto(g_discovery.sock, msg, len, 0, (struct sockaddr*)&dest, sizeof(dest));
+    burst_sendto(&dest, msgs, lens, n);
+    count += n;
     
 #else
     /* Linux: Use getifaddrs */
     struct ifaddrs *ifaddr, *ifa;
     if (getifaddrs(&ifaddr) == -1) {
         /* Fallback to 255.255.255.255 */
+        if (cfg_iface_restricted()) return 0;
         struct sockaddr_in dest;
         memset(&dest, 0, sizeof(dest));
         dest.sin_family = AF_INET;
         dest.sin_port = htons(g_discovery.udp_port);
         dest.sin_addr.s_addr = INADDR_BROADCAST;
-        sendto(g_discovery.sock, msg, len, 0, (struct sockaddr*)&dest, sizeof(dest));
-        return;
+        burst_sendto(&dest, msgs, lens, n);
+        return n;
     }
     
     for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
@@ -342,6 +1472,7 @@ static void broadcast_message(const char *msg, int len) {
         if (ifa->ifa_addr->sa_family != AF_INET) continue;
         if (!(ifa->ifa_flags & IFF_BROADCAST)) continue;
         if (ifa->ifa_broadaddr == NULL) continue;
+        if (!cfg_accepts_iface(ifa->ifa_name)) continue;
         
         struct sockaddr_in *bcast = (struct sockaddr_in*)ifa->ifa_broadaddr;
         struct sockaddr_in dest;
@@ -350,390 +1481,5202 @@ static void broadcast_message(const char *msg, int len) {
         dest.sin_port = htons(g_discovery.udp_port);
         dest.sin_addr = bcast->sin_addr;
         
-        sendto(g_discovery.sock, msg, len, 0, (struct sockaddr*)&dest, sizeof(dest));
+        burst_sendto(&dest, msgs, lens, n);
+        count += n;
     }
     
     freeifaddrs(ifaddr);
 #endif
+    return count;
 }
 
-/* Parse incoming message */
-static int parse_message(const char *buf, int len, const char *sender_ip) {
-    char magic[8], cmd[16], id[PN_MAX_ID_LEN], svc[PN_MAX_SERVICE_LEN];
-    char ip[PN_MAX_IP_LEN], caps[PN_MAX_CAPS_LEN];
+/* Send datagrams to every known peer (unicast mode) */
+static int unicast_fanout(const char *const *msgs, const int *lens, int count) {
+    struct sockaddr_in dests[PN_MAX_PEERS];
+    int n = 0;
+    uint32_t now = (uint32_t)time(NULL);
     
-    /* Verify magic */
-    if (!json_get_string(buf, "m", magic, sizeof(magic))) return -1;
-    if (strcmp(magic, PN_MAGIC) != 0) return -1;
+    mutex_lock(&g_discovery.peers_mutex);
+    for (int i = 0; i < PN_MAX_PEERS; i++) {
+        if (!g_discovery.peers[i].active) continue;
+        
+        /* Learned peers age out; seeds stay forever */
+        if (!g_discovery.peers[i].seed &&
+            now - g_discovery.peers[i].last_heard > PN_PEER_TIMEOUT_SEC) {
+            g_discovery.peers[i].active = false;
+            continue;
+        }
+        dests[n++] = g_discovery.peers[i].addr;
+    }
+    mutex_unlock(&g_discovery.peers_mutex);
     
-    /* Get command */
-    if (!json_get_string(buf, "cmd", cmd, sizeof(cmd))) return -1;
+    if (n == 0) return 0;
     
-    /* Get ID */
-    if (!json_get_string(buf, "id", id, sizeof(id))) return -1;
+    /* Several datagrams: one (segmented) burst per peer */
+    if (count > 1) {
+        for (int i = 0; i < n; i++) {
+            burst_sendto(&dests[i], msgs, lens, count);
+        }
+        return n * count;
+    }
+    const char *msg = msgs[0];
+    int len = lens[0];
     
-    /* Ignore our own messages */
-    if (g_discovery.announcing && strcmp(id, g_discovery.my_service.id) == 0) {
-        return 0;
+#ifdef __linux__
+    /* One syscall for the whole fan-out */
+    struct mmsghdr mmsgs[PN_MAX_PEERS];
+    struct iovec iov;
+    iov.iov_base = (void*)msg;
+    iov.iov_len = (size_t)len;
+    memset(mmsgs, 0, sizeof(mmsgs[0]) * n);
+    for (int i = 0; i < n; i++) {
+        mmsgs[i].msg_hdr.msg_name = &dests[i];
+        mmsgs[i].msg_hdr.msg_namelen = sizeof(dests[i]);
+        mmsgs[i].msg_hdr.msg_iov = &iov;
+        mmsgs[i].msg_hdr.msg_iovlen = 1;
     }
     
-    if (strcmp(cmd, "helo") == 0) {
-        /* Parse service info */
-        if (!json_get_string(buf, "svc", svc, sizeof(svc))) return -1;
-        
-        /* Get IP - use sender_ip if not in message */
-        if (!json_get_string(buf, "ip", ip, sizeof(ip))) {
-            strncpy(ip, sender_ip, sizeof(ip) - 1);
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(g_discovery.sock, mmsgs + sent, (unsigned int)(n - sent), 0);
+        if (r <= 0) {
+            sent++;  /* Skip the peer that failed */
+            continue;
         }
-        
-        int port = json_get_int(buf, "port");
-        int data_port = json_get_int(buf, "data");
-        
-        json_get_string(buf, "caps", caps, sizeof(caps));
-        if (!caps[0]) caps[0] = '\0';
-        
-        /* Update registry */
-        mutex_lock(&g_discovery.services_mutex);
-        
-        int idx = -1;
-        bool is_new = false;
-        
-        /* Check if we already know this service */
-        for (int i = 0; i < PN_MAX_SERVICES; i++) {
-            if (g_discovery.services[i].active && 
-                strcmp(g_discovery.services[i].id, id) == 0) {
-                idx = i;
-                break;
-            }
+        sent += r;
+    }
+#else
+    for (int i = 0; i < n; i++) {
+        sendto(g_discovery.sock, msg, len, 0, (struct sockaddr*)&dests[i], sizeof(dests[i]));
+    }
+#endif
+    return n;
+}
+
+/* Send to the network: broadcast, or unicast fan-out in seed-list mode.
+ * Returns the number of datagrams put on the wire. */
+static int send_discovery_burst(const char *const *msgs, const int *lens, int n) {
+    if (g_discovery.unicast_mode) {
+        return unicast_fanout(msgs, lens, n);
+    }
+    return broadcast_burst(msgs, lens, n);
+}
+
+static int send_discovery(const char *msg, int len) {
+    return send_discovery_burst(&msg, &len, 1);
+}
+
+/* Parse "ip" or "ip:port" (port defaults to the discovery port) */
+static int parse_peer_addr(const char *addr, struct sockaddr_in *out) {
+    char host[PN_MAX_IP_LEN];
+    int port = g_discovery.udp_port;
+    strncpy(host, addr, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+        if (port <= 0 || port > 65535) return -1;
+    }
+    
+    memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_port = htons(port);
+    return inet_pton(AF_INET, host, &out->sin_addr) == 1 ? 0 : -1;
+}
+
+/* Remember a peer we heard from */
+static void note_peer(const struct sockaddr_in *from) {
+    char ip[PN_MAX_IP_LEN];
+    inet_ntop(AF_INET, &from->sin_addr, ip, sizeof(ip));
+    if (ntohs(from->sin_port) == g_discovery.udp_port &&
+        strcmp(ip, g_discovery.local_ip) == 0) {
+        return;  /* Ourselves */
+    }
+    
+    uint32_t now = (uint32_t)time(NULL);
+    int free_idx = -1, oldest_idx = -1;
+    
+    mutex_lock(&g_discovery.peers_mutex);
+    for (int i = 0; i < PN_MAX_PEERS; i++) {
+        if (!g_discovery.peers[i].active) {
+            if (free_idx < 0) free_idx = i;
+            continue;
         }
-        
-        if (idx < 0) {
-            /* New service - find empty slot */
-            is_new = true;
-            for (int i = 0; i < PN_MAX_SERVICES; i++) {
-                if (!g_discovery.services[i].active) {
-                    idx = i;
-                    break;
-                }
-            }
+        if (g_discovery.peers[i].addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+            g_discovery.peers[i].addr.sin_port == from->sin_port) {
+            g_discovery.peers[i].last_heard = now;
+            mutex_unlock(&g_discovery.peers_mutex);
+            return;
         }
-        
-        if (idx >= 0) {
-            pn_service_t *s = &g_discovery.services[idx];
-            strncpy(s->id, id, PN_MAX_ID_LEN - 1);
-            strncpy(s->service, svc, PN_MAX_SERVICE_LEN - 1);
-            strncpy(s->ip, ip, PN_MAX_IP_LEN - 1);
-            s->ctrl_port = port;
-            s->data_port = data_port;
-            strncpy(s->caps, caps, PN_MAX_CAPS_LEN - 1);
-            s->last_seen = (uint32_t)time(NULL);
-            s->active = true;
+        if (!g_discovery.peers[i].seed &&
+            (oldest_idx < 0 || g_discovery.peers[i].last_heard < g_discovery.peers[oldest_idx].last_heard)) {
+            oldest_idx = i;
         }
-        
-        mutex_unlock(&g_discovery.services_mutex);
-        
-        /* Only callback and log for NEW services */
-        if (is_new) {
-            if (g_discovery.callback) {
-                g_discovery.callback(id, svc, ip, port, data_port, caps, false,
-                                    g_discovery.callback_userdata);
-            }
-            printf("pn_discovery: found %s '%s' at %s:%d\n", svc, id, ip, port);
-            
-            /* Trigger reactive re-announce so the new service discovers us */
-            if (g_discovery.announcing && !g_discovery.reannounce_pending) {
-                g_discovery.reannounce_delay_sec = get_reannounce_delay();
-                g_discovery.reannounce_pending = true;
-                printf("pn_discovery: will re-announce in %d sec (new service joined)\n",
-                       g_discovery.reannounce_delay_sec);
-            }
+    }
+    
+    /* Table full: replace the stalest learned peer */
+    int idx = (free_idx >= 0) ? free_idx : oldest_idx;
+    if (idx >= 0) {
+        g_discovery.peers[idx].addr = *from;
+        g_discovery.peers[idx].last_heard = now;
+        g_discovery.peers[idx].seed = false;
+        g_discovery.peers[idx].active = true;
+    }
+    mutex_unlock(&g_discovery.peers_mutex);
+}
+
+/* Known-answer Bloom filter (FNV-1a over id + incarnation, double hashing) */
+typedef struct {
+    uint8_t bits[PN_KA_MAX_BITS / 8];
+    int nbits;
+    int nhash;
+} ka_filter_t;
+
+static void ka_hash(const char *id, uint32_t incarnation, uint32_t *h1, uint32_t *h2) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = id; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 0x100000001b3ULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        h ^= (uint8_t)(incarnation >> (i * 8));
+        h *= 0x100000001b3ULL;
+    }
+    *h1 = (uint32_t)h;
+    *h2 = (uint32_t)(h >> 32) | 1;
+}
+
+/* Size the filter for n entries so it still fits in one datagram */
+static void ka_init(ka_filter_t *f, int n) {
+    memset(f, 0, sizeof(*f));
+    int nbits = n * PN_KA_BITS_PER_ENTRY;
+    nbits = (nbits + 63) & ~63;
+    if (nbits < PN_KA_MIN_BITS) nbits = PN_KA_MIN_BITS;
+    if (nbits > PN_KA_MAX_BITS) nbits = PN_KA_MAX_BITS;
+    f->nbits = nbits;
+    
+    /* Optimal k = (m/n) ln 2, kept small so lookups stay cheap */
+    int k = (n > 0) ? (int)((double)nbits / n * 0.693 + 0.5) : 1;
+    if (k < 1) k = 1;
+    if (k > 8) k = 8;
+    f->nhash = k;
+}
+
+static void ka_add(ka_filter_t *f, const char *id, uint32_t incarnation) {
+    uint32_t h1, h2;
+    ka_hash(id, incarnation, &h1, &h2);
+    for (int i = 0; i < f->nhash; i++) {
+        uint32_t bit = (h1 + (uint32_t)i * h2) % (uint32_t)f->nbits;
+        f->bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+    }
+}
+
+static bool ka_contains(const ka_filter_t *f, const char *id, uint32_t incarnation) {
+    uint32_t h1, h2;
+    ka_hash(id, incarnation, &h1, &h2);
+    for (int i = 0; i < f->nhash; i++) {
+        uint32_t bit = (h1 + (uint32_t)i * h2) % (uint32_t)f->nbits;
+        if (!(f->bits[bit / 8] & (1u << (bit % 8)))) return false;
+    }
+    return true;
+}
+
+static void ka_to_hex(const ka_filter_t *f, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    int nbytes = f->nbits / 8;
+    for (int i = 0; i < nbytes; i++) {
+        out[i * 2] = hex[f->bits[i] >> 4];
+        out[i * 2 + 1] = hex[f->bits[i] & 0x0F];
+    }
+    out[nbytes * 2] = '\0';
+}
+
+static int ka_from_hex(ka_filter_t *f, const char *hex, int nbits, int nhash) {
+    if (nbits < 8 || nbits > PN_KA_MAX_BITS || (nbits % 8) != 0) return -1;
+    if (nhash < 1 || nhash > 8) return -1;
+    if ((int)strlen(hex) != nbits / 4) return -1;
+    memset(f, 0, sizeof(*f));
+    f->nbits = nbits;
+    f->nhash = nhash;
+    for (int i = 0; i < nbits / 8; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        f->bits[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+/* Build "find" JSON message with known-answer filter */
+static int build_find_message(char *buf, int maxlen, const char *svc) {
+    ka_filter_t filter;
+    int known = 0;
+    
+    /* Count and hash what we already know of this type */
+    mutex_lock(&g_discovery.services_mutex);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        const pn_service_t *s = &g_discovery.services[i];
+        if (s->active && (!svc[0] || strcmp(s->service, svc) == 0)) known++;
+    }
+    ka_init(&filter, known);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        const pn_service_t *s = &g_discovery.services[i];
+        if (s->active && (!svc[0] || strcmp(s->service, svc) == 0)) {
+            ka_add(&filter, s->id, s->incarnation);
         }
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    int pos = 0;
+    buf[pos++] = '{';
+    
+    pos = json_add_string(buf, pos, maxlen, "m", PN_MAGIC, false);
+    if (pos < 0) return -1;
+    
+    pos = json_add_int(buf, pos, maxlen, "v", PN_VERSION, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_string(buf, pos, maxlen, "cmd", "find", true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_string(buf, pos, maxlen, "id",
+                          g_discovery.announcing ? g_discovery.my_service.id : "", true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_string(buf, pos, maxlen, "svc", svc, true);
+    if (pos < 0) return -1;
+    
+    if (known > 0) {
+        char hex[PN_KA_MAX_BITS / 4 + 1];
+        ka_to_hex(&filter, hex);
         
-    } else if (strcmp(cmd, "bye") == 0) {
-        /* Remove from registry */
-        mutex_lock(&g_discovery.services_mutex);
-        
-        char svc_copy[PN_MAX_SERVICE_LEN] = "";
-        char ip_copy[PN_MAX_IP_LEN] = "";
-        int port_copy = 0;
-        
-        for (int i = 0; i < PN_MAX_SERVICES; i++) {
-            if (g_discovery.services[i].active && 
-                strcmp(g_discovery.services[i].id, id) == 0) {
-                strncpy(svc_copy, g_discovery.services[i].service, PN_MAX_SERVICE_LEN - 1);
-                strncpy(ip_copy, g_discovery.services[i].ip, PN_MAX_IP_LEN - 1);
-                port_copy = g_discovery.services[i].ctrl_port;
-                g_discovery.services[i].active = false;
-                break;
-            }
-        }
+        pos = json_add_int(buf, pos, maxlen, "kb", filter.nbits, true);
+        if (pos < 0) return -1;
         
-        mutex_unlock(&g_discovery.services_mutex);
+        pos = json_add_int(buf, pos, maxlen, "kh", filter.nhash, true);
+        if (pos < 0) return -1;
         
-        /* Callback */
-        if (g_discovery.callback && svc_copy[0]) {
-            g_discovery.callback(id, svc_copy, ip_copy, port_copy, 0, "", true,
-                                g_discovery.callback_userdata);
+        pos = json_add_string(buf, pos, maxlen, "ka", hex, true);
+        if (pos < 0) return -1;
+    }
+    
+    pos = json_add_int(buf, pos, maxlen, "ts", (int)time(NULL), true);
+    if (pos < 0) return -1;
+    
+    if (pos + 1 >= maxlen) return -1;
+    buf[pos++] = '}';
+    buf[pos] = '\0';
+    
+    return pos;
+}
+
+/* Send message to a single peer */
+static void unicast_message(const struct sockaddr_in *dest, const char *msg, int len) {
+    sendto(g_discovery.sock, msg, len, 0, (const struct sockaddr*)dest, sizeof(*dest));
+}
+
+/* Put a datagram on the wire now; returns bytes sent. Called without tx_mutex. */
+static int tx_transmit(const struct sockaddr_in *dest, const char *msg, int len) {
+    if (dest) {
+        unicast_message(dest, msg, len);
+        return len;
+    }
+    return send_discovery(msg, len) * len;
+}
+
+/* Add tokens for the time since the last refill. Caller holds tx_mutex. */
+static void tx_refill(void) {
+    uint64_t now = now_ms();
+    g_discovery.tx_tokens += (double)(now - g_discovery.tx_refilled) * g_discovery.tx_rate / 1000.0;
+    if (g_discovery.tx_tokens > g_discovery.tx_burst) {
+        g_discovery.tx_tokens = g_discovery.tx_burst;
+    }
+    g_discovery.tx_refilled = now;
+}
+
+/* Most important (then oldest) held datagram, -1 if none. Caller holds tx_mutex. */
+static int tx_head(void) {
+    int best = -1;
+    for (int i = 0; i < PN_TX_QUEUE; i++) {
+        tx_msg_t *q = &g_discovery.txq[i];
+        if (q->used && (best < 0 || q->cls < g_discovery.txq[best].cls ||
+                        (q->cls == g_discovery.txq[best].cls &&
+                         q->seq < g_discovery.txq[best].seq))) {
+            best = i;
         }
-        
-        printf("pn_discovery: '%s' left the network\n", id);
+    }
+    return best;
+}
+
+/*
+ * Work out when the bucket covers the head of the queue, and wake the
+ * sleeping role threads if that is sooner than before. engine_cond is
+ * outside tx_mutex in the lock order, so it is signalled without its
+ * mutex; a lost wakeup costs at most the engine's 1 s cap. Caller holds
+ * tx_mutex.
+ */
+static void tx_schedule(void) {
+    uint64_t before = g_discovery.tx_due;
+    int head = tx_head();
+    if (head < 0) {
+        g_discovery.tx_due = 0;
+    } else if (g_discovery.tx_rate <= 0 || g_discovery.tx_tokens >= g_discovery.txq[head].len) {
+        g_discovery.tx_due = g_discovery.tx_refilled;
+    } else {
+        double need = g_discovery.txq[head].len - g_discovery.tx_tokens;
+        g_discovery.tx_due = g_discovery.tx_refilled +
+                             (uint64_t)(need * 1000.0 / g_discovery.tx_rate) + 1;
+    }
+    
+    if (g_discovery.tx_due && (before == 0 || g_discovery.tx_due < before)) {
+        cond_broadcast(&g_discovery.tx_cond);
+        if (g_discovery.shared_engine) cond_broadcast(&g_discovery.engine_cond);
+    }
+}
+
+/* Is anything of this priority or higher already waiting? */
+static bool tx_pending_ahead(int cls) {
+    for (int i = 0; i < PN_TX_QUEUE; i++) {
+        if (g_discovery.txq[i].used && g_discovery.txq[i].cls <= cls) return true;
+    }
+    return false;
+}
+
+/*
+ * Charge a transmission made outside tx_mutex to the bucket and the stats.
+ * `reserved` tokens were taken when it was let through; `bytes` is what
+ * actually left (one copy per interface or peer).
+ */
+static void tx_charge(int cls, int reserved, int bytes) {
+    mutex_lock(&g_discovery.tx_mutex);
+    if (g_discovery.tx_rate > 0) g_discovery.tx_tokens -= bytes - reserved;
+    g_discovery.tx_stats.sent[cls]++;
+    g_discovery.tx_stats.bytes_sent += (uint64_t)bytes;
+    mutex_unlock(&g_discovery.tx_mutex);
+}
+
+/* Queue a datagram the budget cannot cover yet */
+static void tx_defer(int cls, int key, const struct sockaddr_in *dest, const char *msg, int len) {
+    int slot = -1, victim = -1;
+    for (int i = 0; i < PN_TX_QUEUE; i++) {
+        tx_msg_t *q = &g_discovery.txq[i];
+        if (!q->used) {
+            if (slot < 0) slot = i;
+        } else if (victim < 0 || q->cls > g_discovery.txq[victim].cls ||
+                   (q->cls == g_discovery.txq[victim].cls && q->seq < g_discovery.txq[victim].seq)) {
+            victim = i;
+        }
+    }
+    
+    /* Full: push out the oldest of the least important class, if below us */
+    if (slot < 0) {
+        if (g_discovery.txq[victim].cls <= cls) {
+            g_discovery.tx_stats.dropped[cls]++;
+            return;
+        }
+        g_discovery.tx_stats.dropped[g_discovery.txq[victim].cls]++;
+        slot = victim;
+    }
+    
+    tx_msg_t *q = &g_discovery.txq[slot];
+    q->cls = cls;
+    q->key = key;
+    q->unicast = (dest != NULL);
+    if (dest) q->dest = *dest;
+    q->queued = now_ms();
+    q->seq = g_discovery.tx_seq++;
+    q->len = len;
+    memcpy(q->buf, msg, len);
+    q->used = true;
+    
+    g_discovery.tx_stats.deferred[cls]++;
+    g_discovery.tx_stats.bytes_deferred += (uint64_t)len;
+    g_discovery.tx_stats.last_deferred_ms = wall_ms();
+    tx_schedule();
+}
+
+/* Withdraw queued datagrams with merge keys in [first, last]. Caller holds tx_mutex. */
+static void tx_cancel(int first, int last) {
+    for (int i = 0; i < PN_TX_QUEUE; i++) {
+        tx_msg_t *q = &g_discovery.txq[i];
+        if (q->used && q->key >= first && q->key <= last) {
+            q->used = false;
+            g_discovery.tx_stats.merged[q->cls]++;
+        }
+    }
+}
+
+/*
+ * Send through the pacer. A datagram goes out at once if the budget covers
+ * it and nothing as important is waiting; otherwise it is queued. A queued
+ * datagram with the same non-zero merge key is superseded (a bye passes the
+ * key of the heartbeats it ends). Byes are never deferred: they borrow
+ * against the bucket. The send itself happens after tx_mutex is released.
+ */
+static void tx_submit(int cls, int key, const struct sockaddr_in *dest, const char *msg, int len) {
+    mutex_lock(&g_discovery.tx_mutex);
+    
+    if (key) tx_cancel(key, key);
+    
+    if (g_discovery.tx_rate > 0) tx_refill();
+    bool send = g_discovery.tx_rate <= 0 || cls == PN_TX_BYE ||
+                (g_discovery.tx_tokens >= len && !tx_pending_ahead(cls));
+    if (!send) {
+        tx_defer(cls, key, dest, msg, len);
+    } else if (g_discovery.tx_rate > 0) {
+        g_discovery.tx_tokens -= len;
+    }
+    
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    if (send) tx_charge(cls, len, tx_transmit(dest, msg, len));
+}
+
+/*
+ * Send several datagrams through the pacer. When the budget covers all of
+ * them they go out together, so equal-size runs can be segmented; otherwise
+ * each is submitted on its own. Merge keys are key, key + 1, ...
+ */
+static void tx_submit_burst(int cls, int key, const struct sockaddr_in *dest,
+                            const char *const *msgs, const int *lens, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) total += lens[i];
+    
+    mutex_lock(&g_discovery.tx_mutex);
+    if (key) tx_cancel(key, key + n - 1);
+    if (g_discovery.tx_rate > 0) tx_refill();
+    bool send = g_discovery.tx_rate <= 0 || cls == PN_TX_BYE ||
+                (g_discovery.tx_tokens >= total && !tx_pending_ahead(cls));
+    if (send && g_discovery.tx_rate > 0) g_discovery.tx_tokens -= total;
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    if (send) {
+        int copies = 1;
+        if (dest) burst_sendto(dest, msgs, lens, n);
+        else copies = send_discovery_burst(msgs, lens, n) / n;
+        for (int i = 0; i < n; i++) tx_charge(cls, lens[i], copies * lens[i]);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        tx_submit(cls, key ? key + i : 0, dest, msgs[i], lens[i]);
+    }
+}
+
+/*
+ * Send what the budget allows from the deferred queue, most important
+ * first, one datagram per hold of tx_mutex. Returns when the next held
+ * datagram can go (0 if none is held).
+ */
+static uint64_t tx_drain(void) {
+    tx_msg_t m;
+    
+    for (;;) {
+        mutex_lock(&g_discovery.tx_mutex);
+        if (g_discovery.tx_rate > 0) tx_refill();
+        
+        int head = tx_head();
+        if (head < 0 || (g_discovery.tx_rate > 0 && g_discovery.tx_tokens < g_discovery.txq[head].len)) {
+            tx_schedule();
+            uint64_t due = g_discovery.tx_due;
+            mutex_unlock(&g_discovery.tx_mutex);
+            return due;
+        }
+        
+        m = g_discovery.txq[head];
+        g_discovery.txq[head].used = false;
+        if (g_discovery.tx_rate > 0) g_discovery.tx_tokens -= m.len;
+        uint64_t waited = now_ms() - m.queued;
+        if (waited > g_discovery.tx_stats.max_delay_ms) {
+            g_discovery.tx_stats.max_delay_ms = (uint32_t)waited;
+        }
+        mutex_unlock(&g_discovery.tx_mutex);
+        
+        tx_charge(m.cls, m.len, tx_transmit(m.unicast ? &m.dest : NULL, m.buf, m.len));
+    }
+}
+
+/* Drain held datagrams that are due; returns `next`, or the pacer's next due time if sooner */
+static uint64_t tx_wake(uint64_t now, uint64_t next) {
+    mutex_lock(&g_discovery.tx_mutex);
+    uint64_t due = g_discovery.tx_due;
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    if (due && now >= due) due = tx_drain();
+    return (due && due < next) ? due : next;
+}
+
+/* Sleep until `next` (at most 1 s), waking early when held datagrams fall due */
+static void tx_sleep(uint64_t next) {
+    mutex_lock(&g_discovery.tx_mutex);
+    uint64_t now = now_ms();
+    if (g_discovery.tx_due && g_discovery.tx_due < next) next = g_discovery.tx_due;
+    if (next > now) {
+        cond_wait_ms(&g_discovery.tx_cond, &g_discovery.tx_mutex,
+                     (int)(next - now < 1000 ? next - now : 1000));
+    }
+    mutex_unlock(&g_discovery.tx_mutex);
+}
+
+/* Parse one service descriptor; sfx selects a packed record ("" for helo) */
+static bool parse_descriptor(const char *buf, const char *sfx, const char *sender_ip,
+                             pn_service_t *d) {
+    char key[16];
+    memset(d, 0, sizeof(*d));
+    
+    snprintf(key, sizeof(key), "id%s", sfx);
+    if (!json_get_string(buf, key, d->id, sizeof(d->id)) || !d->id[0]) return false;
+    
+    snprintf(key, sizeof(key), "svc%s", sfx);
+    if (!json_get_string(buf, key, d->service, sizeof(d->service))) return false;
+    
+    /* Get IP - use sender_ip if not in message */
+    snprintf(key, sizeof(key), "ip%s", sfx);
+    if (!json_get_string(buf, key, d->ip, sizeof(d->ip))) {
+        strncpy(d->ip, sender_ip, sizeof(d->ip) - 1);
+    }
+    
+    snprintf(key, sizeof(key), "port%s", sfx);
+    d->ctrl_port = json_get_int(buf, key);
+    snprintf(key, sizeof(key), "data%s", sfx);
+    d->data_port = json_get_int(buf, key);
+    snprintf(key, sizeof(key), "inc%s", sfx);
+    d->incarnation = (uint32_t)json_get_int(buf, key);
+    snprintf(key, sizeof(key), "hlc%s", sfx);
+    d->hlc = json_get_u64(buf, key);
+    if (!d->hlc) d->hlc = json_get_u64(buf, "hlc");   /* Packed records share one stamp */
+    snprintf(key, sizeof(key), "slots%s", sfx);
+    d->slots = json_get_int_def(buf, key, -1);
+    snprintf(key, sizeof(key), "ls%s", sfx);
+    d->lease = (uint32_t)json_get_int(buf, key);
+    snprintf(key, sizeof(key), "caps%s", sfx);
+    json_get_string(buf, key, d->caps, sizeof(d->caps));
+    
+    return true;
+}
+
+/*
+ * Compressed radix tree over instance ids (registry slot per leaf).
+ * Nodes come from a fixed pool: n ids need at most 2n + 1 nodes.
+ * Siblings are kept sorted so prefix listings come out in id order.
+ * Caller holds services_mutex.
+ */
+static void radix_reset(void) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    
+    /* Node 0 is the root with an empty label */
+    memset(&rn[0], 0, sizeof(rn[0]));
+    rn[0].slot = RADIX_NONE;
+    rn[0].child = RADIX_NONE;
+    rn[0].next = RADIX_NONE;
+    g_discovery.radix_free_list = RADIX_NONE;
+    for (int i = RADIX_NODES - 1; i > 0; i--) {
+        rn[i].next = g_discovery.radix_free_list;
+        g_discovery.radix_free_list = i;
+    }
+}
+
+static int radix_alloc(const char *label, int len, int slot) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int n = g_discovery.radix_free_list;
+    if (n == RADIX_NONE) return RADIX_NONE;
+    g_discovery.radix_free_list = rn[n].next;
+    memcpy(rn[n].label, label, len);
+    rn[n].label[len] = '\0';
+    rn[n].len = len;
+    rn[n].slot = slot;
+    rn[n].child = RADIX_NONE;
+    rn[n].next = RADIX_NONE;
+    return n;
+}
+
+static void radix_release(int n) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    rn[n].next = g_discovery.radix_free_list;
+    g_discovery.radix_free_list = n;
+}
+
+/* Link node n into parent's child list, sorted by first byte */
+static void radix_link(int parent, int n) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int *pp = &rn[parent].child;
+    while (*pp != RADIX_NONE && (uint8_t)rn[*pp].label[0] < (uint8_t)rn[n].label[0]) {
+        pp = &rn[*pp].next;
+    }
+    rn[n].next = *pp;
+    *pp = n;
+}
+
+/* Child of n whose label starts with c; *link receives the pointer to it */
+static int radix_child(int n, char c, int **link) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int *pp = &rn[n].child;
+    while (*pp != RADIX_NONE && rn[*pp].label[0] != c) {
+        pp = &rn[*pp].next;
+    }
+    if (link) *link = pp;
+    return *pp;
+}
+
+static int radix_common(const char *a, int alen, const char *b) {
+    int i = 0;
+    while (i < alen && b[i] && a[i] == b[i]) i++;
+    return i;
+}
+
+static int radix_insert(const char *id, int slot) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int n = 0;
+    const char *p = id;
+    
+    while (*p) {
+        int *link;
+        int c = radix_child(n, *p, &link);
+        if (c == RADIX_NONE) {
+            int leaf = radix_alloc(p, (int)strlen(p), slot);
+            if (leaf == RADIX_NONE) return -1;
+            radix_link(n, leaf);
+            return 0;
+        }
+        
+        int common = radix_common(rn[c].label, rn[c].len, p);
+        if (common < rn[c].len) {
+            /* Split c: new inner node takes the shared part of the label */
+            int mid = radix_alloc(rn[c].label, common, RADIX_NONE);
+            if (mid == RADIX_NONE) return -1;
+            rn[mid].next = rn[c].next;
+            *link = mid;
+            memmove(rn[c].label, rn[c].label + common,
+                    rn[c].len - common + 1);
+            rn[c].len -= common;
+            rn[c].next = RADIX_NONE;
+            rn[mid].child = c;
+        }
+        n = *link;
+        p += common;
+    }
+    
+    rn[n].slot = slot;
+    return 0;
+}
+
+/* Exact lookup: registry slot or -1 */
+static int radix_lookup(const char *id) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int n = 0;
+    const char *p = id;
+    while (*p) {
+        int c = radix_child(n, *p, NULL);
+        if (c == RADIX_NONE) return -1;
+        if (strncmp(rn[c].label, p, rn[c].len) != 0) return -1;
+        p += rn[c].len;
+        n = c;
+    }
+    return n == 0 ? -1 : rn[n].slot;
+}
+
+/* Fold a slot-less node with a single child into that child */
+static void radix_merge(int n) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int c = rn[n].child;
+    if (n == 0 || rn[n].slot != RADIX_NONE) return;
+    if (c == RADIX_NONE || rn[c].next != RADIX_NONE) return;
+    if (rn[n].len + rn[c].len >= PN_MAX_ID_LEN) return;
+    
+    memcpy(rn[n].label + rn[n].len, rn[c].label,
+           rn[c].len + 1);
+    rn[n].len += rn[c].len;
+    rn[n].slot = rn[c].slot;
+    rn[n].child = rn[c].child;
+    radix_release(c);
+}
+
+static void radix_remove(const char *id) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int path[PN_MAX_ID_LEN + 1];
+    int *links[PN_MAX_ID_LEN + 1];
+    int depth = 0;
+    int n = 0;
+    const char *p = id;
+    
+    path[0] = 0;
+    while (*p) {
+        int *link;
+        int c = radix_child(n, *p, &link);
+        if (c == RADIX_NONE) return;
+        if (strncmp(rn[c].label, p, rn[c].len) != 0) return;
+        p += rn[c].len;
+        n = c;
+        depth++;
+        path[depth] = n;
+        links[depth] = link;
+    }
+    if (depth == 0) return;
+    
+    rn[n].slot = RADIX_NONE;
+    if (rn[n].child == RADIX_NONE) {
+        /* Leaf: unlink it, then its parent may be foldable */
+        *links[depth] = rn[n].next;
+        radix_release(n);
+        radix_merge(path[depth - 1]);
+    } else {
+        radix_merge(n);
+    }
+}
+
+/* Copy every entry below node n (in id order) */
+static void radix_collect(int n, pn_service_t *out, int max_count, int *count) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    if (*count >= max_count) return;
+    if (rn[n].slot != RADIX_NONE) {
+        memcpy(&out[(*count)++], &g_discovery.services[rn[n].slot], sizeof(pn_service_t));
+    }
+    for (int c = rn[n].child; c != RADIX_NONE && *count < max_count;
+         c = rn[c].next) {
+        radix_collect(c, out, max_count, count);
+    }
+}
+
+/* List entries whose id starts with prefix: O(prefix + k) */
+static int radix_prefix(const char *prefix, pn_service_t *out, int max_count) {
+    radix_node_t *rn = g_discovery.radix_nodes;
+    int n = 0, count = 0;
+    const char *p = prefix;
+    
+    while (*p) {
+        int c = radix_child(n, *p, NULL);
+        if (c == RADIX_NONE) return 0;
+        int plen = (int)strlen(p);
+        int cmp = plen < rn[c].len ? plen : rn[c].len;
+        if (strncmp(rn[c].label, p, cmp) != 0) return 0;
+        n = c;
+        if (plen <= rn[c].len) break;   /* Prefix ends inside this edge */
+        p += rn[c].len;
+    }
+    
+    radix_collect(n, out, max_count, &count);
+    return count;
+}
+
+/* Registry slot for an id, or -1. Caller holds services_mutex. */
+static int registry_lookup(const char *id) {
+    return radix_lookup(id);
+}
+
+/* Append one registry event to the history ring. Caller holds services_mutex. */
+static void history_append(int type, uint16_t changed, int idx) {
+#ifndef _WIN32
+    pn_history_header_t *hdr = g_discovery.history;
+    if (!hdr) return;
+    
+    const pn_service_t *svc = &g_discovery.services[idx];
+    pn_history_record_t *ring = (pn_history_record_t*)(hdr + 1);
+    pn_history_record_t *r = &ring[hdr->total % hdr->capacity];
+    
+    /* Never behind the previous record, so readers can binary-search on time */
+    uint64_t ts = wall_ms();
+    if (hdr->total > 0) {
+        uint64_t prev = ring[(hdr->total - 1) % hdr->capacity].ts_ms;
+        if (ts < prev) ts = prev;
+    }
+    r->ts_ms = ts;
+    r->id_handle = pn_history_id_handle(svc->id);
+    r->type = (uint8_t)type;
+    r->reserved = 0;
+    r->changed = changed;
+    r->src_ip = g_discovery.svc_meta[idx].src.sin_addr.s_addr;
+    r->src_port = ntohs(g_discovery.svc_meta[idx].src.sin_port);
+    r->slots = (int16_t)svc->slots;
+    strncpy(r->id, svc->id, PN_HISTORY_ID_LEN - 1);
+    r->id[PN_HISTORY_ID_LEN - 1] = '\0';
+    
+    /* Publish the record before counting it */
+    __sync_synchronize();
+    hdr->total++;
+#else
+    (void)type; (void)changed; (void)idx;
+#endif
+}
+
+/*
+ * Eviction lists: one doubly linked list of slots per class, least recently
+ * heard from at the head, so picking a victim is a look at a few heads.
+ * Caller holds services_mutex.
+ */
+static void lru_reset(void) {
+    for (int c = 0; c < PN_EVICT_CLASSES; c++) {
+        g_discovery.lru_head[c] = g_discovery.lru_tail[c] = -1;
+    }
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        g_discovery.svc_meta[i].lru_class = -1;
+    }
+}
+
+/* Did the application subscribe to or ask for this type? */
+static bool evict_wanted(const char *service) {
+    for (int i = 0; i < EVICT_WANTED; i++) {
+        if (strcmp(g_discovery.wanted[i], service) == 0) return true;
+    }
+    mutex_lock(&g_discovery.cfg_mutex);
+    bool subscribed = g_discovery.cfg.n_filters > 0 &&
+        cfg_list_accepts(&g_discovery.cfg.filters[0][0], g_discovery.cfg.n_filters,
+                         PN_MAX_SERVICE_LEN, service);
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return subscribed;
+}
+
+/* Eviction class of a descriptor (lower goes first), -1 if never evicted */
+static int evict_class(const pn_service_t *s) {
+    if (s->pinned) return -1;
+    
+    switch (g_discovery.evict_policy) {
+        case PN_EVICT_PRIORITY:
+            for (int i = 0; i < g_discovery.n_priorities; i++) {
+                if (strcmp(g_discovery.priorities[i].service, s->service) == 0) {
+                    return g_discovery.priorities[i].priority;
+                }
+            }
+            return PN_PRIORITY_DEFAULT;
+        case PN_EVICT_RELEVANCE:
+            return evict_wanted(s->service) ? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+static void lru_unlink(int idx) {
+    int c = g_discovery.svc_meta[idx].lru_class;
+    if (c < 0) return;
+    
+    int prev = g_discovery.svc_meta[idx].lru_prev;
+    int next = g_discovery.svc_meta[idx].lru_next;
+    if (prev >= 0) g_discovery.svc_meta[prev].lru_next = next;
+    else g_discovery.lru_head[c] = next;
+    if (next >= 0) g_discovery.svc_meta[next].lru_prev = prev;
+    else g_discovery.lru_tail[c] = prev;
+    g_discovery.svc_meta[idx].lru_class = -1;
+}
+
+/* Move a slot to the most recent end of its (possibly new) class */
+static void lru_touch(int idx) {
+    lru_unlink(idx);
+    int c = evict_class(&g_discovery.services[idx]);
+    if (c < 0) return;
+    
+    int tail = g_discovery.lru_tail[c];
+    g_discovery.svc_meta[idx].lru_prev = tail;
+    g_discovery.svc_meta[idx].lru_next = -1;
+    if (tail >= 0) g_discovery.svc_meta[tail].lru_next = idx;
+    else g_discovery.lru_head[c] = idx;
+    g_discovery.lru_tail[c] = idx;
+    g_discovery.svc_meta[idx].lru_class = c;
+}
+
+/* Re-class every entry in last_seen order (policy or priorities changed) */
+static void lru_rebuild(void) {
+    int order[PN_MAX_SERVICES], n = 0;
+    
+    lru_reset();
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (!g_discovery.services[i].active) continue;
+        int k = n++;
+        while (k > 0 && g_discovery.services[order[k - 1]].last_seen >
+                        g_discovery.services[i].last_seen) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+    for (int k = 0; k < n; k++) lru_touch(order[k]);
+}
+
+/* Remember a type the application asked for; its entries become relevant */
+static void evict_want(const char *service) {
+    if (!service || !service[0]) return;
+    for (int i = 0; i < EVICT_WANTED; i++) {
+        if (strcmp(g_discovery.wanted[i], service) == 0) return;
+    }
+    
+    char *slot = g_discovery.wanted[g_discovery.wanted_next];
+    g_discovery.wanted_next = (g_discovery.wanted_next + 1) % EVICT_WANTED;
+    strncpy(slot, service, PN_MAX_SERVICE_LEN - 1);
+    slot[PN_MAX_SERVICE_LEN - 1] = '\0';
+    
+    if (g_discovery.evict_policy == PN_EVICT_RELEVANCE) lru_rebuild();
+}
+
+/* Entry to evict for a newcomer of class max_class, -1 if none may go */
+static int evict_victim(int max_class) {
+    for (int c = 0; c <= max_class && c < PN_EVICT_CLASSES; c++) {
+        for (int i = g_discovery.lru_head[c]; i >= 0; i = g_discovery.svc_meta[i].lru_next) {
+            if (!g_discovery.services[i].pinned) return i;
+        }
+    }
+    return -1;
+}
+
+/* Report an eviction (outside services_mutex) */
+static void evict_notify(pn_service_t *gone) {
+    mutex_lock(&g_discovery.stats_mutex);
+    g_discovery.ingest_stats.evicted++;
+    mutex_unlock(&g_discovery.stats_mutex);
+    
+    gone->active = false;
+    batch_record(BATCH_REMOVED, gone);
+    if (g_discovery.callback) {
+        g_discovery.callback(gone->id, gone->service, gone->ip, gone->ctrl_port, 0, "", true,
+                             g_discovery.callback_userdata);
+    }
+    log_info("pn_discovery: evicted %s '%s' (registry full)\n", gone->service, gone->id);
+}
+
+/* Forget the connect outcomes of a slot taken by a new id */
+static void health_reset(int idx) {
+    memset(&g_discovery.svc_meta[idx].health, 0, sizeof(pn_health_t));
+    g_discovery.svc_meta[idx].health.rtt_ms = -1;
+}
+
+/* Drop a registry slot and its index entry. Caller holds services_mutex. */
+static void registry_release(int idx, int event) {
+    g_discovery.registry_gen++;
+    history_append(event, 0, idx);
+    coord_record(COORD_REMOVE, &g_discovery.services[idx]);
+    lru_unlink(idx);
+    radix_remove(g_discovery.services[idx].id);
+    g_discovery.services[idx].active = false;
+    shared_publish(idx);
+}
+
+/* Copy one slot into the image shared with children. Caller holds services_mutex. */
+static void shared_publish(int idx) {
+#ifndef _WIN32
+    shared_registry_t *sh = g_discovery.shared;
+    if (!sh || g_discovery.attached) return;
+    sh->seq++;
+    __sync_synchronize();
+    sh->services[idx] = g_discovery.services[idx];
+    __sync_synchronize();
+    sh->seq++;
+#else
+    (void)idx;
+#endif
+}
+
+/* Attached child: refresh the local registry from the parent's image */
+static void shared_sync(void) {
+#ifndef _WIN32
+    shared_registry_t *sh = g_discovery.shared;
+    if (!sh || !g_discovery.attached) return;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    for (;;) {
+        uint32_t seq = sh->seq;
+        __sync_synchronize();
+        if (seq == g_discovery.shared_seen) break;
+        if (seq & 1) continue;        /* Writer mid-update */
+        
+        memcpy(g_discovery.services, sh->services, sizeof(g_discovery.services));
+        __sync_synchronize();
+        if (sh->seq != seq) continue; /* Torn copy, retry */
+        
+        radix_reset();
+        for (int i = 0; i < PN_MAX_SERVICES; i++) {
+            if (g_discovery.services[i].active &&
+                radix_insert(g_discovery.services[i].id, i) != 0) {
+                g_discovery.services[i].active = false;
+            }
+        }
+        g_discovery.shared_seen = seq;
+        break;
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+#endif
+}
+
+/* Which fields subscribers care about differ (PN_FIELD_* bits) */
+static uint16_t descriptor_diff(const pn_service_t *a, const pn_service_t *b) {
+    uint16_t diff = 0;
+    if (strcmp(a->service, b->service) != 0) diff |= PN_FIELD_SERVICE;
+    if (strcmp(a->ip, b->ip) != 0) diff |= PN_FIELD_IP;
+    if (a->ctrl_port != b->ctrl_port || a->data_port != b->data_port) diff |= PN_FIELD_PORTS;
+    if (strcmp(a->caps, b->caps) != 0) diff |= PN_FIELD_CAPS;
+    if (a->incarnation != b->incarnation) diff |= PN_FIELD_INCARNATION;
+    if (a->slots != b->slots) diff |= PN_FIELD_SLOTS;
+    return diff;
+}
+
+/* Did an announcement change anything subscribers care about? */
+static bool descriptor_changed(const pn_service_t *a, const pn_service_t *b) {
+    return descriptor_diff(a, b) != 0;
+}
+
+/* Find an id in one of the pending batch lists */
+static int batch_find(const pn_service_t *list, int n, const char *id) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(list[i].id, id) == 0) return i;
+    }
+    return -1;
+}
+
+static void batch_drop(pn_service_t *list, int *n, int i) {
+    list[i] = list[--(*n)];
+}
+
+/* Hand the pending batch to the subscriber */
+static void batch_flush(void) {
+    pn_service_t added[PN_MAX_SERVICES], updated[PN_MAX_SERVICES], removed[PN_MAX_SERVICES];
+    
+    mutex_lock(&g_discovery.batch_mutex);
+    pn_batch_cb cb = g_discovery.batch_callback;
+    void *userdata = g_discovery.batch_userdata;
+    int na = g_discovery.batch_n_added;
+    int nu = g_discovery.batch_n_updated;
+    int nr = g_discovery.batch_n_removed;
+    memcpy(added, g_discovery.batch_added, sizeof(pn_service_t) * na);
+    memcpy(updated, g_discovery.batch_updated, sizeof(pn_service_t) * nu);
+    memcpy(removed, g_discovery.batch_removed, sizeof(pn_service_t) * nr);
+    g_discovery.batch_n_added = g_discovery.batch_n_updated = g_discovery.batch_n_removed = 0;
+    g_discovery.batch_deadline = 0;
+    mutex_unlock(&g_discovery.batch_mutex);
+    
+    if (cb && (na || nu || nr)) {
+        cb(added, na, updated, nu, removed, nr, userdata);
+    }
+}
+
+/* Flush the batch once its window has elapsed (listener thread) */
+static void batch_flush_if_due(void) {
+    uint64_t deadline = g_discovery.batch_deadline;
+    if (deadline && now_ms() >= deadline) {
+        batch_flush();
+    }
+}
+
+/*
+ * Gather a registry change into the pending batch. Changes to the same id
+ * within one window fold together (added+removed cancels out).
+ */
+static void batch_record(int kind, const pn_service_t *d) {
+    if (!g_discovery.batch_callback) return;
+    
+    bool full;
+    mutex_lock(&g_discovery.batch_mutex);
+    
+    pn_service_t *added = g_discovery.batch_added;
+    pn_service_t *updated = g_discovery.batch_updated;
+    pn_service_t *removed = g_discovery.batch_removed;
+    int *na = &g_discovery.batch_n_added;
+    int *nu = &g_discovery.batch_n_updated;
+    int *nr = &g_discovery.batch_n_removed;
+    int a = batch_find(added, *na, d->id);
+    int u = batch_find(updated, *nu, d->id);
+    int r = batch_find(removed, *nr, d->id);
+    
+    if (kind == BATCH_REMOVED) {
+        if (a >= 0) {
+            batch_drop(added, na, a);     /* Came and went within the window */
+        } else {
+            if (u >= 0) batch_drop(updated, nu, u);
+            if (r < 0) removed[(*nr)++] = *d;
+        }
+    } else if (a >= 0) {
+        added[a] = *d;
+    } else if (u >= 0) {
+        updated[u] = *d;
+    } else if (r >= 0) {
+        batch_drop(removed, nr, r);       /* Left and came back: an update */
+        updated[(*nu)++] = *d;
+    } else if (kind == BATCH_ADDED) {
+        added[(*na)++] = *d;
+    } else {
+        updated[(*nu)++] = *d;
+    }
+    
+    if (!g_discovery.batch_deadline) {
+        g_discovery.batch_deadline = now_ms() + (uint64_t)g_discovery.batch_window_ms;
+    }
+    full = *na >= PN_MAX_SERVICES || *nu >= PN_MAX_SERVICES || *nr >= PN_MAX_SERVICES;
+    mutex_unlock(&g_discovery.batch_mutex);
+    
+    /* Out of room: deliver now rather than lose changes */
+    if (full) {
+        batch_flush();
+    }
+}
+
+/* A helo for this type arrived: drop its negative entry, wake resolvers */
+static void resolve_notify(const char *service) {
+    mutex_lock(&g_discovery.resolve_mutex);
+    for (int i = 0; i < PN_MAX_RESOLVE; i++) {
+        if (g_discovery.resolve[i].service[0] &&
+            strcmp(g_discovery.resolve[i].service, service) == 0) {
+            g_discovery.resolve[i].answered = true;
+            g_discovery.resolve[i].in_flight = false;
+            g_discovery.resolve[i].backoff_ms = 0;
+            g_discovery.resolve[i].neg_until = 0;
+            cond_broadcast(&g_discovery.resolve_cond);
+            break;
+        }
+    }
+    mutex_unlock(&g_discovery.resolve_mutex);
+}
+
+/*
+ * Order two descriptor versions: origin incarnation first, then HLC stamp.
+ * An unknown incarnation (0) is not compared; an unstamped side means the
+ * sender predates stamps, so the newer arrival wins as before.
+ */
+static int version_cmp(uint32_t inc_a, uint64_t hlc_a, uint32_t inc_b, uint64_t hlc_b) {
+    if (inc_a && inc_b && inc_a != inc_b) return (inc_a > inc_b) ? 1 : -1;
+    if (!hlc_a || !hlc_b) return 1;
+    return (hlc_a > hlc_b) - (hlc_a < hlc_b);
+}
+
+/* Tombstone slot for an id (bounded probe). Caller holds services_mutex. */
+static int tomb_find(const char *id, bool for_insert) {
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t h = pn_history_id_handle(id);
+    int victim = -1;
+    for (int i = 0; i < TOMB_PROBE; i++) {
+        int t = (int)((h + i) & (TOMB_SLOTS - 1));
+        bool live = g_discovery.tombs[t].expires > now;
+        if (live && strcmp(g_discovery.tombs[t].id, id) == 0) return t;
+        
+        /* Reuse the slot that lapses first (expired ones sort lowest) */
+        if (for_insert && (victim < 0 ||
+                           g_discovery.tombs[t].expires < g_discovery.tombs[victim].expires)) {
+            victim = t;
+        }
+    }
+    return victim;
+}
+
+/* Remember a bye so late copies of older helos cannot resurrect the id */
+static void tomb_put(const char *id, uint32_t incarnation, uint64_t hlc) {
+    if (!hlc) return;
+    int t = tomb_find(id, true);
+    strncpy(g_discovery.tombs[t].id, id, PN_MAX_ID_LEN - 1);
+    g_discovery.tombs[t].id[PN_MAX_ID_LEN - 1] = '\0';
+    g_discovery.tombs[t].incarnation = incarnation;
+    g_discovery.tombs[t].hlc = hlc;
+    g_discovery.tombs[t].expires = (uint32_t)time(NULL) + PN_TOMBSTONE_SEC;
+}
+
+/* Is d no newer than what we hold (entry or tombstone)? Caller holds services_mutex. */
+static int merge_verdict(const pn_service_t *d, int idx) {
+    if (idx >= 0) {
+        const pn_service_t *cur = &g_discovery.services[idx];
+        return version_cmp(d->incarnation, d->hlc, cur->incarnation, cur->hlc);
+    }
+    int t = tomb_find(d->id, false);
+    if (t >= 0) {
+        return version_cmp(d->incarnation, d->hlc,
+                           g_discovery.tombs[t].incarnation, g_discovery.tombs[t].hlc) > 0 ? 1 : -1;
+    }
+    return 1;
+}
+
+/* Count a dropped duplicate or stale copy */
+static void merge_count_drop(int verdict) {
+    mutex_lock(&g_discovery.stats_mutex);
+    if (verdict == 0) g_discovery.ingest_stats.duplicates++;
+    else g_discovery.ingest_stats.stale++;
+    mutex_unlock(&g_discovery.stats_mutex);
+}
+
+/*
+ * Merge an announced descriptor into the registry, notify on new services.
+ * Returns 0 if the registry holds it, -1 if it was filtered, stale or
+ * turned away.
+ */
+static int registry_update(const pn_service_t *d, const struct sockaddr_in *from) {
+    /* Not subscribed to this type */
+    if (!cfg_accepts_service(d->service)) return -1;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    
+    int idx = -1;
+    bool is_new = false, evicted = false;
+    uint16_t changed = 0;
+    pn_service_t gone;
+    
+    /* Last writer wins: drop duplicates and copies older than what we hold */
+    idx = registry_lookup(d->id);
+    int verdict = merge_verdict(d, idx);
+    if (verdict <= 0) {
+        mutex_unlock(&g_discovery.services_mutex);
+        merge_count_drop(verdict);
+        return -1;
+    }
+    
+    if (idx >= 0) {
+        changed = descriptor_diff(&g_discovery.services[idx], d);
+    } else {
+        /* New service - find empty slot */
+        is_new = true;
+        int slot = -1, count = 0;
+        for (int i = 0; i < PN_MAX_SERVICES; i++) {
+            if (g_discovery.services[i].active) count++;
+            else if (slot < 0) slot = i;
+        }
+        
+        /* Full: evict per policy, or turn the newcomer away */
+        int limit = g_discovery.evict_limit > 0 ? g_discovery.evict_limit : PN_MAX_SERVICES;
+        if (slot < 0 || count >= limit) {
+            int victim = -1;
+            if (g_discovery.evict_policy != PN_EVICT_NONE) {
+                int c = evict_class(d);
+                victim = evict_victim(c < 0 ? PN_EVICT_CLASSES - 1 : c);
+            }
+            if (victim < 0) {
+                mutex_unlock(&g_discovery.services_mutex);
+                mutex_lock(&g_discovery.stats_mutex);
+                g_discovery.ingest_stats.rejected++;
+                mutex_unlock(&g_discovery.stats_mutex);
+                log_debug("pn_discovery: registry full, ignoring '%s'\n", d->id);
+                return -1;
+            }
+            gone = g_discovery.services[victim];
+            registry_release(victim, PN_EVENT_EVICTED);
+            evicted = true;
+            if (slot < 0) slot = victim;
+        }
+        if (radix_insert(d->id, slot) == 0) idx = slot;
+    }
+    
+    if (idx >= 0) {
+        pn_service_t *s = &g_discovery.services[idx];
+        bool pinned = (!is_new && s->pinned) || d->pinned;
+        memcpy(s, d, sizeof(*s));
+        s->last_seen = (uint32_t)time(NULL);
+        s->pinned = pinned;
+        s->active = true;
+        g_discovery.svc_meta[idx].src = *from;
+        if (is_new) health_reset(idx);
+        g_discovery.svc_meta[idx].health.alive = s->last_seen;
+        g_discovery.svc_meta[idx].health.probes = 0;
+        lru_touch(idx);
+        shared_publish(idx);
+        if (is_new || changed) {
+            g_discovery.svc_meta[idx].gen = ++g_discovery.registry_gen;
+            history_append(is_new ? PN_EVENT_ADDED : PN_EVENT_UPDATED, changed, idx);
+            coord_record(COORD_ADD, s);
+        }
+    }
+    
+    services_unlock();
+    
+    if (evicted) evict_notify(&gone);
+    
+    if (idx >= 0) {
+        resolve_notify(d->service);
+        if (is_new || changed) {
+            batch_record(is_new ? BATCH_ADDED : BATCH_UPDATED, d);
+        }
+    }
+    
+    /* Only callback and log for NEW services */
+    if (is_new) {
+        if (g_discovery.callback) {
+            g_discovery.callback(d->id, d->service, d->ip, d->ctrl_port, d->data_port,
+                                d->caps, false, g_discovery.callback_userdata);
+        }
+        log_info("pn_discovery: found %s '%s' at %s:%d\n", d->service, d->id, d->ip, d->ctrl_port);
+        
+        /* Trigger reactive re-announce so the new service discovers us */
+        if (g_discovery.announcing && !g_discovery.reannounce_pending) {
+            g_discovery.reannounce_delay_sec = get_reannounce_delay();
+            g_discovery.reannounce_pending = true;
+            log_debug("pn_discovery: will re-announce in %d sec (new service joined)\n",
+                      g_discovery.reannounce_delay_sec);
+        }
+    }
+    
+    return (idx >= 0) ? 0 : -1;
+}
+
+/* Is this id one we announce ourselves (directly or by proxy)? */
+static bool is_local_id(const char *id) {
+    if (g_discovery.announcing && strcmp(id, g_discovery.my_service.id) == 0) {
+        return true;
+    }
+    
+    bool found = false;
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED && !found; i++) {
+        found = g_discovery.proxied[i].active && strcmp(g_discovery.proxied[i].id, id) == 0;
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    return found;
+}
+
+/* A peer showed it holds our descriptor at `incarnation` */
+static void vis_note(const struct sockaddr_in *peer, uint32_t incarnation, bool coordinator) {
+    mutex_lock(&g_discovery.vis_mutex);
+    if (g_discovery.vis.active && incarnation == g_discovery.vis.incarnation) {
+        int i;
+        for (i = 0; i < g_discovery.vis.n_peers; i++) {
+            if (g_discovery.vis.peers[i].sin_addr.s_addr == peer->sin_addr.s_addr &&
+                g_discovery.vis.peers[i].sin_port == peer->sin_port) break;
+        }
+        if (i == g_discovery.vis.n_peers && i < PN_VISIBLE_MAX_PEERS) {
+            g_discovery.vis.peers[g_discovery.vis.n_peers++] = *peer;
+        }
+        if (coordinator) g_discovery.vis.coordinator = true;
+        cond_broadcast(&g_discovery.vis_cond);
+    }
+    mutex_unlock(&g_discovery.vis_mutex);
+}
+
+/* Handle "helo" (`parsed` is its descriptor if already decoded, else NULL) */
+static void handle_helo(const char *buf, const char *sender_ip,
+                        const struct sockaddr_in *sender, const pn_service_t *parsed) {
+    pn_service_t d;
+    if (parsed) {
+        d = *parsed;
+    } else if (!parse_descriptor(buf, "", sender_ip, &d)) {
+        return;
+    }
+    registry_update(&d, sender);
+    
+    /* Acknowledge if asked and the registry now holds this incarnation */
+    if (!json_get_int(buf, "ack")) return;
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(d.id);
+    bool held = idx >= 0 && g_discovery.services[idx].incarnation == d.incarnation;
+    mutex_unlock(&g_discovery.services_mutex);
+    if (!held) return;
+    
+    char msg[PN_MAX_MSG_LEN];
+    int pos = build_msg_header(msg, sizeof(msg), "ack");
+    if (pos >= 0) pos = json_add_string(msg, pos, sizeof(msg), "of", d.id, true);
+    if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "inc", (int)d.incarnation, true);
+    if (pos >= 0 && g_discovery.coordinating) {
+        pos = json_add_int(msg, pos, sizeof(msg), "coord", 1, true);
+    }
+    int len = build_msg_end(msg, pos, sizeof(msg));
+    if (len > 0) {
+        tx_submit(PN_TX_ANSWER, 0, sender, msg, len);
+    }
+}
+
+/* Handle "ack": a peer holds one of our descriptors */
+static void handle_ack(const char *buf, const struct sockaddr_in *sender) {
+    char of[PN_MAX_ID_LEN];
+    if (!g_discovery.announcing || !json_get_string(buf, "of", of, sizeof(of))) return;
+    if (strcmp(of, g_discovery.my_service.id) != 0) return;
+    vis_note(sender, (uint32_t)json_get_int(buf, "inc"), json_get_int(buf, "coord") != 0);
+}
+
+/* Handle "phelo": descriptors packed by a proxy */
+static void handle_proxy_helo(const char *buf, const char *sender_ip,
+                              const struct sockaddr_in *sender) {
+    int n = json_get_int(buf, "n");
+    for (int i = 0; i < n && i < PN_MAX_PROXIED; i++) {
+        char sfx[8];
+        pn_service_t d;
+        snprintf(sfx, sizeof(sfx), "%d", i);
+        if (!parse_descriptor(buf, sfx, sender_ip, &d)) break;
+        if (is_local_id(d.id)) continue;
+        registry_update(&d, sender);
+    }
+}
+
+/* Handle "bye": remove from registry */
+static void handle_bye(const char *id, uint32_t incarnation, uint64_t hlc) {
+    mutex_lock(&g_discovery.services_mutex);
+    
+    pn_service_t gone;
+    gone.service[0] = '\0';
+    
+    /* A bye older than the entry belongs to a previous version */
+    int idx = registry_lookup(id);
+    if (idx >= 0 && version_cmp(incarnation, hlc, g_discovery.services[idx].incarnation,
+                                g_discovery.services[idx].hlc) < 0) {
+        mutex_unlock(&g_discovery.services_mutex);
+        merge_count_drop(-1);
+        return;
+    }
+    /* Pinned entries outlive byes */
+    if (idx >= 0 && g_discovery.services[idx].pinned) {
+        mutex_unlock(&g_discovery.services_mutex);
+        log_info("pn_discovery: '%s' left, keeping pinned entry\n", id);
+        return;
+    }
+    if (idx >= 0) {
+        gone = g_discovery.services[idx];
+        registry_release(idx, PN_EVENT_REMOVED);
+    }
+    tomb_put(id, incarnation, hlc);
+    
+    services_unlock();
+    
+    /* Callback */
+    if (gone.service[0]) {
+        gone.active = false;
+        batch_record(BATCH_REMOVED, &gone);
+        if (g_discovery.callback) {
+            g_discovery.callback(id, gone.service, gone.ip, gone.ctrl_port, 0, "", true,
+                                g_discovery.callback_userdata);
+        }
+    }
+    
+    log_info("pn_discovery: '%s' left the network\n", id);
+}
+
+/* Handle "pbye": aggregated bye from a proxy */
+static void handle_proxy_bye(const char *buf) {
+    int n = json_get_int(buf, "n");
+    for (int i = 0; i < n && i < PN_MAX_PROXIED; i++) {
+        char key[16], id[PN_MAX_ID_LEN];
+        snprintf(key, sizeof(key), "id%d", i);
+        if (!json_get_string(buf, key, id, sizeof(id))) break;
+        if (is_local_id(id)) continue;
+        snprintf(key, sizeof(key), "inc%d", i);
+        handle_bye(id, (uint32_t)json_get_int(buf, key), json_get_u64(buf, "hlc"));
+    }
+}
+
+/* Free slots: total - connected - held reservations (-1 if not advertised) */
+static int capacity_remaining_locked(void) {
+    if (g_discovery.capacity_total < 0) return -1;
+    
+    uint64_t now = now_ms();
+    int held = 0;
+    for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+        if (!g_discovery.holds[i].active) continue;
+        if (now >= g_discovery.holds[i].expires) {
+            g_discovery.holds[i].active = false;  /* Client never connected */
+            continue;
+        }
+        held++;
+    }
+    
+    int remaining = g_discovery.capacity_total - g_discovery.capacity_in_use - held;
+    return remaining > 0 ? remaining : 0;
+}
+
+static int capacity_remaining(void) {
+    mutex_lock(&g_discovery.capacity_mutex);
+    int remaining = capacity_remaining_locked();
+    mutex_unlock(&g_discovery.capacity_mutex);
+    return remaining;
+}
+
+/* Build "cap": just our slot count, so peers need not wait for a helo */
+static int build_cap_message(char *buf, int maxlen, int slots) {
+    int pos = build_msg_header(buf, maxlen, "cap");
+    if (pos < 0) return -1;
+    
+    pos = json_add_int(buf, pos, maxlen, "inc", (int)g_discovery.my_service.incarnation, true);
+    if (pos < 0) return -1;
+    
+    pos = json_add_int(buf, pos, maxlen, "slots", slots, true);
+    return build_msg_end(buf, pos, maxlen);
+}
+
+/* Tell the network if our free slot count moved */
+static void capacity_publish(void) {
+    if (!g_discovery.announcing) return;
+    
+    mutex_lock(&g_discovery.capacity_mutex);
+    int remaining = capacity_remaining_locked();
+    bool changed = remaining != g_discovery.capacity_last_sent;
+    g_discovery.capacity_last_sent = remaining;
+    mutex_unlock(&g_discovery.capacity_mutex);
+    
+    if (!changed || remaining < 0) return;
+    
+    char msg[PN_MAX_MSG_LEN];
+    int len = build_cap_message(msg, sizeof(msg), remaining);
+    if (len > 0) {
+        tx_submit(PN_TX_REQUEST, TX_KEY_CAP, NULL, msg, len);
+    }
+}
+
+/* Handle "rsv": hold a slot for a client that is about to connect */
+static void handle_reserve(const char *buf, const struct sockaddr_in *sender) {
+    char to[PN_MAX_ID_LEN];
+    if (!g_discovery.announcing) return;
+    if (!json_get_string(buf, "to", to, sizeof(to))) return;
+    if (strcmp(to, g_discovery.my_service.id) != 0) return;
+    
+    uint32_t nonce = (uint32_t)json_get_int(buf, "nonce");
+    uint32_t token = 0;
+    bool retry = false;
+    mutex_lock(&g_discovery.capacity_mutex);
+    int remaining = capacity_remaining_locked();
+    
+    /* A retry of a request we already granted gets the same hold back */
+    for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+        if (g_discovery.holds[i].active && g_discovery.holds[i].nonce == nonce &&
+            g_discovery.holds[i].client.sin_addr.s_addr == sender->sin_addr.s_addr &&
+            g_discovery.holds[i].client.sin_port == sender->sin_port) {
+            token = g_discovery.holds[i].token;
+            retry = true;
+            break;
+        }
+    }
+    
+    if (!retry && remaining > 0) {
+        for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+            if (!g_discovery.holds[i].active) {
+                token = ++g_discovery.next_token;
+                g_discovery.holds[i].token = token;
+                g_discovery.holds[i].expires = now_ms() + PN_RESERVE_HOLD_SEC * 1000ULL;
+                g_discovery.holds[i].client = *sender;
+                g_discovery.holds[i].nonce = nonce;
+                g_discovery.holds[i].active = true;
+                remaining--;
+                break;
+            }
+        }
+    }
+    if (remaining < 0) remaining = 0;
+    mutex_unlock(&g_discovery.capacity_mutex);
+    
+    char msg[PN_MAX_MSG_LEN];
+    int pos = build_msg_header(msg, sizeof(msg), token ? "rsvok" : "rsvno");
+    if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "nonce", (int)nonce, true);
+    if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "tok", (int)token, true);
+    if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "slots", remaining, true);
+    int len = build_msg_end(msg, pos, sizeof(msg));
+    if (len > 0) {
+        tx_submit(PN_TX_ANSWER, 0, sender, msg, len);
+    }
+    
+    if (token && !retry) {
+        capacity_publish();
+    }
+}
+
+/* Update only the slot count of a registry entry */
+static void registry_set_slots(const char *id, int slots) {
+    bool changed = false;
+    pn_service_t copy;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(id);
+    if (idx >= 0 && g_discovery.services[idx].slots != slots) {
+        g_discovery.services[idx].slots = slots;
+        g_discovery.svc_meta[idx].gen = ++g_discovery.registry_gen;
+        shared_publish(idx);
+        history_append(PN_EVENT_UPDATED, PN_FIELD_SLOTS, idx);
+        copy = g_discovery.services[idx];
+        changed = true;
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    if (changed) {
+        batch_record(BATCH_UPDATED, &copy);
+    }
+}
+
+/* Handle "cap": a server's free slot count changed */
+static void handle_capacity(const char *buf, const char *id) {
+    registry_set_slots(id, json_get_int_def(buf, "slots", -1));
+}
+
+/* Handle "rsvok" / "rsvno": answer to one of our reserve requests */
+static void handle_reserve_reply(const char *buf, const char *id, bool granted) {
+    uint32_t nonce = (uint32_t)json_get_int(buf, "nonce");
+    
+    /* The reply carries the server's new count: apply it right away */
+    registry_set_slots(id, json_get_int_def(buf, "slots", -1));
+    
+    mutex_lock(&g_discovery.reserve_mutex);
+    for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+        if (g_discovery.reserve[i].active && g_discovery.reserve[i].nonce == nonce &&
+            g_discovery.reserve[i].state == RSV_PENDING) {
+            g_discovery.reserve[i].state = granted ? RSV_GRANTED : RSV_DENIED;
+            g_discovery.reserve[i].token = (uint32_t)json_get_int(buf, "tok");
+            cond_broadcast(&g_discovery.reserve_cond);
+            break;
+        }
+    }
+    mutex_unlock(&g_discovery.reserve_mutex);
+}
+
+/* Handle "find": answer unless the querier already knows us */
+static void handle_find(const char *buf, const struct sockaddr_in *sender) {
+    char svc[PN_MAX_SERVICE_LEN] = "";
+    char hex[PN_KA_MAX_BITS / 4 + 1];
+    ka_filter_t filter;
+    bool have_filter = false;
+    
+    json_get_string(buf, "svc", svc, sizeof(svc));
+    
+    /* A lease probe asks for one instance only */
+    char pid[PN_MAX_ID_LEN] = "";
+    json_get_string(buf, "pid", pid, sizeof(pid));
+    
+    /* Known-answer suppression */
+    if (json_get_string(buf, "ka", hex, sizeof(hex))) {
+        have_filter = ka_from_hex(&filter, hex, json_get_int(buf, "kb"), json_get_int(buf, "kh")) == 0;
+    }
+    
+    char msg[PN_MAX_MSG_LEN];
+    int len;
+
+    if (g_discovery.announcing &&
+        (!svc[0] || strcmp(svc, g_discovery.my_service.service) == 0) &&
+        (!pid[0] || strcmp(pid, g_discovery.my_service.id) == 0) &&
+        !(have_filter && ka_contains(&filter, g_discovery.my_service.id,
+                                     g_discovery.my_service.incarnation))) {
+        len = build_helo_message(msg, sizeof(msg));
+        if (len > 0) {
+            tx_submit(PN_TX_ANSWER, 0, sender, msg, len);
+        }
+    }
+    
+    /* Answer on behalf of proxied services */
+    if (!g_discovery.proxying) return;
+    
+    pn_service_t answers[PN_MAX_PROXIED];
+    int n = 0;
+    uint32_t lease = lease_request(g_discovery.proxy_idle);
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        const pn_service_t *p = &g_discovery.proxied[i];
+        if (!p->active) continue;
+        if (svc[0] && strcmp(svc, p->service) != 0) continue;
+        if (pid[0] && strcmp(pid, p->id) != 0) continue;
+        if (have_filter && ka_contains(&filter, p->id, p->incarnation)) continue;
+        answers[n] = *p;
+        answers[n++].lease = lease;
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    for (int next = 0; next < n; ) {
+        len = build_proxy_helo_message(msg, sizeof(msg), answers, n, &next);
+        if (len < 0) break;
+        tx_submit(PN_TX_ANSWER, 0, sender, msg, len);
+    }
+}
+
+/*
+ * Build one "snap" part: records from *next on, each with its own version
+ * stamp and the discovery socket it was heard from (none for our own). The
+ * last part also carries the part count.
+ */
+static int build_snap_message(char *buf, int maxlen, const pn_service_t *svcs,
+                              const struct sockaddr_in *srcs, int count, int *next,
+                              uint32_t nonce, uint64_t gen, int part) {
+    int pos = build_msg_header(buf, maxlen, "snap");
+    if (pos >= 0) pos = json_add_int(buf, pos, maxlen, "nonce", (int)nonce, true);
+    if (pos >= 0) pos = json_add_u64(buf, pos, maxlen, "gen", gen, true);
+    if (pos >= 0) pos = json_add_int(buf, pos, maxlen, "part", part, true);
+    if (pos < 0) return -1;
+    
+    int packed = 0;
+    while (*next < count) {
+        char rec[PN_MAX_MSG_LEN], key[16], src[PN_MAX_IP_LEN + 8];
+        int rpos = build_record(rec, sizeof(rec), &svcs[*next], packed);
+        snprintf(key, sizeof(key), "hlc%d", packed);
+        if (rpos >= 0) rpos = json_add_u64(rec, rpos, sizeof(rec), key, svcs[*next].hlc, true);
+        if (rpos >= 0 && srcs[*next].sin_port) {
+            char ip[PN_MAX_IP_LEN];
+            inet_ntop(AF_INET, &srcs[*next].sin_addr, ip, sizeof(ip));
+            snprintf(src, sizeof(src), "%s:%d", ip, ntohs(srcs[*next].sin_port));
+            snprintf(key, sizeof(key), "src%d", packed);
+            rpos = json_add_string(rec, rpos, sizeof(rec), key, src, true);
+        }
+        if (rpos < 0) return -1;
+        
+        if (pos + rpos + SNAP_TRAILER_LEN >= maxlen) {
+            if (packed == 0) return -1;
+            break;
+        }
+        memcpy(buf + pos, rec, rpos);
+        pos += rpos;
+        packed++;
+        (*next)++;
+    }
+    
+    if (*next >= count) pos = json_add_int(buf, pos, maxlen, "parts", part + 1, true);
+    return build_proxy_trailer(buf, pos, maxlen, packed);
+}
+
+/*
+ * Collect what a transfer carries: our own and proxied services, then the
+ * registry entries changed after generation `since`. Returns the count and
+ * the generation the copy is complete up to; it is read first, so a change
+ * committed meanwhile may be in the copy and still count as newer.
+ */
+static int snap_collect(pn_service_t *svcs, struct sockaddr_in *srcs, uint32_t since,
+                        uint32_t *gen_out) {
+    int n = 0;
+    memset(srcs, 0, sizeof(*srcs) * (PN_MAX_SERVICES + PN_MAX_PROXIED + 1));
+    mutex_lock(&g_discovery.services_mutex);
+    uint32_t gen = g_discovery.registry_gen;
+    mutex_unlock(&g_discovery.services_mutex);
+
+    /* What we announce ourselves is part of the segment too */
+    if (g_discovery.announcing) {
+        svcs[n] = g_discovery.my_service;
+        svcs[n].lease = lease_request(g_discovery.announce_idle);
+        svcs[n++].hlc = hlc_now();
+    }
+    uint32_t lease = lease_request(g_discovery.proxy_idle);
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active) {
+            svcs[n] = g_discovery.proxied[i];
+            svcs[n].lease = lease;
+            svcs[n++].hlc = hlc_now();
+        }
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    /* A generation we have not reached yet means everything */
+    mutex_lock(&g_discovery.services_mutex);
+    if (since > gen) since = 0;
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (g_discovery.services[i].active && g_discovery.svc_meta[i].gen > since) {
+            svcs[n] = g_discovery.services[i];
+            srcs[n++] = g_discovery.svc_meta[i].src;
+        }
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    *gen_out = gen;
+    return n;
+}
+
+/* Transfer generation as sent: our epoch in the high half, so a restart shows */
+static uint64_t sync_gen(uint32_t gen) {
+    return ((uint64_t)g_discovery.registry_epoch << 32) | gen;
+}
+
+/*
+ * Cookie a "sync" sender must echo before it gets an answer bigger than its
+ * request: proves it receives at its source address. Keyed by a per-run
+ * secret, changes every minute.
+ */
+static uint64_t sync_cookie(const struct sockaddr_in *addr, uint32_t minute) {
+    uint64_t z = g_discovery.sync_secret ^ ((uint64_t)ntohl(addr->sin_addr.s_addr) << 16) ^
+                 ntohs(addr->sin_port);
+    for (int round = 0; round < 2; round++) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= (z >> 31) ^ ((uint64_t)minute << 32) ^ (g_discovery.sync_secret >> 7);
+    }
+    return z ? z : 1;
+}
+
+/* Count an answer against its source: a few per second for each */
+static bool sync_admit(const struct sockaddr_in *sender) {
+    uint32_t now = (uint32_t)time(NULL);
+    int slot = -1, oldest = 0;
+    for (int i = 0; i < SYNC_SOURCES && slot < 0; i++) {
+        if (g_discovery.sync_srcs[i].addr.sin_addr.s_addr == sender->sin_addr.s_addr &&
+            g_discovery.sync_srcs[i].addr.sin_port == sender->sin_port) {
+            slot = i;
+        } else if (g_discovery.sync_srcs[i].window < g_discovery.sync_srcs[oldest].window) {
+            oldest = i;
+        }
+    }
+    if (slot < 0) {
+        slot = oldest;
+        g_discovery.sync_srcs[slot].addr = *sender;
+        g_discovery.sync_srcs[slot].window = 0;
+    }
+    
+    if (g_discovery.sync_srcs[slot].window != now) {
+        g_discovery.sync_srcs[slot].window = now;
+        g_discovery.sync_srcs[slot].answered = 0;
+    }
+    if (g_discovery.sync_srcs[slot].answered >= SYNC_PER_SEC) return false;
+    g_discovery.sync_srcs[slot].answered++;
+    return true;
+}
+
+/*
+ * Handle "sync": send our registry (or what changed since "since") as "snap"
+ * parts. A sender that has not echoed our cookie gets a "synck" carrying one
+ * instead, unless the answer is within SYNC_AMPLIFY times its request.
+ */
+static void handle_sync(const char *buf, const struct sockaddr_in *sender) {
+    /* Each answer is a burst: a few per second per source */
+    if (!sync_admit(sender)) return;
+    
+    /* A generation from another epoch (before our restart) means everything */
+    uint64_t since = json_get_u64(buf, "since");
+    if ((uint32_t)(since >> 32) != g_discovery.registry_epoch) since = 0;
+    
+    pn_service_t svcs[PN_MAX_SERVICES + PN_MAX_PROXIED + 1];
+    struct sockaddr_in srcs[PN_MAX_SERVICES + PN_MAX_PROXIED + 1];
+    uint32_t gen;
+    int n = snap_collect(svcs, srcs, (uint32_t)since, &gen);
+    
+    /* At least one part, so an empty answer still completes the transfer */
+    uint32_t nonce = (uint32_t)json_get_int(buf, "nonce");
+    char msgs[SNAP_MAX_PARTS][PN_MAX_MSG_LEN];
+    const char *ptrs[SNAP_MAX_PARTS];
+    int lens[SNAP_MAX_PARTS], k = 0, total = 0;
+    for (int next = 0; (k == 0 || next < n) && k < SNAP_MAX_PARTS; ) {
+        int len = build_snap_message(msgs[k], sizeof(msgs[k]), svcs, srcs, n, &next,
+                                     nonce, sync_gen(gen), k);
+        if (len < 0) break;
+        ptrs[k] = msgs[k];
+        total += len;
+        lens[k++] = len;
+    }
+    if (k == 0) return;
+    
+    uint32_t minute = (uint32_t)time(NULL) / 60;
+    uint64_t ck = json_get_u64(buf, "ck");
+    bool verified = ck && (ck == sync_cookie(sender, minute) || ck == sync_cookie(sender, minute - 1));
+    if (!verified && total > SYNC_AMPLIFY * (int)strlen(buf)) {
+        char msg[PN_MAX_MSG_LEN];
+        int pos = build_msg_header(msg, sizeof(msg), "synck");
+        if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "nonce", (int)nonce, true);
+        if (pos >= 0) pos = json_add_u64(msg, pos, sizeof(msg), "ck", sync_cookie(sender, minute), true);
+        int len = build_msg_end(msg, pos, sizeof(msg));
+        if (len > 0) tx_submit(PN_TX_ANSWER, 0, sender, msg, len);
+        return;
+    }
+    tx_submit_burst(PN_TX_ANSWER, 0, sender, ptrs, lens, k);
+}
+
+/* Is this the nonce of a recent "sync" of ours? Caller holds boot_mutex. */
+static bool boot_nonce_ours(uint32_t nonce) {
+    int n = g_discovery.boot.sent < BOOT_NONCES ? g_discovery.boot.sent : BOOT_NONCES;
+    for (int i = 0; i < n; i++) {
+        if (g_discovery.boot.nonces[i] == nonce) return true;
+    }
+    return false;
+}
+
+/* Handle "synck": the peer wants its cookie back before sending the transfer */
+static void handle_synck(const char *buf) {
+    uint32_t nonce = (uint32_t)json_get_int(buf, "nonce");
+    mutex_lock(&g_discovery.boot_mutex);
+    if (g_discovery.boot.active && boot_nonce_ours(nonce)) {
+        g_discovery.boot.cookie = json_get_u64(buf, "ck");
+        cond_broadcast(&g_discovery.boot_cond);
+    }
+    mutex_unlock(&g_discovery.boot_mutex);
+}
+
+/*
+ * Handle "snap": merge one part of a transfer we asked for. The first part
+ * accepted pins its answer; parts of any other answer are ignored until
+ * that one completes or a retry gives it up.
+ */
+static void handle_snap(const char *buf, const struct sockaddr_in *sender) {
+    uint32_t nonce = (uint32_t)json_get_int(buf, "nonce");
+    uint64_t gen = json_get_u64(buf, "gen");
+    int part = json_get_int(buf, "part");
+    if (part < 0 || part >= SNAP_MAX_PARTS) return;
+    
+    mutex_lock(&g_discovery.boot_mutex);
+    bool wanted = g_discovery.boot.active && boot_nonce_ours(nonce) &&
+                  (!g_discovery.boot.pinned ||
+                   (g_discovery.boot.answer == nonce && g_discovery.boot.gen == gen)) &&
+                  !(g_discovery.boot.parts_seen & (1ULL << part));
+    if (wanted && !g_discovery.boot.pinned) {
+        g_discovery.boot.pinned = true;
+        g_discovery.boot.answer = nonce;
+        g_discovery.boot.gen = gen;
+    }
+    mutex_unlock(&g_discovery.boot_mutex);
+    if (!wanted) return;
+    
+    char sender_ip[PN_MAX_IP_LEN];
+    inet_ntop(AF_INET, &sender->sin_addr, sender_ip, sizeof(sender_ip));
+    
+    int n = json_get_int(buf, "n"), merged = 0;
+    for (int i = 0; i < n && i < PN_MAX_SERVICES + PN_MAX_PROXIED + 1; i++) {
+        char sfx[8], key[16], src[PN_MAX_IP_LEN + 8];
+        struct sockaddr_in from = *sender;
+        pn_service_t d;
+        snprintf(sfx, sizeof(sfx), "%d", i);
+        if (!parse_descriptor(buf, sfx, sender_ip, &d)) break;
+        snprintf(key, sizeof(key), "src%d", i);
+        if (json_get_string(buf, key, src, sizeof(src)) && parse_peer_addr(src, &from) < 0) {
+            from = *sender;
+        }
+        merged++;
+        if (is_local_id(d.id)) continue;
+        registry_update(&d, &from);
+    }
+    
+    mutex_lock(&g_discovery.boot_mutex);
+    if (g_discovery.boot.active && g_discovery.boot.pinned && g_discovery.boot.answer == nonce) {
+        g_discovery.boot.parts_seen |= 1ULL << part;
+        g_discovery.boot.received += merged;
+        g_discovery.boot.progress = true;
+        int parts = json_get_int(buf, "parts");
+        if (parts > 0 && parts <= SNAP_MAX_PARTS) g_discovery.boot.parts = parts;
+        
+        parts = g_discovery.boot.parts;
+        uint64_t all = (parts == SNAP_MAX_PARTS) ? ~0ULL : ((1ULL << parts) - 1);
+        if (parts > 0 && (g_discovery.boot.parts_seen & all) == all) {
+            g_discovery.boot.done = true;
+            cond_broadcast(&g_discovery.boot_cond);
+        }
+    }
+    mutex_unlock(&g_discovery.boot_mutex);
+}
+
+/* Is demand mode on here, or on an announcer heard within the interest TTL? */
+static bool demand_in_use(uint32_t now) {
+    return g_discovery.demand ||
+           (g_discovery.demand_heard && now - g_discovery.demand_heard < PN_INTEREST_TTL_SEC);
+}
+
+/* An announcer in demand mode spoke: advertise our interest now if we were not */
+static void demand_note(const char *buf) {
+    if (!json_get_int(buf, "dm")) return;
+    uint32_t now = (uint32_t)time(NULL);
+    if (!demand_in_use(now)) g_discovery.interest_sent = 0;
+    g_discovery.demand_heard = now;
+}
+
+/*
+ * Record the interest carried by a helo or "want". An idle announcer whose
+ * type just became wanted re-announces within a couple of seconds.
+ */
+static void interest_note(const char *buf) {
+    char hex[INTEREST_BITS / 4 + 1];
+    if (!json_get_string(buf, "im", hex, sizeof(hex))) return;
+    if ((uint32_t)json_get_u64(buf, "tag") == g_discovery.interest_tag) return;
+    
+    uint64_t mask = strtoull(hex, NULL, 16);
+    uint32_t now = (uint32_t)time(NULL);
+    bool own_wakes = g_discovery.announce_idle &&
+                     (mask & (1ULL << interest_bit(g_discovery.my_service.service)));
+    for (int b = 0; b < INTEREST_BITS; b++) {
+        if (mask & (1ULL << b)) g_discovery.interest_seen[b] = now;
+    }
+    
+    if (own_wakes && !g_discovery.reannounce_pending) {
+        g_discovery.reannounce_delay_sec = 1 + (int)(rng_next() % 2);
+        g_discovery.reannounce_pending = true;
+    }
+    if (g_discovery.proxy_idle) {
+        mutex_lock(&g_discovery.proxy_mutex);
+        for (int i = 0; i < PN_MAX_PROXIED; i++) {
+            if (g_discovery.proxied[i].active &&
+                (mask & (1ULL << interest_bit(g_discovery.proxied[i].service)))) {
+                g_discovery.proxy_dirty = true;
+                break;
+            }
+        }
+        mutex_unlock(&g_discovery.proxy_mutex);
+    }
+}
+
+/* Listening without regular helos to carry our interest: send a "want" now and then */
+static void interest_advertise_if_due(void) {
+    if (g_discovery.announcing && !g_discovery.announce_idle) return;
+    uint32_t now = (uint32_t)time(NULL);
+    if (!demand_in_use(now)) return;
+    if (g_discovery.interest_sent && now - g_discovery.interest_sent < PN_ANNOUNCE_MAX_SEC) return;
+    g_discovery.interest_sent = now;
+    
+    char msg[PN_MAX_MSG_LEN];
+    int pos = build_msg_header(msg, sizeof(msg), "want");
+    if (pos >= 0) pos = json_add_u64(msg, pos, sizeof(msg), "tag", g_discovery.interest_tag, true);
+    if (pos >= 0) pos = interest_add(msg, pos, sizeof(msg));
+    int len = build_msg_end(msg, pos, sizeof(msg));
+    if (len > 0) tx_submit(PN_TX_KEEPALIVE, TX_KEY_WANT, NULL, msg, len);
+}
+
+/* Parse incoming message */
+static int parse_message(const char *buf, int len, const struct sockaddr_in *sender,
+                         const pn_service_t *helo) {
+    char magic[8], cmd[16], id[PN_MAX_ID_LEN] = "";
+    char sender_ip[PN_MAX_IP_LEN];
+    (void)len;
+    
+    /* Verify magic */
+    if (!json_get_string(buf, "m", magic, sizeof(magic))) return -1;
+    if (strcmp(magic, PN_MAGIC) != 0) return -1;
+    
+    /* Get command */
+    if (!json_get_string(buf, "cmd", cmd, sizeof(cmd))) return -1;
+    
+    /* Get ID (may be empty for queries from non-announcing nodes) */
+    json_get_string(buf, "id", id, sizeof(id));
+    
+    /* Keep our clock ahead of everything we have seen */
+    hlc_observe(json_get_u64(buf, "hlc"));
+    
+    /* Ignore our own messages */
+    if (g_discovery.announcing && strcmp(id, g_discovery.my_service.id) == 0) {
+        return 0;
+    }
+    
+    inet_ntop(AF_INET, &sender->sin_addr, sender_ip, sizeof(sender_ip));
+    interest_note(buf);
+    demand_note(buf);
+    
+    /* Commands where "id" is optional */
+    if (strcmp(cmd, "want") == 0) {
+        return 0;
+    } else if (strcmp(cmd, "find") == 0) {
+        handle_find(buf, sender);
+        return 0;
+    } else if (strcmp(cmd, "rsv") == 0) {
+        handle_reserve(buf, sender);
+        return 0;
+    } else if (strcmp(cmd, "phelo") == 0) {
+        handle_proxy_helo(buf, sender_ip, sender);
+        return 0;
+    } else if (strcmp(cmd, "pbye") == 0) {
+        handle_proxy_bye(buf);
+        return 0;
+    } else if (strcmp(cmd, "sync") == 0) {
+        handle_sync(buf, sender);
+        return 0;
+    } else if (strcmp(cmd, "snap") == 0) {
+        handle_snap(buf, sender);
+        return 0;
+    } else if (strcmp(cmd, "synck") == 0) {
+        handle_synck(buf);
+        return 0;
+    } else if (strcmp(cmd, "ack") == 0) {
+        handle_ack(buf, sender);
+        return 0;
+    }
+    
+    if (!id[0]) return -1;
+    
+    if (strcmp(cmd, "helo") == 0) {
+        handle_helo(buf, sender_ip, sender, helo);
+    } else if (strcmp(cmd, "cap") == 0) {
+        handle_capacity(buf, id);
+    } else if (strcmp(cmd, "rsvok") == 0 || strcmp(cmd, "rsvno") == 0) {
+        handle_reserve_reply(buf, id, cmd[3] == 'o');
+    } else if (strcmp(cmd, "bye") == 0) {
+        handle_bye(id, (uint32_t)json_get_int(buf, "inc"), json_get_u64(buf, "hlc"));
+    }
+    
+    return 0;
+}
+
+/* Private random stream (splitmix64): lock-free, independent of libc rand() */
+static uint64_t rng_next(void) {
+    uint64_t z = atomic_add_u64(&g_discovery.rng_state, 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Get random re-announce interval (shorter, for responding to new services) */
+static int get_reannounce_delay(void) {
+    return 2 + (int)(rng_next() % 9);  /* 2-10 seconds */
+}
+
+/* Heartbeat period: the middle of the configured interval range */
+static uint64_t sched_period_ms(void) {
+    mutex_lock(&g_discovery.cfg_mutex);
+    uint64_t period = (uint64_t)(g_discovery.cfg.announce_min_sec +
+                                 g_discovery.cfg.announce_max_sec) * 500;
+    mutex_unlock(&g_discovery.cfg_mutex);
+    return period > 0 ? period : 1000;
+}
+
+/* Nobody wants our type: beacon slowly until a listener shows interest */
+static bool announce_should_idle(void) {
+    return g_discovery.demand && g_discovery.listening &&
+           !interest_wanted(g_discovery.my_service.service);
+}
+
+/*
+ * Lease to ask receivers for: three gaps until our next heartbeat (the
+ * beacon if `idle`), if that beats PN_LEASE_SEC (else 0)
+ */
+static uint32_t lease_request(bool idle) {
+    uint64_t gap = idle ? PN_BEACON_SEC * 1000ULL : sched_period_ms();
+    uint32_t lease = (uint32_t)((gap * 3 + 999) / 1000);
+    return (lease > PN_LEASE_SEC) ? lease : 0;
+}
+
+/*
+ * Phase of a sender within the heartbeat period. Alone, the key hash places
+ * it; among n - 1 other observed senders it takes the centre of the slot its
+ * key ranks into, so every node that sees the same population lays the same
+ * evenly spaced grid. A proxy round sits half a slot after its node's helo.
+ */
+static uint64_t sched_phase_for(uint32_t self, const uint32_t *keys, int n,
+                                uint64_t period, bool proxy) {
+    uint64_t phase;
+    int total = n + 1, rank = 0;
+    for (int i = 0; i < n; i++) {
+        if (keys[i] < self) rank++;
+    }
+    if (n == 0) {
+        phase = ((uint64_t)self * period) >> 32;
+    } else {
+        phase = (2 * (uint64_t)rank + 1) * period / (2 * (uint64_t)total);
+    }
+    if (proxy) phase += period / (2 * (uint64_t)total);
+    return phase % period;
+}
+
+/*
+ * Schedule key of a sender: the lowest id hash among what it announces,
+ * which is also how others group its entries by source socket
+ */
+static uint32_t sched_self_key(void) {
+    uint32_t key = UINT32_MAX;
+    if (g_discovery.announcing) key = pn_history_id_handle(g_discovery.my_service.id);
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active) {
+            uint32_t h = pn_history_id_handle(g_discovery.proxied[i].id);
+            if (h < key) key = h;
+        }
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    return key;
+}
+
+/* Our phase given the senders observed in the registry */
+static uint64_t sched_phase(uint64_t period, bool proxy) {
+    struct sockaddr_in src[PN_MAX_SERVICES];
+    uint32_t keys[PN_MAX_SERVICES];
+    uint32_t self = sched_self_key();
+    int n = 0;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        const pn_service_t *s = &g_discovery.services[i];
+        const struct sockaddr_in *from = &g_discovery.svc_meta[i].src;
+        if (!s->active || s->pinned || !from->sin_port) continue;
+        
+        uint32_t h = pn_history_id_handle(s->id);
+        int g = 0;
+        while (g < n && (src[g].sin_addr.s_addr != from->sin_addr.s_addr ||
+                         src[g].sin_port != from->sin_port)) g++;
+        if (g == n) {
+            src[n] = *from;
+            keys[n++] = h;
+        } else if (h < keys[g]) {
+            keys[g] = h;
+        }
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    return sched_phase_for(self, keys, n, period, proxy);
+}
+
+/* First point on a phase grid at or after from (both wall-clock ms) */
+static uint64_t sched_due(uint64_t from, uint64_t period, uint64_t phase) {
+    uint64_t due = from - from % period + phase;
+    return (due < from) ? due + period : due;
+}
+
+/*
+ * Monotonic time of the next heartbeat after one sent at last_ms: the first
+ * point on the phase grid at least half a period on, with the clocks read as
+ * mono and wall (test/sim_heartbeat.c calls this with simulated clocks). The
+ * grid is anchored to wall-clock time so nodes that boot together still
+ * spread out.
+ */
+static uint64_t sched_next_at(uint64_t last_ms, uint64_t period, uint64_t phase,
+                              uint64_t mono, uint64_t wall) {
+    uint64_t from = wall + (last_ms + period / 2 > mono ? last_ms + period / 2 - mono : 0);
+    return mono + (sched_due(from, period, phase) - wall);
+}
+
+/* Next heartbeat after one sent at last_ms, on our phase among the senders heard */
+static uint64_t sched_next(uint64_t last_ms, uint64_t period, bool proxy) {
+    uint64_t phase = sched_phase(period, proxy);
+    return sched_next_at(last_ms, period, phase, now_ms(), wall_ms());
+}
+
+/*
+ * One step of the announce schedule at now_ms() `now`; returns when it wants
+ * the next step. Stepped by the announce thread, or by the engine thread
+ * under engine_mutex.
+ */
+static uint64_t announce_step(uint64_t now) {
+    char msg[PN_MAX_MSG_LEN];
+    int len;
+    
+    /* Initial announcement */
+    if (!g_discovery.ann.started) {
+        g_discovery.announce_idle = announce_should_idle();
+        len = build_helo_message(msg, sizeof(msg));
+        if (len > 0) {
+            tx_submit(PN_TX_CHANGE, TX_KEY_HELO, NULL, msg, len);
+        }
+        g_discovery.ann.started = true;
+        g_discovery.ann.last = now;
+        g_discovery.ann.due = 0;
+    }
+    
+    /* Interval reconfigured: announce now and start a fresh one */
+    if (g_discovery.ann.due && g_discovery.sched_gen != g_discovery.ann.gen) {
+        g_discovery.ann.due = now;
+    }
+    
+    if (g_discovery.ann.due == 0) {
+        uint64_t period = sched_period_ms();
+        g_discovery.ann.gen = g_discovery.sched_gen;
+        
+        /* Idle was decided with the helo just sent, whose lease covers the beacon */
+        if (g_discovery.announce_idle) period = PN_BEACON_SEC * 1000ULL;
+        g_discovery.ann.due = sched_next(g_discovery.ann.last, period, false);
+        g_discovery.ann.chore = now + 1000;
+    }
+    
+    /* Once a second: lapsed reservations, reactive re-announce */
+    if (now >= g_discovery.ann.chore) {
+        g_discovery.ann.chore = now + 1000;
+        capacity_publish();
+        
+        /* A new service joined the network */
+        if (g_discovery.reannounce_pending && --g_discovery.reannounce_delay_sec <= 0) {
+            g_discovery.reannounce_pending = false;
+            g_discovery.announce_idle = announce_should_idle();
+            len = build_helo_message(msg, sizeof(msg));
+            if (len > 0) {
+                log_debug("pn_discovery: re-announcing (reactive)\n");
+                tx_submit(PN_TX_CHANGE, TX_KEY_HELO, NULL, msg, len);
+            }
+            g_discovery.ann.last = now;
+            g_discovery.ann.due = 0;  /* Reset the main interval */
+            return now;
+        }
+    }
+    
+    /* Regular periodic announcement (a pending reactive one supersedes it) */
+    if (now >= g_discovery.ann.due) {
+        g_discovery.announce_idle = announce_should_idle();
+        if (!g_discovery.reannounce_pending) {
+            len = build_helo_message(msg, sizeof(msg));
+            if (len > 0) {
+                tx_submit(PN_TX_KEEPALIVE, TX_KEY_HELO, NULL, msg, len);
+            }
+        }
+        g_discovery.ann.last = now;
+        g_discovery.ann.due = 0;
+        return now;
+    }
+    
+    return (g_discovery.ann.due < g_discovery.ann.chore) ? g_discovery.ann.due : g_discovery.ann.chore;
+}
+
+/* Announce thread */
+#ifdef _WIN32
+static DWORD WINAPI announce_thread_func(LPVOID param) {
+#else
+static void* announce_thread_func(void *param) {
+#endif
+    (void)param;
+    
+    while (g_discovery.announce_running) {
+        uint64_t next = announce_step(now_ms());
+        tx_sleep(tx_wake(now_ms(), next));
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* Longest the listener may block: 1 s, or the batch window if that is shorter */
+static int listen_timeout_ms(void) {
+    int ms = 1000;
+    if (g_discovery.batch_callback && g_discovery.batch_window_ms < ms) {
+        ms = g_discovery.batch_window_ms;
+    }
+    return ms;
+}
+
+/* Receive timeout for the listener thread */
+static void set_listen_timeout(void) {
+    int ms = listen_timeout_ms();
+#ifdef _WIN32
+    DWORD timeout = (DWORD)ms;
+    setsockopt(g_discovery.sock, SOL_SOCKET, SO_RCVTIMEO, 
+               (const char*)&timeout, sizeof(timeout));
+#else
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(g_discovery.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+/* Wait up to wait_ms for a datagram; true if one is waiting */
+static bool socket_wait(socket_t sock, int wait_ms) {
+    fd_set fds;
+    struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    return select((int)sock + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/* Is a datagram waiting? (non-blocking) */
+static bool socket_readable(socket_t sock) {
+    return socket_wait(sock, 0);
+}
+
+/* Lease an entry holds: what its announcer asked for, within PN_LEASE_SEC..PN_LEASE_MAX_SEC */
+static uint32_t lease_sec(const pn_service_t *s) {
+    if (s->lease <= PN_LEASE_SEC) return PN_LEASE_SEC;
+    return (s->lease < PN_LEASE_MAX_SEC) ? s->lease : PN_LEASE_MAX_SEC;
+}
+
+/* Silence after which an entry is suspected and probed: PN_SUSPECT_SEC, scaled with its lease */
+static uint32_t lease_suspect_sec(const pn_service_t *s) {
+    return (uint32_t)((uint64_t)lease_sec(s) * PN_SUSPECT_SEC / PN_LEASE_SEC);
+}
+
+/*
+ * Classify a helo-style descriptor against the registry. A heartbeat for an
+ * entry we are probing or that is past its suspect point renews the lease,
+ * so it is kept like a change rather than shed.
+ */
+static int classify_descriptor(const pn_service_t *d) {
+    int cls = PN_INGEST_NEW;
+    uint32_t now = (uint32_t)time(NULL);
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(d->id);
+    if (merge_verdict(d, idx) <= 0) {
+        cls = PN_INGEST_KEEPALIVE;    /* Duplicate or stale: sheddable */
+    } else if (idx >= 0) {
+        const pn_health_t *h = &g_discovery.svc_meta[idx].health;
+        uint32_t silent = (now > h->alive) ? now - h->alive : 0;
+        bool renewing = h->probes > 0 || silent >= lease_suspect_sec(&g_discovery.services[idx]);
+        cls = (renewing || descriptor_changed(&g_discovery.services[idx], d)) ?
+              PN_INGEST_CHANGE : PN_INGEST_KEEPALIVE;
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    return cls;
+}
+
+/*
+ * Header decode: which priority class does this datagram belong to? A helo
+ * keeps its decoded descriptor so parse_message() need not decode it again.
+ */
+static int ingest_classify(ingest_msg_t *m) {
+    char magic[8], cmd[16], sender_ip[PN_MAX_IP_LEN];
+    const char *buf = m->buf;
+    const struct sockaddr_in *sender = &m->sender;
+    pn_service_t d;
+    
+    m->parsed = false;
+    if (!json_get_string(buf, "m", magic, sizeof(magic))) return -1;
+    if (strcmp(magic, PN_MAGIC) != 0) return -1;
+    if (!json_get_string(buf, "cmd", cmd, sizeof(cmd))) return -1;
+    
+    if (strcmp(cmd, "bye") == 0 || strcmp(cmd, "pbye") == 0) {
+        return PN_INGEST_BYE;
+    }
+    
+    inet_ntop(AF_INET, &sender->sin_addr, sender_ip, sizeof(sender_ip));
+    
+    if (strcmp(cmd, "helo") == 0) {
+        if (!parse_descriptor(buf, "", sender_ip, &m->helo)) return -1;
+        m->parsed = true;
+        int cls = classify_descriptor(&m->helo);
+
+        /* An ack request waits on us like a query */
+        if (cls > PN_INGEST_QUERY && json_get_int(buf, "ack")) cls = PN_INGEST_QUERY;
+        return cls;
+    }
+    
+    if (strcmp(cmd, "phelo") == 0) {
+        /* Most urgent record decides */
+        int cls = PN_INGEST_KEEPALIVE;
+        int n = json_get_int(buf, "n");
+        for (int i = 0; i < n && i < PN_MAX_PROXIED && cls != PN_INGEST_NEW; i++) {
+            char sfx[8];
+            snprintf(sfx, sizeof(sfx), "%d", i);
+            if (!parse_descriptor(buf, sfx, sender_ip, &d)) break;
+            int c = classify_descriptor(&d);
+            if (c < cls) cls = c;
+        }
+        return cls;
+    }
+    
+    /* Queries and anything else that wants an answer */
+    return PN_INGEST_QUERY;
+}
+
+/* Queue a received datagram by class */
+static void ingest_enqueue(int slot, int cls) {
+    int tail = (g_discovery.ingest_head[cls] + g_discovery.ingest_count[cls]) % PN_INGEST_SLOTS;
+    g_discovery.ingest_queue[cls][tail] = slot;
+    g_discovery.ingest_count[cls]++;
+    
+    mutex_lock(&g_discovery.stats_mutex);
+    g_discovery.ingest_stats.received[cls]++;
+    mutex_unlock(&g_discovery.stats_mutex);
+}
+
+static int ingest_dequeue(int cls) {
+    int slot = g_discovery.ingest_queue[cls][g_discovery.ingest_head[cls]];
+    g_discovery.ingest_head[cls] = (g_discovery.ingest_head[cls] + 1) % PN_INGEST_SLOTS;
+    g_discovery.ingest_count[cls]--;
+    return slot;
+}
+
+/* Is part of a coalesced buffer still waiting to be split? */
+static bool gro_pending(void) {
+#ifdef __linux__
+    return g_discovery.gro_off < g_discovery.gro_len;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Read the next datagram: the next segment of a GRO buffer being split, or
+ * a fresh read. With GRO the kernel may hand over a burst from one sender
+ * as one buffer of equal-size segments (the last may be shorter).
+ */
+static int ingest_read(ingest_msg_t *m) {
+    socklen_t sender_len = sizeof(m->sender);
+    
+#ifdef __linux__
+    if (!gro_pending() && g_discovery.udp_gro) {
+        char ctrl[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr mh;
+        iov.iov_base = g_discovery.gro_buf;
+        iov.iov_len = sizeof(g_discovery.gro_buf);
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_name = &g_discovery.gro_sender;
+        mh.msg_namelen = sizeof(g_discovery.gro_sender);
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        
+        int len = (int)recvmsg(g_discovery.sock, &mh, 0);
+        if (len <= 0) return len;
+        
+        int seg = len;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            }
+        }
+        if (seg <= 0 || seg > len) seg = len;
+        g_discovery.gro_len = len;
+        g_discovery.gro_off = 0;
+        g_discovery.gro_seg = seg;
+        
+        if (seg < len) {
+            mutex_lock(&g_discovery.stats_mutex);
+            g_discovery.ingest_stats.coalesced += (uint64_t)((len + seg - 1) / seg);
+            mutex_unlock(&g_discovery.stats_mutex);
+        }
+    }
+    
+    if (gro_pending()) {
+        int len = g_discovery.gro_len - g_discovery.gro_off;
+        if (len > g_discovery.gro_seg) len = g_discovery.gro_seg;
+        int copy = (len < (int)sizeof(m->buf) - 1) ? len : (int)sizeof(m->buf) - 1;
+        memcpy(m->buf, g_discovery.gro_buf + g_discovery.gro_off, (size_t)copy);
+        m->sender = g_discovery.gro_sender;
+        g_discovery.gro_off += len;
+        return copy;
+    }
+#endif
+    
+    return (int)recvfrom(g_discovery.sock, m->buf, sizeof(m->buf) - 1, 0,
+                         (struct sockaddr*)&m->sender, &sender_len);
+}
+
+/*
+ * Receive one datagram into the pool and classify it. When the pool is full
+ * it is read aside and takes the place of a queued keepalive once accepted;
+ * with no keepalive queued it stays in the socket buffer, so higher classes
+ * are never dropped here.
+ */
+static void ingest_receive(void) {
+    bool full = g_discovery.ingest_n_free == 0;
+    if (full && g_discovery.ingest_count[PN_INGEST_KEEPALIVE] == 0) return;
+    
+    int slot = full ? -1 : g_discovery.ingest_free[g_discovery.ingest_n_free - 1];
+    ingest_msg_t *m = full ? &g_discovery.ingest_spare : &g_discovery.ingest_pool[slot];
+    m->len = ingest_read(m);
+    if (m->len <= 0) return;
+    m->buf[m->len] = '\0';
+    
+    int cls = ingest_classify(m);
+    if (cls < 0) return;
+    
+    /* Accepted: a keepalive is the only thing we are allowed to shed for it */
+    if (full) {
+        slot = ingest_dequeue(PN_INGEST_KEEPALIVE);
+        g_discovery.ingest_pool[slot] = *m;
+        mutex_lock(&g_discovery.stats_mutex);
+        g_discovery.ingest_stats.dropped[PN_INGEST_KEEPALIVE]++;
+        mutex_unlock(&g_discovery.stats_mutex);
+    } else {
+        g_discovery.ingest_n_free--;
+    }
+    ingest_enqueue(slot, cls);
+}
+
+/*
+ * Process queued datagrams, most important class first. Overloaded (the
+ * pool is full and more is waiting), queued keepalives are traded one for
+ * one against waiting datagrams, so only as many are shed as make room.
+ */
+static void ingest_process(bool overloaded) {
+    if (overloaded) {
+        mutex_lock(&g_discovery.stats_mutex);
+        g_discovery.ingest_stats.overload_cycles++;
+        mutex_unlock(&g_discovery.stats_mutex);
+        
+        int budget = g_discovery.ingest_count[PN_INGEST_KEEPALIVE];
+        while (budget-- > 0 && (gro_pending() || socket_readable(g_discovery.sock))) {
+            ingest_receive();
+        }
+    }
+
+    for (int cls = 0; cls < PN_INGEST_CLASSES; cls++) {
+        while (g_discovery.ingest_count[cls] > 0) {
+            int slot = ingest_dequeue(cls);
+            ingest_msg_t *m = &g_discovery.ingest_pool[slot];
+            if (parse_message(m->buf, m->len, &m->sender, m->parsed ? &m->helo : NULL) == 0) {
+                note_peer(&m->sender);
+            }
+            g_discovery.ingest_free[g_discovery.ingest_n_free++] = slot;
+        }
+    }
+}
+
+/* Send a lease probe: a unicast "find" for one instance */
+static void lease_probe(const pn_service_t *s, const struct sockaddr_in *dest) {
+    char msg[PN_MAX_MSG_LEN];
+    int pos = build_msg_header(msg, sizeof(msg), "find");
+    if (pos >= 0) pos = json_add_string(msg, pos, sizeof(msg), "svc", s->service, true);
+    if (pos >= 0) pos = json_add_string(msg, pos, sizeof(msg), "pid", s->id, true);
+    int len = build_msg_end(msg, pos, sizeof(msg));
+    if (len > 0) tx_submit(PN_TX_REQUEST, 0, dest, msg, len);
+}
+
+/* Latest pn_note_alive() second for an id, 0 if none */
+static uint32_t lease_hint(const char *id) {
+    uint32_t h = pn_history_id_handle(id);
+    uint64_t v = atomic_load_u64(&g_discovery.alive_hints[h & (ALIVE_SLOTS - 1)]);
+    return (uint32_t)(v >> 32) == h ? (uint32_t)v : 0;
+}
+
+/*
+ * Once a second: fold data-plane hints into each entry's liveness, probe
+ * suspected entries and expire the ones whose lease ran out. Pinned entries
+ * are left alone.
+ */
+static void lease_sweep_if_due(void) {
+    uint32_t now = (uint32_t)time(NULL);
+    if (now == g_discovery.lease_swept) return;
+    g_discovery.lease_swept = now;
+    
+    pn_service_t gone[PN_MAX_SERVICES], probe[PN_MAX_SERVICES];
+    struct sockaddr_in probe_dest[PN_MAX_SERVICES];
+    int ngone = 0, nprobe = 0;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        pn_service_t *s = &g_discovery.services[i];
+        pn_health_t *h = &g_discovery.svc_meta[i].health;
+        if (!s->active || s->pinned) continue;
+        
+        uint32_t hint = lease_hint(s->id);
+        if (hint > h->alive && hint <= now) {
+            h->alive = hint;
+            h->probes = 0;
+            lru_touch(i);
+        }
+        uint32_t silent = (now > h->alive) ? now - h->alive : 0;
+        if (silent >= lease_sec(s)) {
+            gone[ngone++] = *s;
+            registry_release(i, PN_EVENT_EXPIRED);
+        } else if (silent >= lease_suspect_sec(s) + (uint32_t)h->probes * PN_PROBE_INTERVAL_SEC &&
+                   g_discovery.svc_meta[i].src.sin_port) {
+            h->probes++;
+            probe[nprobe] = *s;
+            probe_dest[nprobe++] = g_discovery.svc_meta[i].src;
+        }
+    }
+    services_unlock();
+    if (ngone == 0 && nprobe == 0) return;
+    
+    mutex_lock(&g_discovery.stats_mutex);
+    g_discovery.ingest_stats.probes += nprobe;
+    g_discovery.ingest_stats.expired += ngone;
+    mutex_unlock(&g_discovery.stats_mutex);
+    
+    for (int i = 0; i < nprobe; i++) {
+        log_debug("pn_discovery: probing silent '%s'\n", probe[i].id);
+        lease_probe(&probe[i], &probe_dest[i]);
+    }
+    for (int i = 0; i < ngone; i++) {
+        gone[i].active = false;
+        batch_record(BATCH_REMOVED, &gone[i]);
+        if (g_discovery.callback) {
+            g_discovery.callback(gone[i].id, gone[i].service, gone[i].ip, gone[i].ctrl_port, 0,
+                                 "", true, g_discovery.callback_userdata);
+        }
+        log_info("pn_discovery: '%s' expired (silent %u s)\n", gone[i].id, lease_sec(&gone[i]));
+    }
+}
+
+/* Empty ingest pool, before the first listener cycle */
+static void listen_prepare(void) {
+    g_discovery.ingest_n_free = PN_INGEST_SLOTS;
+    for (int i = 0; i < PN_INGEST_SLOTS; i++) {
+        g_discovery.ingest_free[i] = i;
+    }
+#ifdef __linux__
+    g_discovery.gro_len = g_discovery.gro_off = 0;
+#endif
+}
+
+/*
+ * One listener cycle: take in what has arrived (blocking for the first
+ * datagram up to the receive timeout if `block`), then the periodic chores.
+ */
+static void listen_cycle(bool block) {
+    if (block || gro_pending() || socket_readable(g_discovery.sock)) {
+        /* First datagram, then drain what is already queued */
+        ingest_receive();
+        int drained = 1;
+        while (drained < PN_INGEST_SLOTS && (gro_pending() || socket_readable(g_discovery.sock))) {
+            ingest_receive();
+            drained++;
+        }
+        
+        /* Hit the drain limit with more waiting: trade keepalives for it */
+        ingest_process(drained >= PN_INGEST_SLOTS &&
+                       (gro_pending() || socket_readable(g_discovery.sock)));
+    }
+    
+    batch_flush_if_due();
+    lease_sweep_if_due();
+    interest_advertise_if_due();
+    tx_drain();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI listen_thread_func(LPVOID param) {
+#else
+static void* listen_thread_func(void *param) {
+#endif
+    (void)param;
+    
+    /* Set receive timeout */
+    set_listen_timeout();
+    
+    while (g_discovery.listen_running) {
+        /* Held datagrams cut the receive wait short */
+        uint64_t now = now_ms();
+        int limit = listen_timeout_ms();
+        uint64_t next = tx_wake(now, now + (uint64_t)limit);
+        if (next >= now + (uint64_t)limit) {
+            listen_cycle(true);
+        } else {
+            listen_cycle(socket_wait(g_discovery.sock, next > now ? (int)(next - now) : 0));
+        }
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* Announce proxied services, packed into as few datagrams as possible */
+static void proxy_announce_all(void) {
+    pn_service_t svcs[PN_MAX_PROXIED];
+    int n = 0;
+    
+    uint32_t lease = lease_request(g_discovery.proxy_idle);
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active) {
+            svcs[n] = g_discovery.proxied[i];
+            svcs[n++].lease = lease;
+        }
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    /* Full datagrams of equal size go out as one segmented burst */
+    char msgs[PN_MAX_PROXIED][PN_MAX_MSG_LEN];
+    const char *ptrs[PN_MAX_PROXIED];
+    int lens[PN_MAX_PROXIED], k = 0;
+    for (int next = 0; next < n && k < PN_MAX_PROXIED; ) {
+        int len = build_proxy_helo_message(msgs[k], sizeof(msgs[k]), svcs, n, &next);
+        if (len < 0) break;
+        ptrs[k] = msgs[k];
+        lens[k++] = len;
+    }
+    if (k > 0) tx_submit_burst(PN_TX_KEEPALIVE, TX_KEY_PROXY, NULL, ptrs, lens, k);
+}
+
+/* Withdraw services with a single aggregated bye (per datagram) */
+static void proxy_send_bye(const pn_service_t *svcs, int n) {
+    char msgs[PN_MAX_PROXIED][PN_MAX_MSG_LEN];
+    const char *ptrs[PN_MAX_PROXIED];
+    int lens[PN_MAX_PROXIED], k = 0;
+    for (int next = 0; next < n && k < PN_MAX_PROXIED; ) {
+        int len = build_proxy_bye_message(msgs[k], sizeof(msgs[k]), svcs, n, &next);
+        if (len < 0) break;
+        ptrs[k] = msgs[k];
+        lens[k++] = len;
+    }
+    if (k > 0) tx_submit_burst(PN_TX_BYE, 0, NULL, ptrs, lens, k);
+}
+
+/* Is any proxied type wanted by a listener? */
+static bool proxy_wanted(void) {
+    bool wanted = false;
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED && !wanted; i++) {
+        wanted = g_discovery.proxied[i].active && interest_wanted(g_discovery.proxied[i].service);
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    return wanted;
+}
+
+/*
+ * One step of the proxy schedule (one round for every proxied service);
+ * returns when it wants the next step. Stepped like announce_step().
+ */
+static uint64_t proxy_step(uint64_t now) {
+    /* Due, or cut short by new registrations, interest or a new interval */
+    if (g_discovery.prx.due == 0 || now >= g_discovery.prx.due || g_discovery.proxy_dirty ||
+        g_discovery.sched_gen != g_discovery.prx.gen) {
+        g_discovery.proxy_dirty = false;
+        
+        /* Decide idle first, so the round asks for a lease that covers the beacon */
+        g_discovery.proxy_idle = g_discovery.demand && g_discovery.listening && !proxy_wanted();
+        proxy_announce_all();
+        
+        uint64_t period = sched_period_ms();
+        g_discovery.prx.gen = g_discovery.sched_gen;
+        if (g_discovery.proxy_idle) period = PN_BEACON_SEC * 1000ULL;
+        g_discovery.prx.last = now;
+        g_discovery.prx.due = sched_next(now, period, true);
+        g_discovery.prx.chore = now + 1000;
+    }
+    
+    /* Once a second: look again for new registrations and interest */
+    if (now >= g_discovery.prx.chore) {
+        g_discovery.prx.chore = now + 1000;
+    }
+    
+    return (g_discovery.prx.due < g_discovery.prx.chore) ? g_discovery.prx.due : g_discovery.prx.chore;
+}
+
+/* Proxy thread: one schedule for every proxied service */
+#ifdef _WIN32
+static DWORD WINAPI proxy_thread_func(LPVOID param) {
+#else
+static void* proxy_thread_func(void *param) {
+#endif
+    (void)param;
+    
+    while (g_discovery.proxy_running) {
+        uint64_t next = proxy_step(now_ms());
+        tx_sleep(tx_wake(now_ms(), next));
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Shared engine thread: steps the announce and proxy schedules and, while
+ * listening, waits on the discovery socket until the earliest of them. The
+ * listener cycle runs outside engine_mutex so callbacks may start or stop
+ * roles.
+ */
+#ifdef _WIN32
+static DWORD WINAPI engine_thread_func(LPVOID param) {
+#else
+static void* engine_thread_func(void *param) {
+#endif
+    (void)param;
+    
+    mutex_lock(&g_discovery.engine_mutex);
+    while (g_discovery.engine_running) {
+        uint64_t now = now_ms();
+        uint64_t next = tx_wake(now, now + 1000);
+        if (g_discovery.announce_running) {
+            uint64_t t = announce_step(now);
+            if (t < next) next = t;
+        }
+        if (g_discovery.proxy_running) {
+            uint64_t t = proxy_step(now);
+            if (t < next) next = t;
+        }
+        int wait = (next > now) ? (int)(next - now) : 0;
+        
+        if (!g_discovery.listen_running) {
+            if (wait > 0) cond_wait_ms(&g_discovery.engine_cond, &g_discovery.engine_mutex, wait);
+            continue;
+        }
+        
+        int limit = listen_timeout_ms();
+        mutex_unlock(&g_discovery.engine_mutex);
+        socket_wait(g_discovery.sock, wait < limit ? wait : limit);
+        listen_cycle(false);
+        mutex_lock(&g_discovery.engine_mutex);
+    }
+    mutex_unlock(&g_discovery.engine_mutex);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static int thread_start(thread_t *thread, thread_fn_t fn) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, fn, NULL, 0, NULL);
+    return (*thread == NULL) ? -1 : 0;
+#else
+    return (pthread_create(thread, NULL, fn, NULL) == 0) ? 0 : -1;
+#endif
+}
+
+static void thread_join(thread_t thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, 5000);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/* Is the caller running on this thread? */
+static bool thread_is_self(thread_t thread) {
+#ifdef _WIN32
+    return GetThreadId(thread) == GetCurrentThreadId();
+#else
+    return pthread_equal(pthread_self(), thread) != 0;
+#endif
+}
+
+/*
+ * Start a role: on its own thread, or on the shared engine thread (started
+ * with the first role). `step` runs once right away in the shared case so
+ * the first announcement does not wait for the engine to wake.
+ */
+static int role_start(volatile bool *running, thread_t *thread, thread_fn_t fn,
+                      uint64_t (*step)(uint64_t)) {
+    if (!g_discovery.shared_engine) {
+        *running = true;
+        if (thread_start(thread, fn) == 0) return 0;
+        *running = false;
+        return -1;
+    }
+    
+    mutex_lock(&g_discovery.engine_mutex);
+    *running = true;
+    if (step) step(now_ms());
+    cond_broadcast(&g_discovery.engine_cond);
+    bool start = !g_discovery.engine_running;
+    g_discovery.engine_running = true;
+    mutex_unlock(&g_discovery.engine_mutex);
+    
+    if (start && thread_start(&g_discovery.engine_thread, engine_thread_func) < 0) {
+        g_discovery.engine_running = false;
+        *running = false;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stop a role; the engine thread stops with the last one. Callbacks run on
+ * the listener's thread, and only shutdown stops the listener, so the last
+ * role is never stopped from the thread it would join.
+ */
+static void role_stop(volatile bool *running, thread_t thread) {
+    if (!g_discovery.shared_engine) {
+        *running = false;
+        thread_join(thread);
+        return;
+    }
+    
+    mutex_lock(&g_discovery.engine_mutex);
+    *running = false;
+    bool last = !g_discovery.announce_running && !g_discovery.proxy_running &&
+                !g_discovery.listen_running;
+    if (last) g_discovery.engine_running = false;
+    cond_broadcast(&g_discovery.engine_cond);
+    mutex_unlock(&g_discovery.engine_mutex);
+    
+    if (last) thread_join(g_discovery.engine_thread);
+}
+
+/* Start announcing */
+int pn_announce(const char *id, const char *service,
+                int ctrl_port, int data_port, const char *caps) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (fork_settle() < 0) return -1;
+    
+    if (g_discovery.announcing) {
+        pn_announce_stop();
+    }
+    
+    /* Store service info */
+    strncpy(g_discovery.my_service.id, id, PN_MAX_ID_LEN - 1);
+    strncpy(g_discovery.my_service.service, service, PN_MAX_SERVICE_LEN - 1);
+    strncpy(g_discovery.my_service.ip, g_discovery.local_ip, PN_MAX_IP_LEN - 1);
+    g_discovery.my_service.ctrl_port = ctrl_port;
+    g_discovery.my_service.data_port = data_port;
+    if (caps) {
+        strncpy(g_discovery.my_service.caps, caps, PN_MAX_CAPS_LEN - 1);
+    }
+    
+    /* New incarnation so peers' known-answer filters no longer match us */
+    uint32_t now = (uint32_t)time(NULL);
+    g_discovery.my_service.incarnation =
+        (now > g_discovery.my_service.incarnation) ? now : g_discovery.my_service.incarnation + 1;
+    
+    /* Start the schedule */
+    memset(&g_discovery.ann, 0, sizeof(g_discovery.ann));
+    g_discovery.announcing = true;
+    if (role_start(&g_discovery.announce_running, &g_discovery.announce_thread,
+                   announce_thread_func, announce_step) < 0) {
+        g_discovery.announcing = false;
+        return -1;
+    }
+    
+    coord_local(COORD_ADD, &g_discovery.my_service);
+    log_info("pn_discovery: announcing as %s '%s' on port %d\n", service, id, ctrl_port);
+    return 0;
+}
+
+/* Stop announcing */
+void pn_announce_stop(void) {
+    if (!g_discovery.announcing) return;
+    
+    /* Send bye message */
+    char msg[PN_MAX_MSG_LEN];
+    int len = build_bye_message(msg, sizeof(msg));
+    if (len > 0) {
+        tx_submit(PN_TX_BYE, TX_KEY_HELO, NULL, msg, len);
+    }
+    
+    /* Stop the schedule */
+    role_stop(&g_discovery.announce_running, g_discovery.announce_thread);
+    
+    g_discovery.announcing = false;
+    coord_local(COORD_REMOVE, &g_discovery.my_service);
+    log_info("pn_discovery: stopped announcing\n");
+}
+
+/* Start listening */
+int pn_listen(pn_service_cb callback, void *userdata) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (fork_settle() < 0) return -1;
+    
+    if (g_discovery.listening) {
+        return 0;  /* Already listening */
+    }
+    
+    if (g_discovery.attached) {
+        fprintf(stderr, "pn_discovery: attached to parent registry, not listening\n");
+        return -1;
+    }
+    
+    g_discovery.callback = callback;
+    g_discovery.callback_userdata = userdata;
+    g_discovery.listening = true;
+    listen_prepare();
+    
+    if (role_start(&g_discovery.listen_running, &g_discovery.listen_thread,
+                   listen_thread_func, NULL) < 0) {
+        g_discovery.listening = false;
+        return -1;
+    }
+    
+    log_info("pn_discovery: listening for services\n");
+    return 0;
+}
+
+/* Register a service to announce on its behalf */
+int pn_proxy_register(const char *id, const char *service, const char *ip,
+                      int ctrl_port, int data_port, const char *caps) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (fork_settle() < 0) return -1;
+    
+    int idx = -1;
+    pn_service_t added;
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active && strcmp(g_discovery.proxied[i].id, id) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    for (int i = 0; i < PN_MAX_PROXIED && idx < 0; i++) {
+        if (!g_discovery.proxied[i].active) idx = i;
+    }
+    if (idx >= 0) {
+        pn_service_t *p = &g_discovery.proxied[idx];
+        uint32_t prev_inc = p->active ? p->incarnation : 0;
+        uint32_t now = (uint32_t)time(NULL);
+        memset(p, 0, sizeof(*p));
+        strncpy(p->id, id, PN_MAX_ID_LEN - 1);
+        strncpy(p->service, service, PN_MAX_SERVICE_LEN - 1);
+        strncpy(p->ip, (ip && ip[0]) ? ip : g_discovery.local_ip, PN_MAX_IP_LEN - 1);
+        p->ctrl_port = ctrl_port;
+        p->data_port = data_port;
+        if (caps) {
+            strncpy(p->caps, caps, PN_MAX_CAPS_LEN - 1);
+        }
+        p->incarnation = (now > prev_inc) ? now : prev_inc + 1;
+        p->slots = -1;
+        p->active = true;
+        added = *p;
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    if (idx < 0) {
+        fprintf(stderr, "pn_discovery: proxy table full\n");
+        return -1;
+    }
+    
+    if (!g_discovery.proxying) {
+        memset(&g_discovery.prx, 0, sizeof(g_discovery.prx));
+        g_discovery.proxy_dirty = false;
+        g_discovery.proxying = true;
+        if (role_start(&g_discovery.proxy_running, &g_discovery.proxy_thread,
+                       proxy_thread_func, proxy_step) < 0) {
+            g_discovery.proxying = false;
+            return -1;
+        }
+    } else {
+        g_discovery.proxy_dirty = true;
+    }
+    
+    coord_local(COORD_ADD, &added);
+    log_info("pn_discovery: proxying %s '%s'\n", service, id);
+    return 0;
+}
+
+/* Stop announcing a proxied service */
+int pn_proxy_unregister(const char *id) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    pn_service_t gone;
+    bool found = false;
+
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active && strcmp(g_discovery.proxied[i].id, id) == 0) {
+            gone = g_discovery.proxied[i];
+            g_discovery.proxied[i].active = false;
+            found = true;
+            break;
+        }
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    if (!found) return -1;
+    
+    /* Queued heartbeats still pack the withdrawn id: repack the rest next round */
+    mutex_lock(&g_discovery.tx_mutex);
+    tx_cancel(TX_KEY_PROXY, INT_MAX);
+    mutex_unlock(&g_discovery.tx_mutex);
+    g_discovery.proxy_dirty = true;
+    proxy_send_bye(&gone, 1);
+    coord_local(COORD_REMOVE, &gone);
+    return 0;
+}
+
+/* Stop proxying: one aggregated bye for everything */
+void pn_proxy_stop(void) {
+    if (!g_discovery.proxying) return;
+    
+    role_stop(&g_discovery.proxy_running, g_discovery.proxy_thread);
+    g_discovery.proxying = false;
+    
+    pn_service_t svcs[PN_MAX_PROXIED];
+    int n = 0;
+    mutex_lock(&g_discovery.proxy_mutex);
+    for (int i = 0; i < PN_MAX_PROXIED; i++) {
+        if (g_discovery.proxied[i].active) {
+            svcs[n++] = g_discovery.proxied[i];
+            g_discovery.proxied[i].active = false;
+        }
+    }
+    mutex_unlock(&g_discovery.proxy_mutex);
+    
+    /* Heartbeats still queued for the proxied set are moot now */
+    mutex_lock(&g_discovery.tx_mutex);
+    tx_cancel(TX_KEY_PROXY, INT_MAX);
+    mutex_unlock(&g_discovery.tx_mutex);
+    proxy_send_bye(svcs, n);
+    for (int i = 0; i < n; i++) {
+        coord_local(COORD_REMOVE, &svcs[i]);
+    }
+    log_info("pn_discovery: stopped proxying %d services\n", n);
+}
+
+/* Set (or clear) the coalesced change callback */
+int pn_set_batch_callback(pn_batch_cb callback, int window_ms, void *userdata) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    if (callback && window_ms <= 0) {
+        fprintf(stderr, "pn_discovery: batch window must be > 0\n");
+        return -1;
+    }
+    
+    /* Deliver anything gathered under the old settings */
+    batch_flush();
+    
+    mutex_lock(&g_discovery.batch_mutex);
+    g_discovery.batch_callback = callback;
+    g_discovery.batch_userdata = userdata;
+    g_discovery.batch_window_ms = window_ms;
+    mutex_unlock(&g_discovery.batch_mutex);
+    
+    set_listen_timeout();
+    return 0;
+}
+
+/* Get ingest counters */
+int pn_get_ingest_stats(pn_ingest_stats_t *out) {
+    if (!g_discovery.initialized || !out) return -1;
+    mutex_lock(&g_discovery.stats_mutex);
+    *out = g_discovery.ingest_stats;
+    mutex_unlock(&g_discovery.stats_mutex);
+    return 0;
+}
+
+/* Cap outbound discovery traffic */
+int pn_set_bandwidth(int bytes_per_sec, int burst_bytes) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (bytes_per_sec < 0) return -1;
+    if (burst_bytes < PN_MAX_MSG_LEN) burst_bytes = PN_MAX_MSG_LEN;
+    
+    mutex_lock(&g_discovery.tx_mutex);
+    g_discovery.tx_rate = bytes_per_sec;
+    g_discovery.tx_burst = burst_bytes;
+    g_discovery.tx_tokens = burst_bytes;
+    g_discovery.tx_refilled = now_ms();
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    /* Lifting the cap releases everything queued */
+    tx_drain();
+    return 0;
+}
+
+/* Snapshot outbound pacer counters */
+int pn_get_tx_stats(pn_tx_stats_t *out) {
+    if (!g_discovery.initialized || !out) return -1;
+    mutex_lock(&g_discovery.tx_mutex);
+    *out = g_discovery.tx_stats;
+    mutex_unlock(&g_discovery.tx_mutex);
+    return 0;
+}
+
+/* Send caller-built datagrams as one burst */
+int pn_send_burst(const char *const *msgs, const int *lens, int n) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (!msgs || !lens || n < 1 || n > PN_MAX_BURST) return -1;
+    for (int i = 0; i < n; i++) {
+        if (!msgs[i] || lens[i] <= 0 || lens[i] > PN_MAX_MSG_LEN) return -1;
+    }
+    
+    tx_submit_burst(PN_TX_CHANGE, 0, NULL, msgs, lens, n);
+    return 0;
+}
+
+/* Turn UDP segmentation offload on or off */
+int pn_set_udp_offload(bool enable) {
+    if (!g_discovery.initialized) return -1;
+    
+#ifdef __linux__
+    mutex_lock(&g_discovery.tx_mutex);
+    g_discovery.offload = enable;
+    g_discovery.udp_gso = enable;
+    mutex_unlock(&g_discovery.tx_mutex);
+    
+    int gro = enable ? 1 : 0;
+    g_discovery.udp_gro = setsockopt(g_discovery.sock, SOL_UDP, UDP_GRO,
+                                     &gro, sizeof(gro)) == 0 && enable;
+    return 0;
+#else
+    return enable ? -1 : 0;
+#endif
+}
+
+/* Advertise capacity */
+int pn_set_capacity(int total_slots) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    mutex_lock(&g_discovery.capacity_mutex);
+    g_discovery.capacity_total = (total_slots >= 0) ? total_slots : -1;
+    mutex_unlock(&g_discovery.capacity_mutex);
+    
+    capacity_publish();
+    return 0;
+}
+
+/* Report connected clients; arriving clients use up held reservations */
+int pn_capacity_in_use(int clients) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    mutex_lock(&g_discovery.capacity_mutex);
+    int arrived = clients - g_discovery.capacity_in_use;
+    while (arrived-- > 0) {
+        int oldest = -1;
+        for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+            if (g_discovery.holds[i].active &&
+                (oldest < 0 || g_discovery.holds[i].expires < g_discovery.holds[oldest].expires)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) break;
+        g_discovery.holds[oldest].active = false;
+    }
+    g_discovery.capacity_in_use = (clients > 0) ? clients : 0;
+    mutex_unlock(&g_discovery.capacity_mutex);
+    
+    capacity_publish();
+    return 0;
+}
+
+/* Claim a slot on a server before connecting */
+int pn_reserve_slot(const char *id, int timeout_ms, uint32_t *token) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    /* Ask the discovery socket its announcements came from */
+    struct sockaddr_in dest;
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(id);
+    bool ok = idx >= 0 && g_discovery.services[idx].slots != 0;
+    if (ok) dest = g_discovery.svc_meta[idx].src;
+    mutex_unlock(&g_discovery.services_mutex);
+    if (!ok) return -1;
+    
+    /* Register the request */
+    int r = -1;
+    uint32_t nonce = (uint32_t)rng_next();
+    mutex_lock(&g_discovery.reserve_mutex);
+    for (int i = 0; i < PN_MAX_RESERVATIONS; i++) {
+        if (!g_discovery.reserve[i].active) {
+            g_discovery.reserve[i].nonce = nonce;
+            g_discovery.reserve[i].state = RSV_PENDING;
+            g_discovery.reserve[i].token = 0;
+            g_discovery.reserve[i].active = true;
+            r = i;
+            break;
+        }
+    }
+    mutex_unlock(&g_discovery.reserve_mutex);
+    if (r < 0) return -1;
+    
+    char msg[PN_MAX_MSG_LEN];
+    int pos = build_msg_header(msg, sizeof(msg), "rsv");
+    if (pos >= 0) pos = json_add_string(msg, pos, sizeof(msg), "to", id, true);
+    if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "nonce", (int)nonce, true);
+    int len = build_msg_end(msg, pos, sizeof(msg));
+    
+    /* Resend every PN_RESERVE_RETRY_MS until answered or out of time */
+    uint64_t deadline = now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    mutex_lock(&g_discovery.reserve_mutex);
+    while (len > 0 && g_discovery.reserve[r].state == RSV_PENDING) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        mutex_unlock(&g_discovery.reserve_mutex);
+        tx_submit(PN_TX_REQUEST, TX_KEY_RSV + r, &dest, msg, len);
+        mutex_lock(&g_discovery.reserve_mutex);
+        
+        int wait = (int)(deadline - now);
+        if (wait > PN_RESERVE_RETRY_MS) wait = PN_RESERVE_RETRY_MS;
+        if (g_discovery.reserve[r].state == RSV_PENDING) {
+            cond_wait_ms(&g_discovery.reserve_cond, &g_discovery.reserve_mutex, wait);
+        }
+    }
+    int state = g_discovery.reserve[r].state;
+    if (token) *token = g_discovery.reserve[r].token;
+    g_discovery.reserve[r].active = false;
+    mutex_unlock(&g_discovery.reserve_mutex);
+    
+    return (state == RSV_GRANTED) ? 0 : -1;
+}
+
+/* Query for services */
+int pn_query(const char *service_type) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (fork_settle() < 0) return -1;
+    
+    char msg[PN_MAX_MSG_LEN];
+    int len = build_find_message(msg, sizeof(msg), service_type ? service_type : "");
+    if (len < 0) return -1;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    evict_want(service_type);
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    tx_submit(PN_TX_REQUEST, 0, NULL, msg, len);
+    return 0;
+}
+
+/* Switch between broadcast and unicast seed-list mode */
+int pn_set_unicast_mode(bool enable) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    g_discovery.unicast_mode = enable;
+    log_info("pn_discovery: %s mode\n", enable ? "unicast seed-list" : "broadcast");
+    return 0;
+}
+
+/* Add a seed peer ("ip" or "ip:port") */
+int pn_add_peer(const char *addr) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    struct sockaddr_in sin;
+    if (parse_peer_addr(addr, &sin) < 0) {
+        fprintf(stderr, "pn_discovery: bad peer address '%s'\n", addr);
+        return -1;
+    }
+    
+    int result = -1;
+    mutex_lock(&g_discovery.peers_mutex);
+    for (int i = 0; i < PN_MAX_PEERS; i++) {
+        if (g_discovery.peers[i].active &&
+            g_discovery.peers[i].addr.sin_addr.s_addr == sin.sin_addr.s_addr &&
+            g_discovery.peers[i].addr.sin_port == sin.sin_port) {
+            g_discovery.peers[i].seed = true;
+            result = 0;
+            break;
+        }
+    }
+    for (int i = 0; i < PN_MAX_PEERS && result < 0; i++) {
+        if (!g_discovery.peers[i].active) {
+            g_discovery.peers[i].addr = sin;
+            g_discovery.peers[i].last_heard = 0;
+            g_discovery.peers[i].seed = true;
+            g_discovery.peers[i].active = true;
+            result = 0;
+        }
+    }
+    mutex_unlock(&g_discovery.peers_mutex);
+    
+    if (result < 0) {
+        fprintf(stderr, "pn_discovery: peer table full\n");
+    }
+    return result;
+}
+
+/* Pick a peer to bootstrap from: a unicast peer, else the latest node heard */
+static int bootstrap_peer(struct sockaddr_in *out) {
+    int found = -1;
+    
+    mutex_lock(&g_discovery.peers_mutex);
+    for (int i = 0; i < PN_MAX_PEERS && found < 0; i++) {
+        if (g_discovery.peers[i].active) {
+            *out = g_discovery.peers[i].addr;
+            found = 0;
+        }
+    }
+    mutex_unlock(&g_discovery.peers_mutex);
+    if (found == 0) return 0;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    int best = -1;
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (g_discovery.services[i].active && !g_discovery.services[i].pinned &&
+            (best < 0 || g_discovery.services[i].last_seen > g_discovery.services[best].last_seen)) {
+            best = i;
+        }
+    }
+    if (best >= 0) *out = g_discovery.svc_meta[best].src;
+    mutex_unlock(&g_discovery.services_mutex);
+    return best >= 0 ? 0 : -1;
+}
+
+/* Fetch the registry of an established peer */
+int pn_bootstrap(const char *peer, int timeout_ms) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (!g_discovery.listening) {
+        fprintf(stderr, "pn_discovery: bootstrap needs pn_listen()\n");
+        return -1;
+    }
+    
+    struct sockaddr_in dest;
+    if (peer && parse_peer_addr(peer, &dest) < 0) {
+        fprintf(stderr, "pn_discovery: bad peer address '%s'\n", peer);
+        return -1;
+    }
+    if (!peer && bootstrap_peer(&dest) < 0) {
+        fprintf(stderr, "pn_discovery: no peer to bootstrap from\n");
+        return -1;
+    }
+    
+    /* One transfer at a time; a peer we synced with before sends only changes */
+    uint64_t since = 0;
+    mutex_lock(&g_discovery.boot_mutex);
+    if (g_discovery.boot.active) {
+        mutex_unlock(&g_discovery.boot_mutex);
+        return -1;
+    }
+    memset(&g_discovery.boot, 0, sizeof(g_discovery.boot));
+    if (g_discovery.boot_peer.sin_addr.s_addr == dest.sin_addr.s_addr &&
+        g_discovery.boot_peer.sin_port == dest.sin_port) {
+        since = g_discovery.boot_gen;
+        g_discovery.boot.cookie = g_discovery.boot_cookie;
+    }
+    g_discovery.boot.active = true;
+    
+    /*
+     * Resend every PN_BOOTSTRAP_RETRY_MS until complete or out of time, at
+     * once when the peer hands us a cookie. Each send has a fresh nonce; an
+     * answer that stopped arriving before it was complete is given up for
+     * the next one.
+     */
+    uint64_t deadline = now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    uint64_t cookie = 0;
+    int len = 1;
+    while (len > 0 && !g_discovery.boot.done) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        
+        int wait = (int)(deadline - now);
+        if (wait > PN_BOOTSTRAP_RETRY_MS) wait = PN_BOOTSTRAP_RETRY_MS;
+        if (g_discovery.boot.pinned && g_discovery.boot.progress) {
+            /* Parts still coming in: let this answer finish */
+            g_discovery.boot.progress = false;
+            cond_wait_ms(&g_discovery.boot_cond, &g_discovery.boot_mutex, wait);
+            continue;
+        }
+        
+        uint32_t nonce = (uint32_t)rng_next();
+        g_discovery.boot.nonces[g_discovery.boot.sent++ % BOOT_NONCES] = nonce;
+        g_discovery.boot.pinned = false;
+        g_discovery.boot.parts_seen = 0;
+        g_discovery.boot.parts = 0;
+        g_discovery.boot.received = 0;
+        cookie = g_discovery.boot.cookie;
+        mutex_unlock(&g_discovery.boot_mutex);
+        
+        char msg[PN_MAX_MSG_LEN];
+        int pos = build_msg_header(msg, sizeof(msg), "sync");
+        if (pos >= 0) pos = json_add_int(msg, pos, sizeof(msg), "nonce", (int)nonce, true);
+        if (pos >= 0) pos = json_add_u64(msg, pos, sizeof(msg), "since", since, true);
+        if (pos >= 0 && cookie) pos = json_add_u64(msg, pos, sizeof(msg), "ck", cookie, true);
+        len = build_msg_end(msg, pos, sizeof(msg));
+        if (len > 0) tx_submit(PN_TX_REQUEST, 0, &dest, msg, len);
+        mutex_lock(&g_discovery.boot_mutex);
+        
+        if (!g_discovery.boot.done && g_discovery.boot.cookie == cookie) {
+            cond_wait_ms(&g_discovery.boot_cond, &g_discovery.boot_mutex, wait);
+        }
+    }
+    bool done = g_discovery.boot.done;
+    int received = g_discovery.boot.received;
+    uint64_t gen = g_discovery.boot.gen;
+    if (done) {
+        g_discovery.boot_peer = dest;
+        g_discovery.boot_gen = gen;
+        g_discovery.boot_cookie = g_discovery.boot.cookie;
+    }
+    g_discovery.boot.active = false;
+    mutex_unlock(&g_discovery.boot_mutex);
+    
+    if (!done) return -1;
+    log_info("pn_discovery: bootstrapped %d entries from %s:%d (generation %u)\n", received,
+             inet_ntoa(dest.sin_addr), ntohs(dest.sin_port), (uint32_t)gen);
+    return received;
+}
+
+static bool vis_satisfied(int min_peers) {
+    return (min_peers == PN_VISIBLE_COORDINATOR) ? g_discovery.vis.coordinator
+                                                 : g_discovery.vis.n_peers >= min_peers;
+}
+
+/* Wait until enough peers hold our current descriptor */
+int pn_announce_wait_visible(int min_peers, int timeout_ms) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (!g_discovery.announcing || !g_discovery.listening) {
+        fprintf(stderr, "pn_discovery: visibility needs pn_announce() and pn_listen()\n");
+        return -1;
+    }
+    if (min_peers != PN_VISIBLE_COORDINATOR &&
+        (min_peers < 1 || min_peers > PN_VISIBLE_MAX_PEERS)) {
+        return -1;
+    }
+    
+    /* One waiter at a time; confirmations count for the current incarnation only */
+    mutex_lock(&g_discovery.vis_mutex);
+    if (g_discovery.vis.active) {
+        mutex_unlock(&g_discovery.vis_mutex);
+        return -1;
+    }
+    memset(&g_discovery.vis, 0, sizeof(g_discovery.vis));
+    g_discovery.vis.incarnation = g_discovery.my_service.incarnation;
+    g_discovery.vis.active = true;
+    mutex_unlock(&g_discovery.vis_mutex);
+    
+    /* Resend the helo (asking for acks) with backoff until confirmed or out of time */
+    char msg[PN_MAX_MSG_LEN];
+    int retry = PN_VISIBLE_RETRY_MS;
+    uint64_t deadline = now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    mutex_lock(&g_discovery.vis_mutex);
+    while (!vis_satisfied(min_peers) && g_discovery.announcing) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        mutex_unlock(&g_discovery.vis_mutex);
+        int len = build_helo_message(msg, sizeof(msg));
+        if (len > 0) {
+            tx_submit(PN_TX_CHANGE, TX_KEY_HELO, NULL, msg, len);
+        }
+        mutex_lock(&g_discovery.vis_mutex);
+        
+        int wait = (int)(deadline - now);
+        if (wait > retry) wait = retry;
+        if (retry < 16 * PN_VISIBLE_RETRY_MS) retry *= 2;
+        if (!vis_satisfied(min_peers)) {
+            cond_wait_ms(&g_discovery.vis_cond, &g_discovery.vis_mutex, wait);
+        }
+    }
+    bool done = vis_satisfied(min_peers);
+    int peers = g_discovery.vis.n_peers;
+    g_discovery.vis.active = false;
+    mutex_unlock(&g_discovery.vis_mutex);
+    
+    if (!done) return -1;
+    log_info("pn_discovery: '%s' visible to %d peer%s\n", g_discovery.my_service.id,
+             peers, peers == 1 ? "" : "s");
+    return peers;
+}
+
+/*
+ * TCP coordinator. Registry commits queue their changes (under
+ * services_mutex); one thread accepts subscribers, gives each a snapshot and
+ * fans every queued change out to the sessions whose snapshot predates it.
+ */
+
+/* Queue a committed change for the coordinator. Caller holds services_mutex. */
+static void coord_record(int kind, const pn_service_t *d) {
+#ifdef __linux__
+    if (!g_discovery.coordinating) return;
+    
+    /* Full: the thread fell behind, so every session gets a new snapshot instead */
+    if (g_discovery.coord_count == COORD_EVENTS) {
+        g_discovery.coord_count = 0;
+        g_discovery.coord_lost = true;
+    }
+    int slot = (g_discovery.coord_head + g_discovery.coord_count++) % COORD_EVENTS;
+    g_discovery.coord_events[slot].kind = kind;
+    g_discovery.coord_events[slot].gen = g_discovery.registry_gen;
+    g_discovery.coord_events[slot].d = *d;
+    g_discovery.coord_kick = true;
+#else
+    (void)kind; (void)d;
+#endif
+}
+
+/*
+ * Release services_mutex after a commit, then wake the coordinator if the
+ * commit queued a change. The eventfd write stays outside the lock.
+ */
+static void services_unlock(void) {
+#ifdef __linux__
+    bool kick = g_discovery.coord_kick;
+    g_discovery.coord_kick = false;
+    mutex_unlock(&g_discovery.services_mutex);
+    if (kick && g_discovery.coord_wake >= 0) {
+        uint64_t one = 1;
+        ssize_t r = write(g_discovery.coord_wake, &one, sizeof(one));
+        (void)r;
+    }
+#else
+    mutex_unlock(&g_discovery.services_mutex);
+#endif
+}
+
+/* Queue a change to our own or a proxied service */
+static void coord_local(int kind, const pn_service_t *d) {
+    if (!g_discovery.coordinating) return;
+    mutex_lock(&g_discovery.services_mutex);
+    g_discovery.registry_gen++;
+    coord_record(kind, d);
+    services_unlock();
+}
+
+#ifdef __linux__
+/*
+ * Address to listen on: the one set by pn_set_coordinator_addr(), else the
+ * first address of a configured broadcast interface, else loopback
+ */
+static struct in_addr coord_listen_addr(void) {
+    struct in_addr addr;
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (g_discovery.coord_addr_set) return g_discovery.coord_addr;
+    if (!cfg_iface_restricted()) return addr;
+    
+    struct ifaddrs *ifaddr, *ifa;
+    if (getifaddrs(&ifaddr) == -1) return addr;
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET) continue;
+        if (!cfg_accepts_iface(ifa->ifa_name)) continue;
+        addr = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        break;
+    }
+    freeifaddrs(ifaddr);
+    return addr;
+}
+
+/* Unlink and close a session */
+static void coord_close_session(coord_session_t *s) {
+    if (s->prev) s->prev->next = s->next;
+    else g_discovery.coord_sessions = s->next;
+    if (s->next) s->next->prev = s->prev;
+    close(s->fd);
+    free(s->out);
+    free(s);
+    g_discovery.coord_counts.sessions--;
+}
+
+/* Arm or disarm write readiness */
+static void coord_want_write(coord_session_t *s, bool on) {
+    if (s->want_write == on) return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(g_discovery.coord_epoll, EPOLL_CTL_MOD, s->fd, &ev);
+    s->want_write = on;
+}
+
+/* Send what a session has queued; returns -1 if the peer is gone */
+static int coord_flush(coord_session_t *s) {
+    while (s->out_off < s->out_len) {
+        ssize_t n = send(s->fd, s->out + s->out_off, s->out_len - s->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            coord_want_write(s, true);
+            return 0;
+        }
+        if (n <= 0) return -1;
+        s->out_off += (int)n;
+        g_discovery.coord_counts.bytes_out += (uint64_t)n;
+    }
+    
+    /* Caught up: an idle session holds no buffer */
+    free(s->out);
+    s->out = NULL;
+    s->out_off = s->out_len = s->out_cap = 0;
+    coord_want_write(s, false);
+    return 0;
+}
+
+/*
+ * Write to a session: straight to the socket while nothing is queued, the
+ * rest behind what is. Returns -1 if the peer is gone or too far behind.
+ */
+static int coord_write(coord_session_t *s, const char *data, int len) {
+    if (!s->out) {
+        ssize_t n = send(s->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        if (n > 0) {
+            g_discovery.coord_counts.bytes_out += (uint64_t)n;
+            data += n;
+            len -= (int)n;
+        }
+        if (len == 0) return 0;
+    }
+    
+    if (s->out_len - s->out_off + len > PN_COORD_MAX_BACKLOG) {
+        g_discovery.coord_counts.dropped++;
+        return -1;
+    }
+    if (s->out_len + len > s->out_cap) {
+        if (s->out_off > 0) {
+            memmove(s->out, s->out + s->out_off, s->out_len - s->out_off);
+            s->out_len -= s->out_off;
+            s->out_off = 0;
+        }
+        int cap = s->out_cap ? s->out_cap : 4096;
+        while (cap < s->out_len + len) cap *= 2;
+        if (cap != s->out_cap) {
+            char *p = (char*)realloc(s->out, cap);
+            if (!p) return -1;
+            s->out = p;
+            s->out_cap = cap;
+        }
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    coord_want_write(s, true);
+    return 0;
+}
+
+/* The whole registry as newline-terminated "snap" parts (coordinator thread only) */
+static const char* coord_build_snapshot(int *len, uint32_t *gen) {
+    static pn_service_t svcs[PN_MAX_SERVICES + PN_MAX_PROXIED + 1];
+    static struct sockaddr_in srcs[PN_MAX_SERVICES + PN_MAX_PROXIED + 1];
+    static char buf[SNAP_MAX_PARTS * (PN_MAX_MSG_LEN + 1)];
+    int n = snap_collect(svcs, srcs, 0, gen);
+    
+    *len = 0;
+    for (int next = 0, part = 0; (part == 0 || next < n) && part < SNAP_MAX_PARTS; part++) {
+        int mlen = build_snap_message(buf + *len, PN_MAX_MSG_LEN, svcs, srcs, n, &next,
+                                      0, sync_gen(*gen), part);
+        if (mlen < 0) break;
+        *len += mlen;
+        buf[(*len)++] = '\n';
+    }
+    return buf;
+}
+
+/* Accept every pending subscriber; one snapshot serves the whole burst */
+static void coord_accept(void) {
+    const char *snap = NULL;
+    int snap_len = 0;
+    uint32_t gen = 0;
+    
+    for (;;) {
+        int fd = accept4(g_discovery.coord_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        if (g_discovery.coord_counts.sessions >= PN_COORD_MAX_SESSIONS) {
+            close(fd);
+            g_discovery.coord_counts.refused++;
+            continue;
+        }
+        
+        coord_session_t *s = (coord_session_t*)calloc(1, sizeof(*s));
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = s;
+        if (!s || epoll_ctl(g_discovery.coord_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(s);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        s->fd = fd;
+        s->next = g_discovery.coord_sessions;
+        if (s->next) s->next->prev = s;
+        g_discovery.coord_sessions = s;
+        g_discovery.coord_counts.sessions++;
+        g_discovery.coord_counts.accepted++;
+        
+        if (!snap) snap = coord_build_snapshot(&snap_len, &gen);
+        s->since = gen;
+        g_discovery.coord_counts.snapshots++;
+        if (coord_write(s, snap, snap_len) < 0) coord_close_session(s);
+    }
+}
+
+/* Readiness on a session; subscribers only listen, so input is discarded */
+static void coord_session_event(coord_session_t *s, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        coord_close_session(s);
+        return;
+    }
+    if (events & EPOLLIN) {
+        char junk[256];
+        ssize_t n = recv(s->fd, junk, sizeof(junk), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            coord_close_session(s);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && coord_flush(s) < 0) {
+        coord_close_session(s);
+    }
+}
+
+/* Fan queued changes out to every session whose snapshot predates them */
+static void coord_drain(void) {
+    static coord_event_t evs[COORD_EVENTS];
+    
+    mutex_lock(&g_discovery.services_mutex);
+    int n = g_discovery.coord_count;
+    for (int i = 0; i < n; i++) {
+        evs[i] = g_discovery.coord_events[(g_discovery.coord_head + i) % COORD_EVENTS];
+    }
+    g_discovery.coord_head = (g_discovery.coord_head + n) % COORD_EVENTS;
+    g_discovery.coord_count = 0;
+    bool lost = g_discovery.coord_lost;
+    g_discovery.coord_lost = false;
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    coord_session_t *s, *next;
+    if (lost) {
+        int len;
+        uint32_t gen;
+        const char *snap = coord_build_snapshot(&len, &gen);
+        for (s = g_discovery.coord_sessions; s; s = next) {
+            next = s->next;
+            s->since = gen;
+            g_discovery.coord_counts.resyncs++;
+            if (coord_write(s, snap, len) < 0) coord_close_session(s);
+        }
+    }
+    
+    /* Each change is formatted once for all sessions */
+    for (int i = 0; i < n; i++) {
+        char msg[PN_MAX_MSG_LEN + 1];
+        int k = 0;
+        int len = (evs[i].kind == COORD_ADD)
+                  ? build_proxy_helo_message(msg, PN_MAX_MSG_LEN, &evs[i].d, 1, &k)
+                  : build_proxy_bye_message(msg, PN_MAX_MSG_LEN, &evs[i].d, 1, &k);
+        if (len < 0) continue;
+        msg[len++] = '\n';
+        g_discovery.coord_counts.deltas++;
+        
+        for (s = g_discovery.coord_sessions; s; s = next) {
+            next = s->next;
+            if (evs[i].gen <= s->since) continue;
+            if (coord_write(s, msg, len) < 0) coord_close_session(s);
+        }
+    }
+}
+
+/* Coordinator thread: every session on one epoll set */
+static void* coord_thread_func(void *arg) {
+    (void)arg;
+    struct epoll_event evs[COORD_EPOLL_BATCH];
+    
+    while (g_discovery.coord_running) {
+        int n = epoll_wait(g_discovery.coord_epoll, evs, COORD_EPOLL_BATCH, 1000);
+        
+        mutex_lock(&g_discovery.coord_mutex);
+        for (int i = 0; i < n; i++) {
+            void *tag = evs[i].data.ptr;
+            if (tag == &g_discovery.coord_sock) {
+                coord_accept();
+            } else if (tag == &g_discovery.coord_wake) {
+                uint64_t v;
+                ssize_t r = read(g_discovery.coord_wake, &v, sizeof(v));
+                (void)r;
+            } else {
+                coord_session_event((coord_session_t*)tag, evs[i].events);
+            }
+        }
+        coord_drain();
+        
+        mutex_lock(&g_discovery.stats_mutex);
+        g_discovery.coord_stats = g_discovery.coord_counts;
+        mutex_unlock(&g_discovery.stats_mutex);
+        mutex_unlock(&g_discovery.coord_mutex);
+    }
+    
+    return NULL;
+}
+#endif
+
+/* Choose the coordinator's listen address (NULL = default) */
+int pn_set_coordinator_addr(const char *ip) {
+    struct in_addr addr;
+    if (ip && inet_pton(AF_INET, ip, &addr) != 1) {
+        fprintf(stderr, "pn_discovery: bad coordinator address '%s'\n", ip);
+        return -1;
+    }
+#ifdef __linux__
+    g_discovery.coord_addr_set = (ip != NULL);
+    if (ip) g_discovery.coord_addr = addr;
+#endif
+    return 0;
+}
+
+/* Start serving the registry to TCP subscribers */
+int pn_coordinator_open(int tcp_port) {
+#ifndef __linux__
+    (void)tcp_port;
+    fprintf(stderr, "pn_discovery: coordinator only supported on Linux\n");
+    return -1;
+#else
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (g_discovery.coordinating) {
+        pn_coordinator_close();
+    }
+    
+    int port = (tcp_port > 0) ? tcp_port : PN_DISCOVERY_TCP_PORT;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "pn_discovery: coordinator socket() failed\n");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = coord_listen_addr();
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "pn_discovery: coordinator bind() failed on %s:%d\n", ip, port);
+        close(fd);
+        return -1;
+    }
+    
+    /* The listening socket and the wake-up eventfd are told apart by tag */
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    int wake = g_discovery.coord_wake;
+    struct epoll_event ev_sock, ev_wake;
+    memset(&ev_sock, 0, sizeof(ev_sock));
+    memset(&ev_wake, 0, sizeof(ev_wake));
+    ev_sock.events = ev_wake.events = EPOLLIN;
+    ev_sock.data.ptr = &g_discovery.coord_sock;
+    ev_wake.data.ptr = &g_discovery.coord_wake;
+    if (ep < 0 || wake < 0 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev_sock) < 0 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, wake, &ev_wake) < 0) {
+        fprintf(stderr, "pn_discovery: coordinator epoll setup failed\n");
+        if (ep >= 0) close(ep);
+        close(fd);
+        return -1;
+    }
+    
+    g_discovery.coord_sock = fd;
+    g_discovery.coord_epoll = ep;
+    g_discovery.coord_sessions = NULL;
+    memset(&g_discovery.coord_counts, 0, sizeof(g_discovery.coord_counts));
+    mutex_lock(&g_discovery.stats_mutex);
+    memset(&g_discovery.coord_stats, 0, sizeof(g_discovery.coord_stats));
+    mutex_unlock(&g_discovery.stats_mutex);
+    
+    mutex_lock(&g_discovery.services_mutex);
+    g_discovery.coord_head = g_discovery.coord_count = 0;
+    g_discovery.coord_lost = false;
+    g_discovery.coordinating = true;
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    g_discovery.coord_running = true;
+    if (pthread_create(&g_discovery.coord_thread, NULL, coord_thread_func, NULL) != 0) {
+        fprintf(stderr, "pn_discovery: failed to create coordinator thread\n");
+        mutex_lock(&g_discovery.services_mutex);
+        g_discovery.coordinating = false;
+        mutex_unlock(&g_discovery.services_mutex);
+        g_discovery.coord_running = false;
+        close(ep);
+        close(fd);
+        return -1;
+    }
+    
+    log_info("pn_discovery: coordinator on TCP %s:%d\n", ip, port);
+    return 0;
+#endif
+}
+
+/* Close every session and stop serving */
+void pn_coordinator_close(void) {
+#ifdef __linux__
+    if (!g_discovery.coordinating) return;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    g_discovery.coordinating = false;
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    g_discovery.coord_running = false;
+    uint64_t one = 1;
+    ssize_t r = write(g_discovery.coord_wake, &one, sizeof(one));
+    (void)r;
+    pthread_join(g_discovery.coord_thread, NULL);
+    
+    int n = 0;
+    while (g_discovery.coord_sessions) {
+        coord_close_session(g_discovery.coord_sessions);
+        n++;
+    }
+    close(g_discovery.coord_sock);
+    close(g_discovery.coord_epoll);
+    log_info("pn_discovery: coordinator closed %d sessions\n", n);
+#endif
+}
+
+/* Get coordinator counters */
+int pn_get_coord_stats(pn_coord_stats_t *out) {
+#ifdef __linux__
+    if (!g_discovery.coordinating || !out) return -1;
+    mutex_lock(&g_discovery.stats_mutex);
+    *out = g_discovery.coord_stats;
+    mutex_unlock(&g_discovery.stats_mutex);
+    return 0;
+#else
+    (void)out;
+    return -1;
+#endif
+}
+
+/* Load pinned static entries */
+int pn_load_static_services(const char *path) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    FILE *f = path ? fopen(path, "r") : NULL;
+    if (!f) {
+        fprintf(stderr, "pn_discovery: cannot open static services %s\n", path ? path : "(null)");
+        return -1;
+    }
+    
+    /* Field widths follow the descriptor buffers */
+    char fmt[64];
+    snprintf(fmt, sizeof(fmt), "%%%ds %%%ds %%%ds %%d %%d %%%ds", PN_MAX_ID_LEN - 1,
+             PN_MAX_SERVICE_LEN - 1, PN_MAX_IP_LEN - 1, PN_MAX_CAPS_LEN - 1);
+    
+    char line[512];
+    int lineno = 0, loaded = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        
+        /* id service ip ctrl_port [data_port [caps]] */
+        pn_service_t d;
+        memset(&d, 0, sizeof(d));
+        int fields = sscanf(p, fmt, d.id, d.service, d.ip, &d.ctrl_port, &d.data_port, d.caps);
+        struct sockaddr_in from;
+        memset(&from, 0, sizeof(from));
+        from.sin_family = AF_INET;
+        from.sin_port = htons(g_discovery.udp_port);
+        if (fields < 4 || inet_pton(AF_INET, d.ip, &from.sin_addr) != 1) {
+            fprintf(stderr, "pn_discovery: %s:%d: bad static entry\n", path, lineno);
+            continue;
+        }
+        d.slots = -1;
+        d.pinned = true;
+        
+        /* Already heard live: just pin it */
+        mutex_lock(&g_discovery.services_mutex);
+        int idx = registry_lookup(d.id);
+        if (idx >= 0) {
+            g_discovery.services[idx].pinned = true;
+            lru_touch(idx);                   /* Pinned: off the eviction lists */
+            shared_publish(idx);
+        }
+        mutex_unlock(&g_discovery.services_mutex);
+        
+        if (idx >= 0 || registry_update(&d, &from) == 0) {
+            loaded++;
+        } else {
+            fprintf(stderr, "pn_discovery: %s:%d: static entry '%s' not loaded\n", path, lineno, d.id);
+        }
+    }
+    fclose(f);
+    
+    log_info("pn_discovery: %d static entries from %s\n", loaded, path);
+    return loaded;
+}
+
+/* Announce only as often as someone listens */
+int pn_set_demand_announce(bool enable) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    
+    g_discovery.demand = enable;
+    g_discovery.sched_gen++;          /* Re-plan the current intervals */
+    log_info("pn_discovery: demand-driven announcing %s\n", enable ? "on" : "off");
+    return 0;
+}
+
+/* Choose the eviction policy and entry budget */
+int pn_set_eviction(int policy, int max_entries) {
+    pn_service_t gone[PN_MAX_SERVICES];
+    int n_gone = 0;
+    
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (policy < PN_EVICT_NONE || policy > PN_EVICT_RELEVANCE ||
+        max_entries < 0 || max_entries > PN_MAX_SERVICES) {
+        return -1;
+    }
+    
+    mutex_lock(&g_discovery.services_mutex);
+    g_discovery.evict_policy = policy;
+    g_discovery.evict_limit = max_entries;
+    lru_rebuild();
+    
+    /* Shrink to a lowered budget now rather than on the next newcomer */
+    int count = 0;
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (g_discovery.services[i].active) count++;
+    }
+    while (policy != PN_EVICT_NONE && max_entries > 0 && count > max_entries) {
+        int victim = evict_victim(PN_EVICT_CLASSES - 1);
+        if (victim < 0) break;
+        gone[n_gone++] = g_discovery.services[victim];
+        registry_release(victim, PN_EVENT_EVICTED);
+        count--;
+    }
+    services_unlock();
+    
+    for (int i = 0; i < n_gone; i++) evict_notify(&gone[i]);
+    return 0;
+}
+
+/* Set a service type's eviction priority */
+int pn_set_service_priority(const char *service_type, int priority) {
+    if (!g_discovery.initialized || !service_type || !service_type[0] ||
+        priority < 0 || priority >= PN_EVICT_CLASSES) {
+        return -1;
+    }
+    
+    mutex_lock(&g_discovery.services_mutex);
+    int i = 0;
+    while (i < g_discovery.n_priorities &&
+           strcmp(g_discovery.priorities[i].service, service_type) != 0) {
+        i++;
+    }
+    if (i == PN_MAX_PRIORITIES) {
+        mutex_unlock(&g_discovery.services_mutex);
+        return -1;
+    }
+    if (i == g_discovery.n_priorities) {
+        strncpy(g_discovery.priorities[i].service, service_type, PN_MAX_SERVICE_LEN - 1);
+        g_discovery.priorities[i].service[PN_MAX_SERVICE_LEN - 1] = '\0';
+        g_discovery.n_priorities++;
+    }
+    g_discovery.priorities[i].priority = priority;
+    if (g_discovery.evict_policy == PN_EVICT_PRIORITY) lru_rebuild();
+    mutex_unlock(&g_discovery.services_mutex);
+    return 0;
+}
+
+/* Append formatted text to a reply buffer */
+static int reply_append(char *out, int pos, int maxlen, const char *fmt, ...) {
+    if (!out || pos >= maxlen - 1) return pos;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out + pos, maxlen - pos, fmt, ap);
+    va_end(ap);
+    if (n < 0) return pos;
+    return (pos + n < maxlen) ? pos + n : maxlen - 1;
+}
+
+/* Parse "a,b,c" (or "*" for none) into a fixed-stride name list */
+static int parse_name_list(const char *arg, char *list, int max, int stride) {
+    if (strcmp(arg, "*") == 0) return 0;
+    int count = 0;
+    const char *p = arg;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        int n = end ? (int)(end - p) : (int)strlen(p);
+        if (n <= 0 || n >= stride || count >= max) return -1;
+        memcpy(list + (size_t)count * stride, p, n);
+        list[(size_t)count * stride + n] = '\0';
+        count++;
+        if (!end) break;
+        p = end + 1;
+    }
+    return count;
+}
+
+/* Drop registry entries the new subscription filter no longer accepts */
+static void registry_apply_filter(void) {
+    char ids[PN_MAX_SERVICES][PN_MAX_ID_LEN];
+    int n = 0;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (g_discovery.services[i].active &&
+            !cfg_accepts_service(g_discovery.services[i].service)) {
+            strncpy(ids[n], g_discovery.services[i].id, PN_MAX_ID_LEN - 1);
+            ids[n][PN_MAX_ID_LEN - 1] = '\0';
+            n++;
+        }
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    for (int i = 0; i < n; i++) {
+        handle_bye(ids[i], 0, 0);
+    }
+}
+
+/* Execute one control command */
+int pn_control_exec(const char *cmd, char *out, int maxlen) {
+    char verb[16] = "", arg1[256] = "", arg2[32] = "";
+    int pos = 0;
+    
+    if (out && maxlen > 0) out[0] = '\0';
+    if (!g_discovery.initialized) {
+        reply_append(out, 0, maxlen, "error: not initialized\n");
+        return -1;
+    }
+    if (!cmd || sscanf(cmd, "%15s %255s %31s", verb, arg1, arg2) < 1) {
+        reply_append(out, 0, maxlen, "error: empty command\n");
+        return -1;
+    }
+    
+    if (strcmp(verb, "interval") == 0) {
+        int min = atoi(arg1), max = atoi(arg2);
+        if (min < 1 || max < min) {
+            reply_append(out, 0, maxlen, "error: usage: interval <min> <max>\n");
+            return -1;
+        }
+        if (max > PN_LEASE_MAX_SEC / 3) {
+            reply_append(out, 0, maxlen, "error: interval max above %d s outruns the longest lease\n",
+                         PN_LEASE_MAX_SEC / 3);
+            return -1;
+        }
+        mutex_lock(&g_discovery.cfg_mutex);
+        g_discovery.cfg.announce_min_sec = min;
+        g_discovery.cfg.announce_max_sec = max;
+        mutex_unlock(&g_discovery.cfg_mutex);
+        g_discovery.sched_gen++;
+        
+    } else if (strcmp(verb, "log") == 0) {
+        int level = atoi(arg1);
+        if (!arg1[0] || level < PN_LOG_QUIET || level > PN_LOG_DEBUG) {
+            reply_append(out, 0, maxlen, "error: usage: log <0|1|2>\n");
+            return -1;
+        }
+        mutex_lock(&g_discovery.cfg_mutex);
+        g_discovery.cfg.log_level = level;
+        mutex_unlock(&g_discovery.cfg_mutex);
+    
+    } else if (strcmp(verb, "filter") == 0 || strcmp(verb, "iface") == 0) {
+        bool is_filter = (verb[0] == 'f');
+        config_t next;
+        int count;
+        
+        if (!arg1[0]) {
+            reply_append(out, 0, maxlen, "error: usage: %s <name,...|*>\n", verb);
+            return -1;
+        }
+        if (is_filter) {
+            count = parse_name_list(arg1, &next.filters[0][0], PN_MAX_FILTERS,
+                                    PN_MAX_SERVICE_LEN);
+        } else {
+            count = parse_name_list(arg1, &next.ifaces[0][0], PN_MAX_IFACES,
+                                    CFG_IFNAME_LEN);
+        }
+        if (count < 0) {
+            reply_append(out, 0, maxlen, "error: bad %s list\n", verb);
+            return -1;
+        }
+        
+        /* Swap the whole list in at once */
+        mutex_lock(&g_discovery.cfg_mutex);
+        if (is_filter) {
+            memcpy(g_discovery.cfg.filters, next.filters, sizeof(next.filters));
+            g_discovery.cfg.n_filters = count;
+        } else {
+            memcpy(g_discovery.cfg.ifaces, next.ifaces, sizeof(next.ifaces));
+            g_discovery.cfg.n_ifaces = count;
+        }
+        mutex_unlock(&g_discovery.cfg_mutex);
+        
+        if (is_filter) {
+            registry_apply_filter();
+            g_discovery.interest_sent = 0;    /* Advertise the new interest now */
+        }
+        
+    } else if (strcmp(verb, "evict") == 0) {
+        static const char *names[] = { "none", "lru", "priority", "relevance" };
+        int policy = -1;
+        for (int i = 0; i < 4; i++) {
+            if (strcmp(arg1, names[i]) == 0) policy = i;
+        }
+        if (policy < 0 || pn_set_eviction(policy, atoi(arg2)) < 0) {
+            reply_append(out, 0, maxlen,
+                         "error: usage: evict <none|lru|priority|relevance> [max]\n");
+            return -1;
+        }
+        
+    } else if (strcmp(verb, "priority") == 0) {
+        if (!arg1[0] || !arg2[0] || pn_set_service_priority(arg1, atoi(arg2)) < 0) {
+            reply_append(out, 0, maxlen, "error: usage: priority <type> <0-%d>\n",
+                         PN_EVICT_CLASSES - 1);
+            return -1;
+        }
+        
+    } else if (strcmp(verb, "demand") == 0) {
+        if (strcmp(arg1, "on") != 0 && strcmp(arg1, "off") != 0) {
+            reply_append(out, 0, maxlen, "error: usage: demand <on|off>\n");
+            return -1;
+        }
+        pn_set_demand_announce(arg1[1] == 'n');
+        
+    } else if (strcmp(verb, "budget") == 0) {
+        if (!arg1[0] || pn_set_bandwidth(atoi(arg1), atoi(arg2)) < 0) {
+            reply_append(out, 0, maxlen, "error: usage: budget <bytes/s|0> [burst]\n");
+            return -1;
+        }
+        
+    } else if (strcmp(verb, "stats") == 0) {
+        pn_ingest_stats_t st;
+        pn_tx_stats_t tx;
+        config_t cfg;
+        int peers = 0;
+        
+        pn_get_ingest_stats(&st);
+        pn_get_tx_stats(&tx);
+        mutex_lock(&g_discovery.tx_mutex);
+        int tx_rate = g_discovery.tx_rate, tx_burst = g_discovery.tx_burst;
+        mutex_unlock(&g_discovery.tx_mutex);
+        mutex_lock(&g_discovery.cfg_mutex);
+        cfg = g_discovery.cfg;
+        mutex_unlock(&g_discovery.cfg_mutex);
+        mutex_lock(&g_discovery.peers_mutex);
+        for (int i = 0; i < PN_MAX_PEERS; i++) {
+            if (g_discovery.peers[i].active) peers++;
+        }
+        mutex_unlock(&g_discovery.peers_mutex);
+        
+        pos = reply_append(out, pos, maxlen, "services %d\n", pn_get_service_count());
+        pos = reply_append(out, pos, maxlen, "peers %d\n", peers);
+        pos = reply_append(out, pos, maxlen, "mode %s\n",
+                           g_discovery.unicast_mode ? "unicast" : "broadcast");
+        pos = reply_append(out, pos, maxlen, "interval %d %d\n",
+                           cfg.announce_min_sec, cfg.announce_max_sec);
+        pos = reply_append(out, pos, maxlen, "log %d\n", cfg.log_level);
+        pos = reply_append(out, pos, maxlen, "filters %d\n", cfg.n_filters);
+        pos = reply_append(out, pos, maxlen, "ifaces %d\n", cfg.n_ifaces);
+        pos = reply_append(out, pos, maxlen, "slots %d\n", capacity_remaining());
+        for (int c = 0; c < PN_INGEST_CLASSES; c++) {
+            pos = reply_append(out, pos, maxlen, "ingest%d %llu %llu\n", c,
+                               (unsigned long long)st.received[c],
+                               (unsigned long long)st.dropped[c]);
+        }
+        pos = reply_append(out, pos, maxlen, "overload %llu\n",
+                           (unsigned long long)st.overload_cycles);
+        pos = reply_append(out, pos, maxlen, "merge %llu %llu\n",
+                           (unsigned long long)st.duplicates, (unsigned long long)st.stale);
+        pos = reply_append(out, pos, maxlen, "evict %d %d %llu %llu\n",
+                           g_discovery.evict_policy, g_discovery.evict_limit,
+                           (unsigned long long)st.evicted, (unsigned long long)st.rejected);
+        pos = reply_append(out, pos, maxlen, "demand %d idle %d %d\n", g_discovery.demand,
+                           g_discovery.announce_idle, g_discovery.proxy_idle);
+        pos = reply_append(out, pos, maxlen, "lease %llu %llu\n",
+                           (unsigned long long)st.probes, (unsigned long long)st.expired);
+        pn_coord_stats_t cs;
+        if (pn_get_coord_stats(&cs) == 0) {
+            pos = reply_append(out, pos, maxlen, "coord %u %llu %llu %llu\n", cs.sessions,
+                               (unsigned long long)cs.accepted, (unsigned long long)cs.dropped,
+                               (unsigned long long)cs.deltas);
+        }
+        pos = reply_append(out, pos, maxlen, "engine %d\n", g_discovery.shared_engine);
+        pos = reply_append(out, pos, maxlen, "budget %d %d\n", tx_rate, tx_burst);
+        for (int c = 0; c < PN_TX_CLASSES; c++) {
+            pos = reply_append(out, pos, maxlen, "tx%d %llu %llu %llu %llu\n", c,
+                               (unsigned long long)tx.sent[c], (unsigned long long)tx.deferred[c],
+                               (unsigned long long)tx.merged[c], (unsigned long long)tx.dropped[c]);
+        }
+        pos = reply_append(out, pos, maxlen, "txbytes %llu %llu\n",
+                           (unsigned long long)tx.bytes_sent, (unsigned long long)tx.bytes_deferred);
+        pos = reply_append(out, pos, maxlen, "txdelay %u last %llu\n", tx.max_delay_ms,
+                           (unsigned long long)tx.last_deferred_ms);
+        pos = reply_append(out, pos, maxlen, "offload gso %d gro %d segmented %llu coalesced %llu\n",
+                           g_discovery.udp_gso, g_discovery.udp_gro,
+                           (unsigned long long)tx.segmented, (unsigned long long)st.coalesced);
+        
+    } else if (strcmp(verb, "dump") == 0) {
+        uint32_t now = (uint32_t)time(NULL);
+        mutex_lock(&g_discovery.services_mutex);
+        for (int i = 0; i < PN_MAX_SERVICES; i++) {
+            const pn_service_t *s = &g_discovery.services[i];
+            if (!s->active) continue;
+            pos = reply_append(out, pos, maxlen,
+                               "%s %s %s:%d/%d age=%u alive=%u inc=%u hlc=%llu slots=%d\n",
+                               s->id, s->service, s->ip, s->ctrl_port, s->data_port,
+                               now - s->last_seen, now - g_discovery.svc_meta[i].health.alive,
+                               s->incarnation,
+                               (unsigned long long)s->hlc, s->slots);
+        }
+        mutex_unlock(&g_discovery.services_mutex);
+        
+    } else if (strcmp(verb, "resync") == 0) {
+        if (g_discovery.announcing) {
+            g_discovery.reannounce_delay_sec = 0;
+            g_discovery.reannounce_pending = true;
+        }
+        if (g_discovery.proxying) {
+            g_discovery.proxy_dirty = true;
+        }
+        pn_query(NULL);
+        
+    } else if (strcmp(verb, "help") == 0) {
+        pos = reply_append(out, pos, maxlen,
+                           "interval <min> <max>\nlog <0|1|2>\nfilter <type,...|*>\n"
+                           "iface <name,...|*>\nevict <none|lru|priority|relevance> [max]\n"
+                           "priority <type> <0-7>\ndemand <on|off>\nbudget <bytes/s|0> [burst]\n"
+                           "stats\ndump\nresync\n");
+        
+    } else {
+        reply_append(out, 0, maxlen, "error: unknown command '%s'\n", verb);
+        return -1;
+    }
+    
+    reply_append(out, pos, maxlen, "ok\n");
+    return 0;
+}
+
+#ifndef _WIN32
+/* Serve one control connection until the peer closes it */
+static void control_serve(int fd) {
+    char line[512];
+    char reply[PN_CONTROL_MAX_REPLY];
+    int len = 0;
+    
+    while (g_discovery.control_running) {
+        ssize_t n = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+        if (n <= 0) break;
+        len += (int)n;
+        line[len] = '\0';
+        
+        /* Run each complete line */
+        char *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+            if (line[0]) {
+                pn_control_exec(line, reply, sizeof(reply));
+                send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+            }
+            len -= (int)(nl + 1 - line);
+            memmove(line, nl + 1, len + 1);
+        }
+        if (len >= (int)sizeof(line) - 1) break;  /* Overlong line */
+    }
+}
+
+/* Control thread: one connection at a time */
+static void* control_thread_func(void *arg) {
+    (void)arg;
+    
+    while (g_discovery.control_running) {
+        fd_set fds;
+        struct timeval tv = {1, 0};
+        FD_ZERO(&fds);
+        FD_SET(g_discovery.control_sock, &fds);
+        if (select(g_discovery.control_sock + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+        
+        int fd = accept(g_discovery.control_sock, NULL, NULL);
+        if (fd < 0) continue;
+        
+        /* Bounded reads so close() is never stuck behind an idle client */
+        struct timeval rtv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rtv, sizeof(rtv));
+        control_serve(fd);
+        close(fd);
+    }
+    
+    return NULL;
+}
+#endif
+
+/* Id handle for history records */
+uint32_t pn_history_id_handle(const char *id) {
+    uint32_t h = 0x811c9dc5u;
+    for (const char *p = id; p && *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 0x01000193u;
+    }
+    return h;
+}
+
+/* Start recording registry events */
+int pn_history_open(const char *path, int max_records) {
+#ifdef _WIN32
+    (void)path; (void)max_records;
+    fprintf(stderr, "pn_discovery: event history not supported on Windows\n");
+    return -1;
+#else
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (!path || max_records <= 0) return -1;
+    
+    size_t len = sizeof(pn_history_header_t) + (size_t)max_records * sizeof(pn_history_record_t);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "pn_discovery: cannot open history %s\n", path);
+        return -1;
+    }
+    
+    /* Reuse a matching file, otherwise start over */
+    pn_history_header_t old;
+    bool reuse = pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) &&
+                 old.magic == PN_HISTORY_MAGIC && old.version == PN_HISTORY_VERSION &&
+                 old.record_size == sizeof(pn_history_record_t) &&
+                 old.capacity == (uint32_t)max_records;
+    if (!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)len) < 0)) {
+        fprintf(stderr, "pn_discovery: cannot size history %s\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "pn_discovery: mmap() of history failed\n");
+        return -1;
+    }
+    
+    pn_history_header_t *hdr = (pn_history_header_t*)p;
+    if (!reuse) {
+        hdr->version = PN_HISTORY_VERSION;
+        hdr->record_size = sizeof(pn_history_record_t);
+        hdr->capacity = (uint32_t)max_records;
+        hdr->total = 0;
+        __sync_synchronize();
+        hdr->magic = PN_HISTORY_MAGIC;
+    }
+    
+    pn_history_close();
+    mutex_lock(&g_discovery.services_mutex);
+    g_discovery.history = hdr;
+    g_discovery.history_len = len;
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    log_info("pn_discovery: recording history to %s (%d records)\n", path, max_records);
+    return 0;
+#endif
+}
+
+/* Stop recording registry events */
+void pn_history_close(void) {
+#ifndef _WIN32
+    if (!g_discovery.initialized) return;
+    mutex_lock(&g_discovery.services_mutex);
+    pn_history_header_t *hdr = g_discovery.history;
+    size_t len = g_discovery.history_len;
+    g_discovery.history = NULL;
+    mutex_unlock(&g_discovery.services_mutex);
+    
+    if (hdr) munmap(hdr, len);
+#endif
+}
+
+/* Run announce, proxy and listen roles on one thread */
+int pn_set_shared_engine(bool enable) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (g_discovery.announcing || g_discovery.proxying || g_discovery.listening) {
+        fprintf(stderr, "pn_discovery: stop announcing, proxying and listening first\n");
+        return -1;
     }
     
+    g_discovery.shared_engine = enable;
     return 0;
 }
 
-/* Get random announce interval */
-static int get_random_interval(void) {
-    int range = PN_ANNOUNCE_MAX_SEC - PN_ANNOUNCE_MIN_SEC;
-    return PN_ANNOUNCE_MIN_SEC + (rand() % (range + 1));
-}
-
-/* Get random re-announce interval (shorter, for responding to new services) */
-static int get_reannounce_delay(void) {
-    return 2 + (rand() % 9);  /* 2-10 seconds */
-}
-
-/* Announce thread */
-#ifdef _WIN32
-static DWORD WINAPI announce_thread_func(LPVOID param) {
-#else
-static void* announce_thread_func(void *param) {
-#endif
-    (void)param;
+/* Finish setting up a forked child */
+int pn_discovery_after_fork(void) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
     
-    char msg[PN_MAX_MSG_LEN];
+    bool restart = g_discovery.forked && g_discovery.fork_restart;
+    if (fork_settle() < 0) return -1;
+    if (!restart) return 0;
     
-    /* Initial announcement */
-    int len = build_helo_message(msg, sizeof(msg));
-    if (len > 0) {
-        broadcast_message(msg, len);
+    if (pn_listen(g_discovery.callback, g_discovery.callback_userdata) < 0) return -1;
+    
+    /* Unicast peers learn our ephemeral port from the query */
+    if (g_discovery.unicast_mode) pn_query(NULL);
+    return 0;
+}
+
+/* Choose what forked children inherit */
+int pn_set_fork_mode(int mode) {
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (mode != PN_FORK_SNAPSHOT && mode != PN_FORK_RESTART && mode != PN_FORK_ATTACH) {
+        return -1;
     }
     
-    while (g_discovery.announce_running) {
-        int interval = get_random_interval();
-        
-        /* Sleep in 1-second increments, checking for re-announce requests */
-        for (int i = 0; i < interval && g_discovery.announce_running; i++) {
-            sleep_ms(1000);
-            
-            /* Check for reactive re-announce (new service joined network) */
-            if (g_discovery.reannounce_pending) {
-                g_discovery.reannounce_delay_sec--;
-                if (g_discovery.reannounce_delay_sec <= 0) {
-                    g_discovery.reannounce_pending = false;
-                    len = build_helo_message(msg, sizeof(msg));
-                    if (len > 0) {
-                        printf("pn_discovery: re-announcing (reactive)\n");
-                        broadcast_message(msg, len);
-                    }
-                    break;  /* Reset the main interval */
-                }
-            }
+#ifdef _WIN32
+    return (mode == PN_FORK_SNAPSHOT) ? 0 : -1;
+#else
+    if (mode == PN_FORK_ATTACH && !g_discovery.shared) {
+        /* Map the image before any fork so children share the pages */
+        void *p = mmap(NULL, sizeof(shared_registry_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "pn_discovery: mmap() of shared registry failed\n");
+            return -1;
         }
+        g_discovery.shared = (shared_registry_t*)p;
         
-        if (!g_discovery.announce_running) break;
-        
-        /* Regular periodic announcement (only if we didn't just re-announce) */
-        if (!g_discovery.reannounce_pending) {
-            len = build_helo_message(msg, sizeof(msg));
-            if (len > 0) {
-                broadcast_message(msg, len);
-            }
+        mutex_lock(&g_discovery.services_mutex);
+        for (int i = 0; i < PN_MAX_SERVICES; i++) {
+            shared_publish(i);
         }
+        mutex_unlock(&g_discovery.services_mutex);
     }
     
-#ifdef _WIN32
+    g_discovery.fork_mode = mode;
     return 0;
-#else
-    return NULL;
 #endif
 }
 
-/* Listen thread */
+/* Open the control socket */
+int pn_control_open(const char *path) {
 #ifdef _WIN32
-static DWORD WINAPI listen_thread_func(LPVOID param) {
+    (void)path;
+    fprintf(stderr, "pn_discovery: control socket not supported on Windows\n");
+    return -1;
 #else
-static void* listen_thread_func(void *param) {
-#endif
-    (void)param;
+    if (!g_discovery.initialized) {
+        fprintf(stderr, "pn_discovery: not initialized\n");
+        return -1;
+    }
+    if (!path || !path[0] || strlen(path) >= sizeof(g_discovery.control_path)) {
+        fprintf(stderr, "pn_discovery: bad control socket path\n");
+        return -1;
+    }
+    if (g_discovery.controlling) {
+        pn_control_close();
+    }
     
-    char buf[PN_MAX_MSG_LEN];
-    struct sockaddr_in sender;
-    socklen_t sender_len;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "pn_discovery: control socket() failed\n");
+        return -1;
+    }
     
-    /* Set receive timeout */
-#ifdef _WIN32
-    DWORD timeout = 1000;
-    setsockopt(g_discovery.sock, SOL_SOCKET, SO_RCVTIMEO, 
-               (const char*)&timeout, sizeof(timeout));
-#else
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    setsockopt(g_discovery.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-#endif
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
     
-    while (g_discovery.listen_running) {
-        sender_len = sizeof(sender);
-        int len = recvfrom(g_discovery.sock, buf, sizeof(buf) - 1, 0,
-                          (struct sockaddr*)&sender, &sender_len);
-        
-        if (len > 0) {
-            buf[len] = '\0';
-            char sender_ip[64];
-            inet_ntop(AF_INET, &sender.sin_addr, sender_ip, sizeof(sender_ip));
-            parse_message(buf, len, sender_ip);
-        }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "pn_discovery: control bind(%s) failed\n", path);
+        close(fd);
+        return -1;
     }
     
-#ifdef _WIN32
+    g_discovery.control_sock = fd;
+    strncpy(g_discovery.control_path, path, sizeof(g_discovery.control_path) - 1);
+    g_discovery.control_running = true;
+    if (pthread_create(&g_discovery.control_thread, NULL, control_thread_func, NULL) != 0) {
+        fprintf(stderr, "pn_discovery: failed to create control thread\n");
+        g_discovery.control_running = false;
+        close(fd);
+        unlink(path);
+        g_discovery.control_sock = INVALID_SOCK;
+        return -1;
+    }
+    g_discovery.controlling = true;
+    
+    log_info("pn_discovery: control socket at %s\n", path);
     return 0;
-#else
-    return NULL;
 #endif
 }
 
-/* Start announcing */
-int pn_announce(const char *id, const char *service,
-                int ctrl_port, int data_port, const char *caps) {
+/* Close the control socket */
+void pn_control_close(void) {
+#ifndef _WIN32
+    if (!g_discovery.controlling) return;
+    
+    g_discovery.control_running = false;
+    pthread_join(g_discovery.control_thread, NULL);
+    close(g_discovery.control_sock);
+    unlink(g_discovery.control_path);
+    g_discovery.control_sock = INVALID_SOCK;
+    g_discovery.controlling = false;
+#endif
+}
+
+/* Can this slot take a client of the type? Caller holds services_mutex. */
+static bool registry_eligible(int i, const char *service_type) {
+    return g_discovery.services[i].active &&
+           g_discovery.services[i].slots != 0 &&
+           strcmp(g_discovery.services[i].service, service_type) == 0;
+}
+
+/*
+ * First active service of a type that can take a client: servers that
+ * advertise zero free slots are skipped, and one that failed its last
+ * connects loses to one that did not. Caller holds services_mutex.
+ */
+static int registry_pick(const char *service_type) {
+    int best = -1;
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (registry_eligible(i, service_type) &&
+            (best < 0 || g_discovery.svc_meta[i].health.streak <
+                         g_discovery.svc_meta[best].health.streak)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* Copy first active service of a type */
+static bool copy_service(const char *service_type, pn_service_t *out) {
+    shared_sync();
+    mutex_lock(&g_discovery.services_mutex);
+    evict_want(service_type);
+    int idx = registry_pick(service_type);
+    if (idx >= 0 && out) {
+        memcpy(out, &g_discovery.services[idx], sizeof(*out));
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+    return idx >= 0;
+}
+
+/* Resolve a service type: registry, then one coalesced query per type */
+int pn_resolve_service(const char *service_type, pn_service_t *out, int timeout_ms) {
     if (!g_discovery.initialized) {
         fprintf(stderr, "pn_discovery: not initialized\n");
         return -1;
     }
     
-    if (g_discovery.announcing) {
-        pn_announce_stop();
+    if (copy_service(service_type, out)) return 0;
+    
+    mutex_lock(&g_discovery.resolve_mutex);
+    
+    /* Find this type's entry, or recycle an idle one */
+    uint64_t now = now_ms();
+    int idx = -1, idle = -1;
+    for (int i = 0; i < PN_MAX_RESOLVE; i++) {
+        if (strcmp(g_discovery.resolve[i].service, service_type) == 0) {
+            idx = i;
+            break;
+        }
+        if (g_discovery.resolve[i].in_flight || g_discovery.resolve[i].waiters > 0) continue;
+        if (g_discovery.resolve[i].service[0] && g_discovery.resolve[i].neg_until > now) continue;
+        if (idle < 0 || g_discovery.resolve[i].last_used < g_discovery.resolve[idle].last_used) {
+            idle = i;
+        }
+    }
+    if (idx < 0) {
+        if (idle < 0) {
+            /* Every slot is busy: bounded, so don't add to the wire */
+            mutex_unlock(&g_discovery.resolve_mutex);
+            return -1;
+        }
+        idx = idle;
+        memset(&g_discovery.resolve[idx], 0, sizeof(g_discovery.resolve[idx]));
+        strncpy(g_discovery.resolve[idx].service, service_type, PN_MAX_SERVICE_LEN - 1);
     }
     
-    /* Store service info */
-    strncpy(g_discovery.my_service.id, id, PN_MAX_ID_LEN - 1);
-    strncpy(g_discovery.my_service.service, service, PN_MAX_SERVICE_LEN - 1);
-    strncpy(g_discovery.my_service.ip, g_discovery.local_ip, PN_MAX_IP_LEN - 1);
-    g_discovery.my_service.ctrl_port = ctrl_port;
-    g_discovery.my_service.data_port = data_port;
-    if (caps) {
-        strncpy(g_discovery.my_service.caps, caps, PN_MAX_CAPS_LEN - 1);
+    /* Cached miss */
+    if (g_discovery.resolve[idx].neg_until > now) {
+        mutex_unlock(&g_discovery.resolve_mutex);
+        return -1;
     }
     
-    /* Start announce thread */
-    g_discovery.announce_running = true;
-    g_discovery.announcing = true;
+    g_discovery.resolve[idx].last_used = now;
+    g_discovery.resolve[idx].waiters++;
     
-#ifdef _WIN32
-    g_discovery.announce_thread = CreateThread(NULL, 0, announce_thread_func, NULL, 0, NULL);
-    if (g_discovery.announce_thread == NULL) {
-        g_discovery.announcing = false;
-        g_discovery.announce_running = false;
-        return -1;
+    /* First asker sends the query; everyone else waits on it */
+    bool leader = !g_discovery.resolve[idx].in_flight;
+    if (leader) {
+        g_discovery.resolve[idx].in_flight = true;
+        g_discovery.resolve[idx].answered = false;
+        mutex_unlock(&g_discovery.resolve_mutex);
+        pn_query(service_type);
+        mutex_lock(&g_discovery.resolve_mutex);
     }
-#else
-    if (pthread_create(&g_discovery.announce_thread, NULL, announce_thread_func, NULL) != 0) {
-        g_discovery.announcing = false;
-        g_discovery.announce_running = false;
-        return -1;
+    
+    uint64_t deadline = now + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    while (!g_discovery.resolve[idx].answered && g_discovery.resolve[idx].in_flight) {
+        now = now_ms();
+        if (now >= deadline) break;
+        cond_wait_ms(&g_discovery.resolve_cond, &g_discovery.resolve_mutex, (int)(deadline - now));
     }
-#endif
     
-    printf("pn_discovery: announcing as %s '%s' on port %d\n", service, id, ctrl_port);
-    return 0;
+    /* Leader gave up: cache the miss with exponential backoff */
+    if (leader && !g_discovery.resolve[idx].answered && g_discovery.resolve[idx].in_flight) {
+        int backoff = g_discovery.resolve[idx].backoff_ms * 2;
+        if (backoff < PN_NEG_CACHE_MIN_MS) backoff = PN_NEG_CACHE_MIN_MS;
+        if (backoff > PN_NEG_CACHE_MAX_MS) backoff = PN_NEG_CACHE_MAX_MS;
+        g_discovery.resolve[idx].backoff_ms = backoff;
+        g_discovery.resolve[idx].neg_until = now_ms() + (uint64_t)backoff;
+        g_discovery.resolve[idx].in_flight = false;
+        cond_broadcast(&g_discovery.resolve_cond);
+    }
+    
+    g_discovery.resolve[idx].waiters--;
+    mutex_unlock(&g_discovery.resolve_mutex);
+    
+    return copy_service(service_type, out) ? 0 : -1;
 }
 
-/* Stop announcing */
-void pn_announce_stop(void) {
-    if (!g_discovery.announcing) return;
+/* One address raced by pn_connect_service() */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int cand;                         /* Index into the ranked candidates */
+    socket_t sock;
+    uint64_t started;
+} connect_attempt_t;
+
+/* Should slot a be tried before slot b? Caller holds services_mutex. */
+static bool connect_ranks_before(int a, int b) {
+    const pn_health_t *ha = &g_discovery.svc_meta[a].health;
+    const pn_health_t *hb = &g_discovery.svc_meta[b].health;
+    if (ha->streak != hb->streak) return ha->streak < hb->streak;
+    if ((ha->rtt_ms >= 0) != (hb->rtt_ms >= 0)) return ha->rtt_ms >= 0;
+    if (ha->rtt_ms != hb->rtt_ms) return ha->rtt_ms < hb->rtt_ms;
+    return g_discovery.services[a].last_seen > g_discovery.services[b].last_seen;
+}
+
+/* Copy the instances of a type that can take a client, best first */
+static int connect_candidates(const char *service_type, pn_service_t *out, int max) {
+    int order[PN_MAX_SERVICES], n = 0;
     
-    /* Send bye message */
-    char msg[PN_MAX_MSG_LEN];
-    int len = build_bye_message(msg, sizeof(msg));
-    if (len > 0) {
-        broadcast_message(msg, len);
+    shared_sync();
+    mutex_lock(&g_discovery.services_mutex);
+    evict_want(service_type);
+    for (int i = 0; i < PN_MAX_SERVICES; i++) {
+        if (!registry_eligible(i, service_type) || g_discovery.services[i].ctrl_port <= 0) continue;
+        int k = n++;
+        while (k > 0 && connect_ranks_before(i, order[k - 1])) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
     }
+    if (n > max) n = max;
+    for (int i = 0; i < n; i++) out[i] = g_discovery.services[order[i]];
+    mutex_unlock(&g_discovery.services_mutex);
+    return n;
+}
+
+/*
+ * Resolve every candidate's address and order the attempts: rank order
+ * within each address family, families alternating, starting with the
+ * family the resolver preferred first (RFC 8305 interleaving).
+ */
+static int connect_plan(const pn_service_t *cands, int ncand, connect_attempt_t *att, int max) {
+    connect_attempt_t fam[2][PN_MAX_CONNECT_ATTEMPTS];
+    int nfam[2] = {0, 0}, first = -1;
     
-    /* Stop thread */
-    g_discovery.announce_running = false;
+    for (int c = 0; c < ncand; c++) {
+        struct addrinfo hints, *res, *ai;
+        char port[8];
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        snprintf(port, sizeof(port), "%d", cands[c].ctrl_port);
+        if (getaddrinfo(cands[c].ip, port, &hints, &res) != 0) continue;
+        
+        for (ai = res; ai; ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+            int f = (ai->ai_family == AF_INET6) ? 1 : 0;
+            if (first < 0) first = f;
+            if (nfam[f] >= PN_MAX_CONNECT_ATTEMPTS ||
+                ai->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+            connect_attempt_t *a = &fam[f][nfam[f]++];
+            memset(a, 0, sizeof(*a));
+            memcpy(&a->addr, ai->ai_addr, ai->ai_addrlen);
+            a->addrlen = (socklen_t)ai->ai_addrlen;
+            a->cand = c;
+            a->sock = INVALID_SOCK;
+        }
+        freeaddrinfo(res);
+    }
     
+    int n = 0, next[2] = {0, 0}, f = (first < 0) ? 0 : first;
+    while (n < max && (next[0] < nfam[0] || next[1] < nfam[1])) {
+        if (next[f] < nfam[f]) att[n++] = fam[f][next[f]++];
+        f ^= 1;
+    }
+    return n;
+}
+
+static void socket_set_blocking(socket_t sock, bool blocking) {
 #ifdef _WIN32
-    WaitForSingleObject(g_discovery.announce_thread, 5000);
-    CloseHandle(g_discovery.announce_thread);
+    u_long nonblocking = blocking ? 0 : 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
 #else
-    pthread_join(g_discovery.announce_thread, NULL);
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
 #endif
+}
+
+/* Start a non-blocking connect; 0 if under way (or already connected) */
+static int connect_start(connect_attempt_t *a) {
+    a->sock = socket(a->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (a->sock == INVALID_SOCK) return -1;
+    socket_set_blocking(a->sock, false);
+    a->started = now_ms();
     
-    g_discovery.announcing = false;
-    printf("pn_discovery: stopped announcing\n");
+    if (connect(a->sock, (struct sockaddr*)&a->addr, a->addrlen) == 0) return 0;
+#ifdef _WIN32
+    if (WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+#else
+    if (errno == EINPROGRESS) return 0;
+#endif
+    close_socket(a->sock);
+    a->sock = INVALID_SOCK;
+    return -1;
 }
 
-/* Start listening */
-int pn_listen(pn_service_cb callback, void *userdata) {
+/*
+ * Wait up to wait_ms for pending connects to finish; marks finished ones in
+ * done[]. Windows reports a refused connect only through the except set.
+ */
+static int connect_wait(const connect_attempt_t *att, int n, int wait_ms, bool *done) {
+    int ready = 0;
+#ifdef _WIN32
+    fd_set wfds, efds;
+    struct timeval tv = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    for (int i = 0; i < n; i++) {
+        if (att[i].sock == INVALID_SOCK) continue;
+        FD_SET(att[i].sock, &wfds);
+        FD_SET(att[i].sock, &efds);
+    }
+    if (select(0, NULL, &wfds, &efds, &tv) <= 0) return 0;
+    for (int i = 0; i < n; i++) {
+        done[i] = att[i].sock != INVALID_SOCK &&
+                  (FD_ISSET(att[i].sock, &wfds) || FD_ISSET(att[i].sock, &efds));
+        if (done[i]) ready++;
+    }
+#else
+    struct pollfd pfds[PN_MAX_CONNECT_ATTEMPTS];
+    int map[PN_MAX_CONNECT_ATTEMPTS], np = 0;
+    for (int i = 0; i < n; i++) {
+        if (att[i].sock == INVALID_SOCK) continue;
+        pfds[np].fd = att[i].sock;
+        pfds[np].events = POLLOUT;
+        pfds[np].revents = 0;
+        map[np++] = i;
+    }
+    if (poll(pfds, np, wait_ms) <= 0) return 0;
+    for (int k = 0; k < np; k++) {
+        done[map[k]] = pfds[k].revents != 0;
+        if (done[map[k]]) ready++;
+    }
+#endif
+    return ready;
+}
+
+/* Outcome of a finished connect: 0 if established, else the socket error */
+static int connect_result(socket_t sock) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) return -1;
+    return err;
+}
+
+/* Record one finished attempt against the instance's health */
+static void health_record(const pn_service_t *s, bool ok, int rtt_ms) {
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(s->id);
+    if (idx >= 0) {
+        pn_health_t *h = &g_discovery.svc_meta[idx].health;
+        if (ok) {
+            h->connects++;
+            h->streak = 0;
+            h->rtt_ms = rtt_ms;
+        } else {
+            h->failures++;
+            h->streak++;
+        }
+    }
+    mutex_unlock(&g_discovery.services_mutex);
+}
+
+/* Connect to a service type, racing the ranked candidates */
+int pn_connect_service(const char *service_type, int timeout_ms, pn_service_t *chosen) {
     if (!g_discovery.initialized) {
         fprintf(stderr, "pn_discovery: not initialized\n");
         return -1;
     }
     
-    if (g_discovery.listening) {
-        return 0;  /* Already listening */
+    uint64_t deadline = now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    pn_service_t cands[PN_MAX_CONNECT_ATTEMPTS];
+    int ncand = connect_candidates(service_type, cands, PN_MAX_CONNECT_ATTEMPTS);
+    if (ncand == 0 && pn_resolve_service(service_type, NULL, timeout_ms) == 0) {
+        ncand = connect_candidates(service_type, cands, PN_MAX_CONNECT_ATTEMPTS);
     }
     
-    g_discovery.callback = callback;
-    g_discovery.callback_userdata = userdata;
-    g_discovery.listen_running = true;
-    g_discovery.listening = true;
+    connect_attempt_t att[PN_MAX_CONNECT_ATTEMPTS];
+    bool done[PN_MAX_CONNECT_ATTEMPTS];
+    int n = connect_plan(cands, ncand, att, PN_MAX_CONNECT_ATTEMPTS);
+    int next = 0, pending = 0, win = -1;
+    uint64_t next_start = 0;
     
-#ifdef _WIN32
-    g_discovery.listen_thread = CreateThread(NULL, 0, listen_thread_func, NULL, 0, NULL);
-    if (g_discovery.listen_thread == NULL) {
-        g_discovery.listening = false;
-        g_discovery.listen_running = false;
-        return -1;
+    while (win < 0) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        
+        /* Start the next attempt when the stagger expires or nothing is in flight */
+        if (next < n && (pending == 0 || now >= next_start)) {
+            connect_attempt_t *a = &att[next++];
+            if (connect_start(a) == 0) {
+                pending++;
+                next_start = now + PN_CONNECT_STAGGER_MS;
+            } else {
+                health_record(&cands[a->cand], false, 0);
+            }
+            continue;
+        }
+        if (pending == 0) break;
+        
+        uint64_t until = (next < n && next_start < deadline) ? next_start : deadline;
+        memset(done, 0, sizeof(done));
+        if (connect_wait(att, next, (int)(until - now), done) == 0) continue;
+        
+        for (int i = 0; i < next && win < 0; i++) {
+            if (!done[i]) continue;
+            connect_attempt_t *a = &att[i];
+            int err = connect_result(a->sock);
+            if (err == 0) {
+                win = i;
+                health_record(&cands[a->cand], true, (int)(now_ms() - a->started));
+                continue;
+            }
+            log_debug("pn_discovery: connect to %s '%s' failed (%d)\n",
+                      cands[a->cand].service, cands[a->cand].id, err);
+            health_record(&cands[a->cand], false, 0);
+            close_socket(a->sock);
+            a->sock = INVALID_SOCK;
+            pending--;
+            next_start = now;         /* A failure starts the next attempt at once */
+        }
     }
-#else
-    if (pthread_create(&g_discovery.listen_thread, NULL, listen_thread_func, NULL) != 0) {
-        g_discovery.listening = false;
-        g_discovery.listen_running = false;
-        return -1;
+    
+    /* Losers still in flight are abandoned, not counted against their instance */
+    for (int i = 0; i < next; i++) {
+        if (i != win && att[i].sock != INVALID_SOCK) close_socket(att[i].sock);
     }
-#endif
+    if (win < 0) return -1;
     
-    printf("pn_discovery: listening for services\n");
-    return 0;
+    socket_set_blocking(att[win].sock, true);
+    if (chosen) *chosen = cands[att[win].cand];
+    return (int)att[win].sock;
+}
+
+/* Get the connect health recorded for an instance */
+int pn_get_health(const char *id, pn_health_t *out) {
+    if (!id || !out) return -1;
+    
+    mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(id);
+    if (idx >= 0) *out = g_discovery.svc_meta[idx].health;
+    mutex_unlock(&g_discovery.services_mutex);
+    return idx >= 0 ? 0 : -1;
+}
+
+/* Note data-plane traffic from an instance: one lock-free store */
+void pn_note_alive(const char *id) {
+    if (!id) return;
+    uint32_t h = pn_history_id_handle(id);
+    atomic_store_u64(&g_discovery.alive_hints[h & (ALIVE_SLOTS - 1)],
+                     ((uint64_t)h << 32) | (uint32_t)time(NULL));
 }
 
 /* Find service by type */
 const pn_service_t* pn_find_service(const char *service_type) {
+    shared_sync();
     mutex_lock(&g_discovery.services_mutex);
-    
-    for (int i = 0; i < PN_MAX_SERVICES; i++) {
-        if (g_discovery.services[i].active &&
-            strcmp(g_discovery.services[i].service, service_type) == 0) {
-            mutex_unlock(&g_discovery.services_mutex);
-            return &g_discovery.services[i];
-        }
-    }
-    
+    evict_want(service_type);
+    int idx = registry_pick(service_type);
     mutex_unlock(&g_discovery.services_mutex);
-    return NULL;
+    
+    return (idx >= 0) ? &g_discovery.services[idx] : NULL;
 }
 
 /* Find service by ID */
 const pn_service_t* pn_find_service_by_id(const char *id) {
+    shared_sync();
     mutex_lock(&g_discovery.services_mutex);
+    int idx = registry_lookup(id);
+    mutex_unlock(&g_discovery.services_mutex);
     
-    for (int i = 0; i < PN_MAX_SERVICES; i++) {
-        if (g_discovery.services[i].active &&
-            strcmp(g_discovery.services[i].id, id) == 0) {
-            mutex_unlock(&g_discovery.services_mutex);
-            return &g_discovery.services[i];
-        }
-    }
+    return (idx >= 0) ? &g_discovery.services[idx] : NULL;
+}
+
+/* List services by id prefix */
+int pn_find_by_id_prefix(const char *prefix, pn_service_t *out, int max_count) {
+    if (!g_discovery.initialized || !prefix || !out || max_count <= 0) return 0;
     
+    shared_sync();
+    mutex_lock(&g_discovery.services_mutex);
+    int count = radix_prefix(prefix, out, max_count);
     mutex_unlock(&g_discovery.services_mutex);
-    return NULL;
+    return count;
 }
 
 /* Get all services */
 int pn_get_services(pn_service_t *out, int max_count) {
     int count = 0;
     
+    shared_sync();
     mutex_lock(&g_discovery.services_mutex);
     
     for (int i = 0; i < PN_MAX_SERVICES && count < max_count; i++) {
@@ -751,6 +6694,7 @@ int pn_get_services(pn_service_t *out, int max_count) {
 int pn_get_service_count(void) {
     int count = 0;
     
+    shared_sync();
     mutex_lock(&g_discovery.services_mutex);
     
     for (int i = 0; i < PN_MAX_SERVICES; i++) {
@@ -767,38 +6711,92 @@ int pn_get_service_count(void) {
 void pn_discovery_shutdown(void) {
     if (!g_discovery.initialized) return;
     
+    /* From a callback it would join the thread it is running on */
+    if (g_discovery.listening &&
+        thread_is_self(g_discovery.shared_engine ? g_discovery.engine_thread
+                                                 : g_discovery.listen_thread)) {
+        fprintf(stderr, "pn_discovery: shutdown called from a callback, ignored\n");
+        return;
+    }
+    
+    /* Stop taking control commands */
+    pn_control_close();
+    
+    /* Close coordinator sessions */
+    pn_coordinator_close();
+    
+    /* Stop recording history */
+    pn_history_close();
+    
+    /* A forked child that never settled still holds its parent's copies */
+    fork_release();
+    g_discovery.forked = false;
+
     /* Stop announcing */
     if (g_discovery.announcing) {
         pn_announce_stop();
     }
     
+    /* Withdraw proxied services */
+    if (g_discovery.proxying) {
+        pn_proxy_stop();
+    }
+    
     /* Stop listening */
     if (g_discovery.listening) {
-        g_discovery.listen_running = false;
-#ifdef _WIN32
-        WaitForSingleObject(g_discovery.listen_thread, 5000);
-        CloseHandle(g_discovery.listen_thread);
-#else
-        pthread_join(g_discovery.listen_thread, NULL);
-#endif
+        role_stop(&g_discovery.listen_running, g_discovery.listen_thread);
         g_discovery.listening = false;
     }
     
+    /* Deliver the last partial batch */
+    batch_flush();
+    
     /* Close socket */
     if (g_discovery.sock != INVALID_SOCK) {
         close_socket(g_discovery.sock);
         g_discovery.sock = INVALID_SOCK;
     }
     
-    /* Destroy mutex */
+#ifndef _WIN32
+    /* Drop the registry image shared with children */
+    if (g_discovery.shared) {
+        munmap(g_discovery.shared, sizeof(*g_discovery.shared));
+        g_discovery.shared = NULL;
+    }
+#endif
+    
+    /* Destroy mutexes */
     mutex_destroy(&g_discovery.services_mutex);
+    mutex_destroy(&g_discovery.peers_mutex);
+    mutex_destroy(&g_discovery.proxy_mutex);
+    mutex_destroy(&g_discovery.resolve_mutex);
+    cond_destroy(&g_discovery.resolve_cond);
+    mutex_destroy(&g_discovery.batch_mutex);
+    mutex_destroy(&g_discovery.stats_mutex);
+    mutex_destroy(&g_discovery.capacity_mutex);
+    mutex_destroy(&g_discovery.cfg_mutex);
+    mutex_destroy(&g_discovery.reserve_mutex);
+    cond_destroy(&g_discovery.reserve_cond);
+    mutex_destroy(&g_discovery.hlc_mutex);
+    mutex_destroy(&g_discovery.tx_mutex);
+    cond_destroy(&g_discovery.tx_cond);
+    mutex_destroy(&g_discovery.boot_mutex);
+    cond_destroy(&g_discovery.boot_cond);
+    mutex_destroy(&g_discovery.engine_mutex);
+    cond_destroy(&g_discovery.engine_cond);
+    mutex_destroy(&g_discovery.vis_mutex);
+    cond_destroy(&g_discovery.vis_cond);
+#ifdef __linux__
+    mutex_destroy(&g_discovery.coord_mutex);
+    if (g_discovery.coord_wake >= 0) close(g_discovery.coord_wake);
+#endif
     
 #ifdef _WIN32
     WSACleanup();
 #endif
     
     g_discovery.initialized = false;
-    printf("pn_discovery: shutdown complete\n");
+    log_info("pn_discovery: shutdown complete\n");
 }
 
 /* Get local IP address */
@@ -0,0 +1,413 @@
+/*
+ * Phoenix Nest Service Discovery - Coordinator Connection-Storm Benchmark
+ * 
+ * Measures how the TCP coordinator copes with a whole site reconnecting at
+ * once and how fast one registry change reaches every subscriber:
+ *   bench_coordinator [sessions] [deltas] [port] [--json]
+ * 
+ * A forked child runs the engine's listener on <port> and the coordinator
+ * on <port>+1. The parent seeds the registry with SEED_IDS helos, opens
+ * <sessions> non-blocking loopback connections at once and waits for every
+ * snapshot, then sends <deltas> helos that each change one entry, one at a
+ * time, timing each on every session before sending the next. Reported:
+ * sessions accepted per second (first snapshot byte), connect-to-complete
+ * snapshot time, fan-out latency percentiles from the helo leaving to the
+ * change arriving, and coordinator RSS growth per session (user space only;
+ * socket buffers are kernel memory). --json prints one JSON object instead
+ * of the table. The client side shares the machine, so latencies include
+ * its own scheduling. Linux only.
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "pn_discovery.h"
+
+#define SEED_IDS        24      /* Registry entries in every snapshot */
+#define STORM_LIMIT_SEC 60      /* Give up on sessions not served by then */
+#define DRAIN_LIMIT_SEC 10      /* ...and on a change not delivered by then */
+#define LINE_BYTES      8192
+
+typedef struct {
+    int fd;
+    bool connected;
+    bool snapshot;              /* Last "snap" part received */
+    double t_connected;
+    double t_first;             /* First byte (the coordinator accepted us) */
+    double t_snapshot;
+    int deltas;                 /* Changes received after the snapshot */
+    int len;
+    char buf[LINE_BYTES];
+} client_t;
+
+typedef struct {
+    int sessions, deltas;
+    double storm_sec;           /* First connect to last complete snapshot */
+    double accept_per_sec;
+    double snap_p50_ms, snap_p99_ms, snap_max_ms;
+    double lat_p50_ms, lat_p90_ms, lat_p99_ms, lat_p999_ms, lat_max_ms;
+    long samples, expected;
+    double rss_per_session;     /* Bytes */
+    int failed;                 /* Sessions never served */
+    pn_coord_stats_t stats;
+} report_t;
+
+static client_t *clients;
+static int n_clients, ep;
+static double *sent_at;         /* Per change: when its helo left */
+static float *latency;          /* Per delivered change, ms */
+static long n_latency;
+static int n_deltas;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* One helo for seed id i at incarnation inc */
+static void send_helo(int sock, const struct sockaddr_in *dest, int i, int inc) {
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg),
+                       "{\"m\":\"PNSD\",\"v\":1,\"cmd\":\"helo\",\"id\":\"STORM-%02d\","
+                       "\"svc\":\"waterfall\",\"port\":%d,\"data\":0,\"inc\":%d,\"caps\":\"\"}",
+                       i, 7000 + i, inc);
+    sendto(sock, msg, len, 0, (const struct sockaddr*)dest, sizeof(*dest));
+}
+
+/* Coordinator child: serve until the parent closes the go pipe, then report */
+static void run_coordinator(int port, int go_fd, int result_fd) {
+    pn_coord_stats_t st;
+    char c;
+    
+    memset(&st, 0, sizeof(st));
+    if (pn_discovery_init(port) < 0) _exit(1);
+    pn_control_exec("log 0", NULL, 0);
+    if (pn_listen(NULL, NULL) < 0 || pn_coordinator_open(port + 1) < 0) _exit(1);
+    if (write(result_fd, "R", 1) != 1) _exit(1);
+    
+    while (read(go_fd, &c, 1) > 0) { }
+    pn_get_coord_stats(&st);
+    pn_discovery_shutdown();
+    if (write(result_fd, &st, sizeof(st)) != (ssize_t)sizeof(st)) _exit(1);
+    _exit(0);
+}
+
+/* Handle one complete line received by client c */
+static void client_line(client_t *c, const char *line, double now) {
+    if (strstr(line, "\"cmd\":\"snap\"")) {
+        if (!c->snapshot && strstr(line, "\"parts\":")) {
+            c->snapshot = true;
+            c->t_snapshot = now;
+        }
+        return;
+    }
+    const char *p = strstr(line, "\"cmd\":\"phelo\"");
+    if (!p || !c->snapshot) return;
+    
+    /* Changes are numbered by incarnation: change d carries d + 2 */
+    p = strstr(line, "\"inc0\":");
+    if (!p) return;
+    int d = atoi(p + 7) - 2;
+    if (d < 0 || d >= n_deltas || sent_at[d] == 0) return;
+    if (n_latency >= (long)n_clients * n_deltas) return;
+    latency[n_latency++] = (float)((now - sent_at[d]) * 1000.0);
+    c->deltas++;
+}
+
+/* Read everything a client has; returns -1 once it is closed */
+static int client_read(client_t *c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+        if (n == 0) return -1;
+        if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        
+        double now = now_sec();
+        if (c->t_first == 0) c->t_first = now;
+        c->len += (int)n;
+        c->buf[c->len] = '\0';
+        
+        char *start = c->buf, *nl;
+        while ((nl = strchr(start, '\n')) != NULL) {
+            *nl = '\0';
+            client_line(c, start, now);
+            start = nl + 1;
+        }
+        c->len -= (int)(start - c->buf);
+        memmove(c->buf, start, c->len + 1);
+        if (c->len >= (int)sizeof(c->buf) - 1) return -1;  /* Overlong line */
+    }
+}
+
+/* Service client sockets for up to wait_ms */
+static void pump(int wait_ms) {
+    struct epoll_event evs[256];
+    int n = epoll_wait(ep, evs, 256, wait_ms);
+    for (int i = 0; i < n; i++) {
+        client_t *c = (client_t*)evs[i].data.ptr;
+        if (!c->connected && (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int err = 0;
+            socklen_t elen = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+            if (err != 0) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                continue;
+            }
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+            c->connected = true;
+            c->t_connected = now_sec();
+        }
+        if ((evs[i].events & EPOLLIN) && client_read(c) < 0) {
+            epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+    }
+}
+
+static int count_snapshots(void) {
+    int n = 0;
+    for (int i = 0; i < n_clients; i++) n += clients[i].snapshot;
+    return n;
+}
+
+static bool deltas_reached(int k) {
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i].snapshot && clients[i].deltas < k) return false;
+    }
+    return true;
+}
+
+/* Enough descriptors for every session in both processes */
+static int raise_fd_limit(int need) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return -1;
+    if (rl.rlim_cur >= (rlim_t)need) return 0;
+    if (rl.rlim_max < (rlim_t)need) return -1;
+    rl.rlim_cur = rl.rlim_max;
+    return setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static int run(int sessions, int deltas, int port, report_t *r) {
+    int go[2], result[2];
+    char c;
+    
+    memset(r, 0, sizeof(*r));
+    r->sessions = sessions;
+    r->deltas = deltas;
+    if (pipe(go) < 0 || pipe(result) < 0) return -1;
+    
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        close(go[1]);
+        close(result[0]);
+        run_coordinator(port, go[0], result[1]);
+    }
+    close(go[0]);
+    close(result[1]);
+    if (read(result[0], &c, 1) != 1) return -1;
+    
+    /* Seed the registry every snapshot carries */
+    struct sockaddr_in udp, tcp;
+    memset(&udp, 0, sizeof(udp));
+    udp.sin_family = AF_INET;
+    udp.sin_port = htons(port);
+    udp.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcp = udp;
+    tcp.sin_port = htons(port + 1);
+    int usock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (usock < 0) return -1;
+    for (int i = 0; i < SEED_IDS; i++) {
+        send_helo(usock, &udp, i, 1);
+    }
+    usleep(500 * 1000);
+    long rss0 = rss_kb(pid);
+    
+    /* Storm: every session connects at once */
+    clients = (client_t*)calloc(sessions, sizeof(client_t));
+    sent_at = (double*)calloc(deltas, sizeof(double));
+    latency = (float*)malloc((size_t)sessions * deltas * sizeof(float));
+    ep = epoll_create1(0);
+    if (!clients || !sent_at || !latency || ep < 0) return -1;
+    n_clients = sessions;
+    n_deltas = deltas;
+    
+    double t0 = now_sec();
+    for (int i = 0; i < sessions; i++) {
+        client_t *cl = &clients[i];
+        cl->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (cl->fd < 0) return -1;
+        if (connect(cl->fd, (struct sockaddr*)&tcp, sizeof(tcp)) < 0 && errno != EINPROGRESS) {
+            continue;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = cl;
+        epoll_ctl(ep, EPOLL_CTL_ADD, cl->fd, &ev);
+        pump(0);
+    }
+    while (count_snapshots() < sessions && now_sec() - t0 < STORM_LIMIT_SEC) {
+        pump(100);
+    }
+    
+    double last_first = t0, last_snap = t0;
+    double *snap_ms = (double*)malloc(sessions * sizeof(double));
+    int served = 0;
+    if (!snap_ms) return -1;
+    for (int i = 0; i < sessions; i++) {
+        client_t *cl = &clients[i];
+        if (!cl->snapshot) continue;
+        if (cl->t_first > last_first) last_first = cl->t_first;
+        if (cl->t_snapshot > last_snap) last_snap = cl->t_snapshot;
+        snap_ms[served++] = (cl->t_snapshot - t0) * 1000.0;
+    }
+    r->failed = sessions - served;
+    r->storm_sec = last_snap - t0;
+    r->accept_per_sec = (last_first > t0) ? served / (last_first - t0) : 0.0;
+    if (served > 0) {
+        qsort(snap_ms, served, sizeof(double), cmp_double);
+        r->snap_p50_ms = snap_ms[served / 2];
+        r->snap_p99_ms = snap_ms[(long)served * 99 / 100];
+        r->snap_max_ms = snap_ms[served - 1];
+    }
+    free(snap_ms);
+    
+    long rss1 = rss_kb(pid);
+    if (served > 0 && rss0 >= 0 && rss1 >= 0) {
+        r->rss_per_session = (rss1 - rss0) * 1024.0 / served;
+    }
+    
+    /* Fan-out: one change at a time, each timed on every session */
+    for (int d = 0; d < deltas; d++) {
+        sent_at[d] = now_sec();
+        send_helo(usock, &udp, d % SEED_IDS, d + 2);
+        while (!deltas_reached(d + 1) && now_sec() - sent_at[d] < DRAIN_LIMIT_SEC) {
+            pump(1);
+        }
+    }
+    
+    r->samples = n_latency;
+    r->expected = (long)served * deltas;
+    if (n_latency > 0) {
+        qsort(latency, n_latency, sizeof(float), cmp_float);
+        r->lat_p50_ms = latency[n_latency / 2];
+        r->lat_p90_ms = latency[n_latency * 90 / 100];
+        r->lat_p99_ms = latency[n_latency * 99 / 100];
+        r->lat_p999_ms = latency[n_latency * 999 / 1000];
+        r->lat_max_ms = latency[n_latency - 1];
+    }
+    
+    close(go[1]);
+    int ok = read(result[0], &r->stats, sizeof(r->stats)) == (ssize_t)sizeof(r->stats);
+    close(result[0]);
+    waitpid(pid, NULL, 0);
+    
+    for (int i = 0; i < sessions; i++) close(clients[i].fd);
+    close(ep);
+    close(usock);
+    free(clients);
+    free(sent_at);
+    free(latency);
+    return ok ? 0 : -1;
+}
+
+static void print_table(const report_t *r) {
+    printf("Coordinator benchmark: %d sessions, %d changes, %d registry entries\n\n",
+           r->sessions, r->deltas, SEED_IDS);
+    printf("storm        %8.3f s until every snapshot was complete (%d never served)\n",
+           r->storm_sec, r->failed);
+    printf("accept       %8.0f sessions/s\n", r->accept_per_sec);
+    printf("snapshot     %8.2f ms p50  %8.2f ms p99  %8.2f ms max  (connect to last part)\n",
+           r->snap_p50_ms, r->snap_p99_ms, r->snap_max_ms);
+    printf("fan-out      %8.2f ms p50  %8.2f ms p90  %8.2f ms p99  %8.2f ms p99.9  %8.2f ms max\n",
+           r->lat_p50_ms, r->lat_p90_ms, r->lat_p99_ms, r->lat_p999_ms, r->lat_max_ms);
+    printf("delivered    %8ld of %ld changes\n", r->samples, r->expected);
+    printf("memory       %8.0f bytes RSS per session\n", r->rss_per_session);
+    printf("coordinator  %llu accepted, %llu refused, %llu dropped, %llu resyncs, %llu bytes out\n",
+           (unsigned long long)r->stats.accepted, (unsigned long long)r->stats.refused,
+           (unsigned long long)r->stats.dropped, (unsigned long long)r->stats.resyncs,
+           (unsigned long long)r->stats.bytes_out);
+}
+
+static void print_json(const report_t *r) {
+    printf("{\"sessions\":%d,\"changes\":%d,\"entries\":%d,\"failed\":%d,"
+           "\"storm_s\":%.4f,\"accept_per_s\":%.0f,"
+           "\"snapshot_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+           "\"fanout_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f},"
+           "\"delivered\":%ld,\"expected\":%ld,\"rss_per_session\":%.0f,"
+           "\"accepted\":%llu,\"refused\":%llu,\"dropped\":%llu,\"resyncs\":%llu,"
+           "\"bytes_out\":%llu}\n",
+           r->sessions, r->deltas, SEED_IDS, r->failed, r->storm_sec, r->accept_per_sec,
+           r->snap_p50_ms, r->snap_p99_ms, r->snap_max_ms,
+           r->lat_p50_ms, r->lat_p90_ms, r->lat_p99_ms, r->lat_p999_ms, r->lat_max_ms,
+           r->samples, r->expected, r->rss_per_session,
+           (unsigned long long)r->stats.accepted, (unsigned long long)r->stats.refused,
+           (unsigned long long)r->stats.dropped, (unsigned long long)r->stats.resyncs,
+           (unsigned long long)r->stats.bytes_out);
+}
+
+int main(int argc, char *argv[]) {
+    int args[3] = { 2000, 200, 6600 };
+    bool json = false;
+    report_t r;
+    
+    for (int i = 1, n = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (n < 3) args[n++] = atoi(argv[i]);
+    }
+    if (args[0] < 1 || args[0] > PN_COORD_MAX_SESSIONS || args[1] < 1) {
+        fprintf(stderr, "Use 1 to %d sessions and at least 1 change\n", PN_COORD_MAX_SESSIONS);
+        return 1;
+    }
+    if (raise_fd_limit(args[0] + 64) < 0) {
+        fprintf(stderr, "Need %d open files: raise the limit (ulimit -n)\n", args[0] + 64);
+        return 1;
+    }
+    
+    if (run(args[0], args[1], args[2], &r) < 0) {
+        fprintf(stderr, "Benchmark failed to run on port %d\n", args[2]);
+        return 1;
+    }
+    if (json) print_json(&r);
+    else print_table(&r);
+    return 0;
+}
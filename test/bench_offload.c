@@ -0,0 +1,188 @@
+/*
+ * Phoenix Nest Service Discovery - UDP Offload Benchmark
+ * 
+ * Measures packets per second per CPU core for burst sends and receives,
+ * with plain datagram I/O and with UDP GSO/GRO:
+ *   bench_offload [seconds] [port]
+ * 
+ * A forked receiver runs the engine's listener on <port>; the parent runs
+ * a second engine on <port>+1 in unicast mode with the receiver as its only
+ * peer and sends rounds of equal-size helo datagrams with pn_send_burst().
+ * Send rate is datagrams per CPU second of the sending thread; receive rate
+ * is datagrams classified per CPU second of the receiver process. Over
+ * loopback the kernel delivers in the sender's context, so the send figure
+ * includes the receive-side stack. Linux only.
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "pn_discovery.h"
+
+#define BURST_IDS       32      /* Datagrams per pn_send_burst() round */
+#define MSG_BYTES       1200    /* Every datagram padded to this size */
+
+typedef struct {
+    double wall_sec;
+    double cpu_sec;
+    unsigned long long packets;
+    unsigned long long offloaded;   /* Segmented (send) or coalesced (receive) */
+} result_t;
+
+static double now_sec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu_sec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Equal-size helo datagrams for a fleet of BURST_IDS ids */
+static void build_burst(char msgs[][MSG_BYTES + 1], const char **ptrs, int *lens) {
+    for (int i = 0; i < BURST_IDS; i++) {
+        int len = snprintf(msgs[i], MSG_BYTES + 1,
+                           "{\"m\":\"PNSD\",\"v\":1,\"cmd\":\"helo\",\"id\":\"BENCH-%02d\","
+                           "\"svc\":\"waterfall\",\"ctrl\":%d,\"data\":0,\"inc\":1,\"caps\":\"",
+                           i, 7000 + i);
+        while (len < MSG_BYTES - 2) msgs[i][len++] = 'x';
+        msgs[i][len++] = '"';
+        msgs[i][len++] = '}';
+        msgs[i][len] = '\0';
+        ptrs[i] = msgs[i];
+        lens[i] = len;
+    }
+}
+
+/* Receiver: listen until the parent closes the go pipe, then report */
+static void run_receiver(int port, bool offload, int go_fd, int result_fd) {
+    result_t r;
+    pn_ingest_stats_t st;
+    char c;
+    
+    memset(&r, 0, sizeof(r));
+    if (pn_discovery_init(port) < 0) _exit(1);
+    pn_control_exec("log 0", NULL, 0);
+    pn_set_udp_offload(offload);
+    if (pn_listen(NULL, NULL) < 0) _exit(1);
+    
+    double cpu0 = process_cpu_sec(), wall0 = now_sec(CLOCK_MONOTONIC);
+    if (write(result_fd, "R", 1) != 1) _exit(1);
+    while (read(go_fd, &c, 1) > 0) { }
+    
+    r.cpu_sec = process_cpu_sec() - cpu0;
+    r.wall_sec = now_sec(CLOCK_MONOTONIC) - wall0;
+    pn_get_ingest_stats(&st);
+    for (int i = 0; i < PN_INGEST_CLASSES; i++) r.packets += st.received[i];
+    r.offloaded = st.coalesced;
+    pn_discovery_shutdown();
+    
+    if (write(result_fd, &r, sizeof(r)) != (ssize_t)sizeof(r)) _exit(1);
+    _exit(0);
+}
+
+/* One measurement: returns 0 and fills send/recv on success */
+static int run_mode(int port, bool offload, int seconds, result_t *send, result_t *recv) {
+    static char msgs[BURST_IDS][MSG_BYTES + 1];
+    const char *ptrs[BURST_IDS];
+    int lens[BURST_IDS];
+    int go[2], result[2];
+    char peer[32], c;
+    
+    build_burst(msgs, ptrs, lens);
+    if (pipe(go) < 0 || pipe(result) < 0) return -1;
+    
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        close(go[1]);
+        close(result[0]);
+        run_receiver(port, offload, go[0], result[1]);
+    }
+    close(go[0]);
+    close(result[1]);
+    if (read(result[0], &c, 1) != 1) return -1;
+    
+    snprintf(peer, sizeof(peer), "127.0.0.1:%d", port);
+    if (pn_discovery_init(port + 1) < 0) return -1;
+    pn_control_exec("log 0", NULL, 0);
+    pn_set_udp_offload(offload);
+    if (pn_add_peer(peer) < 0 || pn_set_unicast_mode(true) < 0) return -1;
+    
+    memset(send, 0, sizeof(*send));
+    double wall0 = now_sec(CLOCK_MONOTONIC);
+    double cpu0 = now_sec(CLOCK_THREAD_CPUTIME_ID);
+    while (now_sec(CLOCK_MONOTONIC) - wall0 < seconds) {
+        for (int i = 0; i < 64; i++) {
+            pn_send_burst(ptrs, lens, BURST_IDS);
+            send->packets += BURST_IDS;
+        }
+    }
+    send->cpu_sec = now_sec(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    send->wall_sec = now_sec(CLOCK_MONOTONIC) - wall0;
+    
+    pn_tx_stats_t tx;
+    pn_get_tx_stats(&tx);
+    send->offloaded = tx.segmented;
+    pn_discovery_shutdown();
+    
+    /* Let the receiver drain its socket buffer before it stops counting */
+    usleep(200 * 1000);
+    close(go[1]);
+    int ok = read(result[0], recv, sizeof(*recv)) == (ssize_t)sizeof(*recv);
+    close(result[0]);
+    waitpid(pid, NULL, 0);
+    return ok ? 0 : -1;
+}
+
+static void print_row(const char *name, const result_t *send, const result_t *recv) {
+    printf("%-8s %12.0f %14.0f %14.0f %12llu %12llu\n", name,
+           send->packets / send->wall_sec,
+           send->cpu_sec > 0 ? send->packets / send->cpu_sec : 0.0,
+           recv->cpu_sec > 0 ? recv->packets / recv->cpu_sec : 0.0,
+           send->offloaded, recv->offloaded);
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 5;
+    int port = (argc > 2) ? atoi(argv[2]) : 6500;
+    result_t plain_send, plain_recv, gso_send, gso_recv;
+    
+    if (seconds < 1) {
+        fprintf(stderr, "Run for at least 1 second\n");
+        return 1;
+    }
+    
+    printf("Offload benchmark: %d s per mode, bursts of %d x %d-byte datagrams, port %d\n\n",
+           seconds, BURST_IDS, MSG_BYTES, port);
+    
+    if (run_mode(port, false, seconds, &plain_send, &plain_recv) < 0 ||
+        run_mode(port, true, seconds, &gso_send, &gso_recv) < 0) {
+        fprintf(stderr, "Benchmark failed to run on port %d\n", port);
+        return 1;
+    }
+    
+    printf("%-8s %12s %14s %14s %12s %12s\n", "mode", "sent/s", "send pps/core",
+           "recv pps/core", "segmented", "coalesced");
+    print_row("plain", &plain_send, &plain_recv);
+    print_row("offload", &gso_send, &gso_recv);
+    
+    if (gso_send.offloaded == 0) {
+        printf("\nGSO was not used (kernel or device refused UDP_SEGMENT)\n");
+    } else {
+        printf("\nPer-core speedup: send %.2fx, receive %.2fx\n",
+               (gso_send.packets / gso_send.cpu_sec) / (plain_send.packets / plain_send.cpu_sec),
+               (gso_recv.packets / gso_recv.cpu_sec) / (plain_recv.packets / plain_recv.cpu_sec));
+    }
+    return 0;
+}
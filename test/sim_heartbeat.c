@@ -0,0 +1,154 @@
+/*
+ * Phoenix Nest Service Discovery - Heartbeat Schedule Simulator
+ * 
+ * Simulates a site-wide power-up of NODES announcers and compares the
+ * aggregate helo rate of the phase-spread scheduler with the old one (a
+ * fresh random 30-60 s interval after every send):
+ *   sim_heartbeat [seconds]
+ * 
+ * Nodes boot within a 2 s window with up to +/-500 ms of clock skew, hear
+ * each other instantly and re-announce 2-10 s after seeing a new node, as
+ * the library does. Packets are counted per second once the start-up
+ * burst is over; the figure of merit is the peak-to-mean rate. Exits
+ * non-zero if the phase-spread schedule is not flatter than the random one
+ * or its peak exceeds MAX_PEAK_TO_MEAN, so it doubles as a ctest.
+ * 
+ * Built against the library source to reach the scheduler internals.
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include "../src/pn_discovery.c"
+
+#define NODES               30
+#define BOOT_SPREAD_MS      2000
+#define SKEW_MS             500
+#define WARMUP_SEC          300
+#define MAX_PEAK_TO_MEAN    2.0
+
+typedef struct {
+    uint32_t key;                     /* Schedule key (id hash) */
+    int64_t skew;                     /* Wall clock minus true time */
+    uint64_t next;                    /* True time of the next periodic send */
+    uint64_t reactive;                /* True time of a pending reactive send (0 = none) */
+    bool heard[NODES];
+} sim_node_t;
+
+static uint64_t sim_rng = 0x5EEDULL;
+
+/* Reproducible stream for the simulation itself (splitmix64) */
+static uint64_t sim_rand(void) {
+    uint64_t z = (sim_rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Next periodic send of node i after one at true time t */
+static uint64_t sim_next(sim_node_t *nodes, int i, uint64_t t, bool spread) {
+    if (!spread) {
+        return t + (uint64_t)(PN_ANNOUNCE_MIN_SEC +
+                              sim_rand() % (PN_ANNOUNCE_MAX_SEC - PN_ANNOUNCE_MIN_SEC + 1)) * 1000;
+    }
+    
+    uint64_t period = (uint64_t)(PN_ANNOUNCE_MIN_SEC + PN_ANNOUNCE_MAX_SEC) * 500;
+    uint32_t keys[NODES];
+    int n = 0;
+    for (int j = 0; j < NODES; j++) {
+        if (j != i && nodes[i].heard[j]) keys[n++] = nodes[j].key;
+    }
+    uint64_t phase = sched_phase_for(nodes[i].key, keys, n, period, false);
+    
+    /* The node sends at t and schedules at once: its clocks read t and t + skew */
+    return sched_next_at(t, period, phase, t, t + (uint64_t)nodes[i].skew);
+}
+
+/* Node i sends at time t: everyone hears it */
+static void sim_send(sim_node_t *nodes, int i, uint64_t t, int *bins, int nbins) {
+    int bin = (int)(t / 1000) - WARMUP_SEC;
+    if (bin >= 0 && bin < nbins) bins[bin]++;
+    
+    for (int j = 0; j < NODES; j++) {
+        if (j == i || nodes[j].heard[i]) continue;
+        nodes[j].heard[i] = true;
+        if (!nodes[j].reactive) nodes[j].reactive = t + (2 + sim_rand() % 9) * 1000;
+    }
+}
+
+/* Run one schedule; returns the peak-to-mean packet rate */
+static double sim_run(bool spread, int seconds, int *peak, double *mean) {
+    sim_node_t nodes[NODES];
+    static int bins[86400];
+    int nbins = seconds - WARMUP_SEC;
+    
+    memset(nodes, 0, sizeof(nodes));
+    memset(bins, 0, sizeof(bins));
+    sim_rng = 0x5EEDULL;
+    
+    /* True time starts at 0 at power-up; node clocks read a Unix time */
+    for (int i = 0; i < NODES; i++) {
+        char id[32];
+        snprintf(id, sizeof(id), "SITE-NODE-%02d", i);
+        nodes[i].key = pn_history_id_handle(id);
+        nodes[i].skew = 1700000000000LL + (int64_t)(sim_rand() % (2 * SKEW_MS + 1)) - SKEW_MS;
+        nodes[i].next = sim_rand() % BOOT_SPREAD_MS;     /* Initial announcement */
+    }
+    
+    for (;;) {
+        int who = -1;
+        bool reactive = false;
+        uint64_t t = UINT64_MAX;
+        for (int i = 0; i < NODES; i++) {
+            if (nodes[i].next < t) {
+                t = nodes[i].next;
+                who = i;
+                reactive = false;
+            }
+            if (nodes[i].reactive && nodes[i].reactive < t) {
+                t = nodes[i].reactive;
+                who = i;
+                reactive = true;
+            }
+        }
+        if (t >= (uint64_t)seconds * 1000) break;
+        
+        if (reactive) nodes[who].reactive = 0;
+        sim_send(nodes, who, t, bins, nbins);
+        nodes[who].next = sim_next(nodes, who, t, spread);
+    }
+    
+    long total = 0;
+    *peak = 0;
+    for (int b = 0; b < nbins; b++) {
+        total += bins[b];
+        if (bins[b] > *peak) *peak = bins[b];
+    }
+    *mean = (double)total / nbins;
+    return *mean > 0 ? *peak / *mean : 0.0;
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 3600;
+    if (seconds <= WARMUP_SEC + 60 || seconds > 86400) {
+        fprintf(stderr, "Simulate between %d and 86400 seconds\n", WARMUP_SEC + 60);
+        return 1;
+    }
+    
+    int peak_rand, peak_spread;
+    double mean_rand, mean_spread;
+    double ratio_rand = sim_run(false, seconds, &peak_rand, &mean_rand);
+    double ratio_spread = sim_run(true, seconds, &peak_spread, &mean_spread);
+    
+    printf("Heartbeat simulation: %d nodes, %d s after a %d s warm-up, 1 s bins\n\n",
+           NODES, seconds - WARMUP_SEC, WARMUP_SEC);
+    printf("%-14s %10s %10s %14s\n", "schedule", "mean pps", "peak pps", "peak-to-mean");
+    printf("%-14s %10.2f %10d %14.2f\n", "random", mean_rand, peak_rand, ratio_rand);
+    printf("%-14s %10.2f %10d %14.2f\n", "phase-spread", mean_spread, peak_spread, ratio_spread);
+    
+    if (ratio_spread >= ratio_rand || ratio_spread > MAX_PEAK_TO_MEAN) {
+        printf("\nFAIL: phase-spread schedule is not flat enough\n");
+        return 1;
+    }
+    printf("\nPASS\n");
+    return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * Phoenix Nest Service Discovery - Soak Harness
+ * 
+ * Runs the engine against a loopback load generator for a long time and
+ * fails if resource use trends upward:
+ *   soak_discovery [seconds] [port]
+ * 
+ * Time is accelerated: announce intervals are cut to 1-2 s through the
+ * control interface and the generator plays one heartbeat round of its
+ * synthetic fleet every 100 ms, with joins, departures and descriptor
+ * changes mixed in. Announcing is stopped and restarted every few seconds
+ * and the whole engine is shut down and re-initialized every minute,
+ * alternating between a thread per role and the shared engine thread.
+ * 
+ * Every sample records RSS, open fds, threads and CPU per generated
+ * datagram. After a warm-up, least-squares slopes of RSS, fds and threads
+ * and the CPU-per-datagram ratio between the two halves of the run must
+ * stay within bounds, and fds and threads must return to their starting
+ * counts after the final shutdown. Linux only (reads /proc/self).
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "pn_discovery.h"
+
+#define GEN_IDS             24      /* Synthetic fleet size (below PN_MAX_SERVICES) */
+#define GEN_TICK_MS         100     /* One heartbeat round per tick */
+#define GEN_BURST           4       /* Repeat keepalives per id per round */
+#define ANNOUNCE_CYCLE_SEC  5       /* pn_announce / pn_announce_stop period */
+#define INIT_CYCLE_SEC      60      /* shutdown / init period */
+#define SAMPLE_SEC          5
+#define WARMUP_SEC          20
+#define MAX_SAMPLES         8192
+
+/* Allowed growth over the whole run, taken from the fitted slope */
+#define MAX_RSS_GROWTH_KB   2048
+#define MAX_FD_GROWTH       1.0
+#define MAX_THREAD_GROWTH   1.0
+#define MAX_CPU_RATIO       1.5     /* Second-half vs first-half CPU per datagram */
+
+typedef struct {
+    double t;                       /* Seconds since start */
+    double rss_kb;
+    double fds;
+    double threads;
+    double cpu_per_msg_us;
+} sample_t;
+
+static sample_t samples[MAX_SAMPLES];
+static int n_samples;
+static volatile long events;
+
+static void on_event(const char *id, const char *service, const char *ip,
+                     int ctrl_port, int data_port, const char *caps,
+                     bool is_bye, void *userdata) {
+    (void)id; (void)service; (void)ip; (void)ctrl_port;
+    (void)data_port; (void)caps; (void)is_bye; (void)userdata;
+    events++;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long read_rss_kb(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = -1;
+    fclose(f);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int count_fds(void) {
+    int n = 0;
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return -1;
+    while (readdir(d)) n++;
+    closedir(d);
+    return n - 3;   /* ".", ".." and the directory's own fd */
+}
+
+static int count_threads(void) {
+    char line[128];
+    int n = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Threads: %d", &n) == 1) break;
+    }
+    fclose(f);
+    return n;
+}
+
+static double cpu_us(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Least-squares slope of a sample field (units per second) */
+static double slope(int first, size_t offset) {
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = first; i < n_samples; i++) {
+        double x = samples[i].t;
+        double y = *(const double*)((const char*)&samples[i] + offset);
+        n++; sx += x; sy += y; sxx += x * x; sxy += x * y;
+    }
+    double den = n * sxx - sx * sx;
+    return (n < 2 || den == 0) ? 0 : (n * sxy - sx * sy) / den;
+}
+
+/* Load generator: a fleet of synthetic services on its own socket */
+typedef struct {
+    int sock;
+    struct sockaddr_in target;
+    bool live[GEN_IDS];
+    int inc[GEN_IDS];
+    int port[GEN_IDS];
+    long sent;
+} generator_t;
+
+static int gen_open(generator_t *g, int engine_port) {
+    memset(g, 0, sizeof(*g));
+    g->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (g->sock < 0) return -1;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(engine_port + 1);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(g->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(g->sock);
+        return -1;
+    }
+    
+    g->target = addr;
+    g->target.sin_port = htons(engine_port);
+    for (int i = 0; i < GEN_IDS; i++) {
+        g->live[i] = true;
+        g->inc[i] = 1;
+        g->port[i] = 7000 + i;
+    }
+    return 0;
+}
+
+static void gen_send(generator_t *g, const char *msg) {
+    sendto(g->sock, msg, strlen(msg), 0, (struct sockaddr*)&g->target, sizeof(g->target));
+    g->sent++;
+}
+
+/* One heartbeat round: churn one id, then keepalives for the live fleet */
+static void gen_round(generator_t *g) {
+    char msg[512];
+    int ts = (int)time(NULL);
+    int k = rand() % GEN_IDS;
+    int r = rand() % 10;
+    
+    if (r == 0 && g->live[k]) {
+        g->live[k] = false;
+        snprintf(msg, sizeof(msg),
+                 "{\"m\":\"PNSD\",\"v\":1,\"cmd\":\"bye\",\"id\":\"SOAK-%02d\",\"ts\":%d}", k, ts);
+        gen_send(g, msg);
+    } else if (r == 1 && !g->live[k]) {
+        g->live[k] = true;
+        g->inc[k]++;
+    } else if (r == 2) {
+        g->port[k] = 7000 + rand() % 1000;
+    }
+    
+    for (int i = 0; i < GEN_IDS; i++) {
+        if (!g->live[i]) continue;
+        snprintf(msg, sizeof(msg),
+                 "{\"m\":\"PNSD\",\"v\":1,\"cmd\":\"helo\",\"id\":\"SOAK-%02d\","
+                 "\"svc\":\"%s\",\"ip\":\"127.0.0.1\",\"port\":%d,\"inc\":%d,\"ts\":%d}",
+                 i, (i % 2) ? PN_SVC_WATERFALL : PN_SVC_DETECTOR, g->port[i], g->inc[i], ts);
+        for (int b = 0; b < GEN_BURST; b++) gen_send(g, msg);
+    }
+    
+    /* Discard what the engine sends us */
+    char sink[2048];
+    while (recv(g->sock, sink, sizeof(sink), MSG_DONTWAIT) > 0) {}
+}
+
+static int engine_start(int port, bool shared) {
+    char seed[32];
+    snprintf(seed, sizeof(seed), "127.0.0.1:%d", port + 1);
+    
+    if (pn_discovery_init(port) < 0) return -1;
+    if (pn_set_shared_engine(shared) < 0) return -1;
+    pn_control_exec("log 0", NULL, 0);
+    pn_control_exec("interval 1 2", NULL, 0);
+    if (pn_add_peer(seed) < 0 || pn_set_unicast_mode(true) < 0) return -1;
+    if (pn_listen(on_event, NULL) < 0) return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int duration = (argc > 1) ? atoi(argv[1]) : 120;
+    int port = (argc > 2) ? atoi(argv[2]) : 6400;
+    generator_t gen;
+    
+    if (duration < 2 * WARMUP_SEC) {
+        fprintf(stderr, "Run for at least %d seconds\n", 2 * WARMUP_SEC);
+        return 1;
+    }
+    srand((unsigned int)time(NULL));
+    
+    int base_fds = count_fds();
+    int base_threads = count_threads();
+    
+    if (gen_open(&gen, port) < 0) {
+        fprintf(stderr, "Failed to open load generator on port %d\n", port + 1);
+        return 1;
+    }
+    base_fds++;     /* The generator socket stays open until the end */
+    
+    if (engine_start(port, false) < 0) {
+        fprintf(stderr, "Failed to start engine on port %d\n", port);
+        return 1;
+    }
+    
+    printf("Soak: %d s on port %d, %d ids, round every %d ms\n\n",
+           duration, port, GEN_IDS, GEN_TICK_MS);
+    printf("%8s %10s %6s %8s %12s %10s\n", "t(s)", "rss(KB)", "fds", "threads",
+           "cpu/msg(us)", "events");
+    
+    double start = now_sec();
+    double next_sample = start + SAMPLE_SEC;
+    double last_cpu = cpu_us();
+    long last_sent = 0;
+    int last_announce = 0, last_init = 0;
+    bool announcing = false, shared = false;
+    int failures = 0;
+    
+    while (now_sec() - start < duration) {
+        gen_round(&gen);
+        usleep(GEN_TICK_MS * 1000);
+    
+        int elapsed = (int)(now_sec() - start);
+    
+        /* Announce on/off cycle */
+        if (elapsed - last_announce >= ANNOUNCE_CYCLE_SEC) {
+            last_announce = elapsed;
+            if (announcing) {
+                pn_announce_stop();
+            } else if (pn_announce("SOAK-SELF", PN_SVC_CONTROLLER, 9000, 0, "soak") < 0) {
+                fprintf(stderr, "FAIL: pn_announce failed at %d s\n", elapsed);
+                failures++;
+            }
+            announcing = !announcing;
+        }
+    
+        /* Full engine restart */
+        if (elapsed - last_init >= INIT_CYCLE_SEC) {
+            last_init = elapsed;
+            pn_discovery_shutdown();
+            announcing = false;
+            shared = !shared;
+            if (engine_start(port, shared) < 0) {
+                fprintf(stderr, "FAIL: re-init failed at %d s\n", elapsed);
+                return 1;
+            }
+        }
+    
+        if (now_sec() >= next_sample && n_samples < MAX_SAMPLES) {
+            double cpu = cpu_us();
+            long sent = gen.sent - last_sent;
+            sample_t *s = &samples[n_samples++];
+            s->t = now_sec() - start;
+            s->rss_kb = read_rss_kb();
+            s->fds = count_fds();
+            s->threads = count_threads();
+            s->cpu_per_msg_us = sent > 0 ? (cpu - last_cpu) / sent : 0;
+            last_cpu = cpu;
+            last_sent = gen.sent;
+            next_sample += SAMPLE_SEC;
+    
+            printf("%8.0f %10.0f %6.0f %8.0f %12.2f %10ld\n", s->t, s->rss_kb, s->fds,
+                   s->threads, s->cpu_per_msg_us, events);
+            fflush(stdout);
+        }
+    }
+    
+    pn_discovery_shutdown();
+    close(gen.sock);
+    base_fds--;
+    
+    /* Trends after warm-up */
+    int first = 0;
+    while (first < n_samples && samples[first].t < WARMUP_SEC) first++;
+    double span = samples[n_samples - 1].t - samples[first].t;
+    double rss_growth = slope(first, offsetof(sample_t, rss_kb)) * span;
+    double fd_growth = slope(first, offsetof(sample_t, fds)) * span;
+    double thread_growth = slope(first, offsetof(sample_t, threads)) * span;
+    
+    double cpu_a = 0, cpu_b = 0;
+    int mid = first + (n_samples - first) / 2, na = 0, nb = 0;
+    for (int i = first; i < n_samples; i++) {
+        if (i < mid) { cpu_a += samples[i].cpu_per_msg_us; na++; }
+        else         { cpu_b += samples[i].cpu_per_msg_us; nb++; }
+    }
+    cpu_a = na ? cpu_a / na : 0;
+    cpu_b = nb ? cpu_b / nb : 0;
+    
+    printf("\nFitted growth over %.0f s: rss %+.0f KB, fds %+.2f, threads %+.2f\n",
+           span, rss_growth, fd_growth, thread_growth);
+    printf("CPU per datagram: %.2f us -> %.2f us\n", cpu_a, cpu_b);
+    
+    if (rss_growth > MAX_RSS_GROWTH_KB) {
+        printf("FAIL: RSS trending up\n");
+        failures++;
+    }
+    if (fd_growth > MAX_FD_GROWTH) {
+        printf("FAIL: fd count trending up\n");
+        failures++;
+    }
+    if (thread_growth > MAX_THREAD_GROWTH) {
+        printf("FAIL: thread count trending up\n");
+        failures++;
+    }
+    if (cpu_a > 0 && cpu_b > cpu_a * MAX_CPU_RATIO) {
+        printf("FAIL: CPU per datagram drifting up\n");
+        failures++;
+    }
+    
+    int end_fds = count_fds(), end_threads = count_threads();
+    if (end_fds != base_fds || end_threads != base_threads) {
+        printf("FAIL: after shutdown %d fds / %d threads, started with %d / %d\n",
+               end_fds, end_threads, base_fds, base_threads);
+        failures++;
+    }
+    
+    printf("%s\n", failures ? "SOAK FAILED" : "SOAK PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Phoenix Nest Service Discovery - Coordinator Test
+ * 
+ * Checks the TCP coordinator end to end in one process:
+ *   test_coordinator [port]
+ * 
+ * The engine listens on <port> (default 47310) and the coordinator on
+ * <port>+1. Helos sent to the listener must reach a subscriber: first in
+ * its snapshot, then as "phelo" and "pbye" changes. The coordinator must
+ * not be reachable on a non-loopback address unless asked to, and must
+ * close its sessions when it stops. Exits non-zero on the first failure,
+ * so it doubles as a ctest. Linux only.
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "pn_discovery.h"
+
+#define WAIT_MS         3000    /* Longest wait for any one step */
+#define LINE_BYTES      8192
+
+static int udp_sock;
+static struct sockaddr_in udp_dest;
+static char rx[LINE_BYTES];
+static int rx_len, rx_used;               /* Buffered bytes; those of the line last returned */
+
+static int fail(const char *what) {
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Send one datagram to the engine's listener */
+static void send_msg(const char *cmd, const char *id, int inc) {
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg),
+                       "{\"m\":\"PNSD\",\"v\":1,\"cmd\":\"%s\",\"id\":\"%s\","
+                       "\"svc\":\"waterfall\",\"port\":7000,\"data\":0,\"inc\":%d,\"caps\":\"\"}",
+                       cmd, id, inc);
+    sendto(udp_sock, msg, len, 0, (const struct sockaddr*)&udp_dest, sizeof(udp_dest));
+}
+
+/* Wait until the registry holds n entries */
+static int wait_count(int n) {
+    double end = now_ms() + WAIT_MS;
+    while (pn_get_service_count() != n) {
+        if (now_ms() > end) return -1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+/* Connect to the coordinator at ip:port; -1 if refused */
+static int dial(const char *ip, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct timeval tv = { 0, 200000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Next line from the coordinator: 1 with it in rx, 0 at end of stream, -1 on timeout */
+static int next_line(int fd) {
+    double end = now_ms() + WAIT_MS;
+    rx_len -= rx_used;
+    memmove(rx, rx + rx_used, rx_len + 1);
+    rx_used = 0;
+    for (;;) {
+        char *nl = memchr(rx, '\n', rx_len);
+        if (nl) {
+            *nl = '\0';
+            rx_used = (int)(nl + 1 - rx);
+            return 1;
+        }
+        if (now_ms() > end || rx_len >= (int)sizeof(rx) - 1) return -1;
+        
+        ssize_t n = recv(fd, rx + rx_len, sizeof(rx) - 1 - rx_len, 0);
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            return 0;
+        }
+        rx_len += (int)n;
+        rx[rx_len] = '\0';
+    }
+}
+
+/* Skip to the next line carrying both needles (b may be NULL); 1 when found */
+static int expect_line(int fd, const char *a, const char *b) {
+    int r;
+    while ((r = next_line(fd)) == 1) {
+        if (strstr(rx, a) && (!b || strstr(rx, b))) return 1;
+    }
+    return r;
+}
+
+/* Read a whole snapshot; 0 if it held every id in ids */
+static int read_snapshot(int fd, const char *const *ids, int n) {
+    bool seen[8] = { false };
+    for (;;) {
+        if (expect_line(fd, "\"cmd\":\"snap\"", NULL) != 1) return -1;
+        for (int i = 0; i < n; i++) {
+            if (strstr(rx, ids[i])) seen[i] = true;
+        }
+        if (strstr(rx, "\"parts\":")) break;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!seen[i]) return -1;
+    }
+    return 0;
+}
+
+/* First IPv4 address of an interface other than loopback, if any */
+static bool outside_addr(char *ip, size_t len) {
+    struct ifaddrs *ifaddr, *ifa;
+    bool found = false;
+    if (getifaddrs(&ifaddr) == -1) return false;
+    for (ifa = ifaddr; ifa && !found; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET) continue;
+        struct in_addr a = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        if ((ntohl(a.s_addr) >> 24) == 127) continue;
+        inet_ntop(AF_INET, &a, ip, len);
+        found = true;
+    }
+    freeifaddrs(ifaddr);
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    int port = (argc > 1) ? atoi(argv[1]) : 47310;
+    char ip[INET_ADDRSTRLEN];
+    
+    if (pn_discovery_init(port) < 0) return fail("init");
+    pn_control_exec("log 0", NULL, 0);
+    if (pn_set_coordinator_addr("not-an-address") == 0) return fail("bad address accepted");
+    if (pn_listen(NULL, NULL) < 0) return fail("listen");
+    
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&udp_dest, 0, sizeof(udp_dest));
+    udp_dest.sin_family = AF_INET;
+    udp_dest.sin_port = htons(port);
+    udp_dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    send_msg("helo", "COORD-TEST-1", 1);
+    send_msg("helo", "COORD-TEST-2", 1);
+    if (wait_count(2) < 0) return fail("seed entries not registered");
+    
+    /* Snapshot: every entry, the last part says how many parts there were */
+    if (pn_coordinator_open(port + 1) < 0) return fail("coordinator open");
+    int fd = dial("127.0.0.1", port + 1);
+    if (fd < 0) return fail("connect over loopback");
+    const char *seed[] = { "COORD-TEST-1", "COORD-TEST-2" };
+    if (read_snapshot(fd, seed, 2) < 0) return fail("snapshot");
+    printf("snapshot        ok\n");
+    
+    /* Changes after the snapshot */
+    send_msg("helo", "COORD-TEST-1", 2);
+    if (expect_line(fd, "\"cmd\":\"phelo\"", "COORD-TEST-1") != 1) return fail("change delta");
+    send_msg("helo", "COORD-TEST-3", 1);
+    if (expect_line(fd, "\"cmd\":\"phelo\"", "COORD-TEST-3") != 1) return fail("add delta");
+    send_msg("bye", "COORD-TEST-2", 1);
+    if (expect_line(fd, "\"cmd\":\"pbye\"", "COORD-TEST-2") != 1) return fail("remove delta");
+    printf("deltas          ok\n");
+    
+    /* Loopback by default: not reachable from outside */
+    if (outside_addr(ip, sizeof(ip))) {
+        int out = dial(ip, port + 1);
+        if (out >= 0) {
+            close(out);
+            return fail("reachable on a non-loopback address by default");
+        }
+        printf("bind            ok (refused on %s)\n", ip);
+    } else {
+        printf("bind            skipped (no non-loopback address)\n");
+    }
+    
+    /* Stopping closes the session */
+    pn_coord_stats_t st;
+    if (pn_get_coord_stats(&st) < 0) return fail("stats");
+    pn_coordinator_close();
+    if (expect_line(fd, "\"never\"", NULL) != 0) return fail("session kept after close");
+    close(fd);
+    printf("close           ok\n");
+    
+    /* Serving every interface is an explicit choice */
+    if (pn_set_coordinator_addr("0.0.0.0") < 0 || pn_coordinator_open(port + 1) < 0) {
+        return fail("coordinator on every interface");
+    }
+    rx_len = rx_used = 0;
+    fd = dial("127.0.0.1", port + 1);
+    if (fd < 0 || read_snapshot(fd, seed, 0) < 0) return fail("reopen");
+    close(fd);
+    
+    pn_discovery_shutdown();
+    close(udp_sock);
+    printf("\nPASS\n");
+    return 0;
+}
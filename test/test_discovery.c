@@ -45,12 +45,14 @@ void on_service_found(const char *id, const char *service,
 }
 
 void print_usage(const char *prog) {
-    printf("Usage: %s <mode> [id]\n", prog);
+    printf("Usage: %s <mode> [id] [seed-peer]\n", prog);
     printf("Modes:\n");
     printf("  server  - Announce as sdr_server\n");
     printf("  client  - Announce as waterfall, look for servers\n");
     printf("  listen  - Just listen, don't announce\n");
     printf("\n");
+    printf("Giving a seed peer (ip or ip:port) switches to unicast mode.\n");
+    printf("\n");
     printf("Example:\n");
     printf("  %s server KY4OLB-SDR1\n", prog);
     printf("  %s client WF1\n", prog);
@@ -64,6 +66,7 @@ int main(int argc, char *argv[]) {
     
     const char *mode = argv[1];
     const char *id = (argc > 2) ? argv[2] : "TEST1";
+    const char *seed = (argc > 3) ? argv[3] : NULL;
     
     /* Setup signal handler */
     signal(SIGINT, signal_handler);
@@ -77,6 +80,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    /* Unicast seed-list mode */
+    if (seed) {
+        if (pn_add_peer(seed) < 0 || pn_set_unicast_mode(true) < 0) {
+            fprintf(stderr, "Failed to set seed peer\n");
+            pn_discovery_shutdown();
+            return 1;
+        }
+    }
+    
     /* Start listening */
     if (pn_listen(on_service_found, NULL) < 0) {
         fprintf(stderr, "Failed to start listener\n");
@@ -93,6 +105,10 @@ int main(int argc, char *argv[]) {
         }
         printf("Announcing as sdr_server '%s' on ports 4535/4536\n", id);
         
+        /* Report once someone can see us */
+        int peers = pn_announce_wait_visible(1, 3000);
+        if (peers > 0) printf("Visible to %d peer%s\n", peers, peers == 1 ? "" : "s");
+
     } else if (strcmp(mode, "client") == 0) {
         if (pn_announce(id, PN_SVC_WATERFALL, 0, 0, NULL) < 0) {
             fprintf(stderr, "Failed to start announcing\n");
@@ -101,6 +117,9 @@ int main(int argc, char *argv[]) {
         }
         printf("Announcing as waterfall '%s'\n", id);
         
+        /* Ask for servers now instead of waiting for their next heartbeat */
+        pn_query(PN_SVC_SDR_SERVER);
+        
     } else if (strcmp(mode, "listen") == 0) {
         printf("Listen-only mode\n");
         
@@ -0,0 +1,147 @@
+/*
+ * Phoenix Nest Service Discovery - Event History Reader
+ * 
+ * Prints the records of a history file written by pn_history_open(),
+ * oldest first, optionally filtered by id and time range:
+ *   pn_history <file> [--id ID] [--since UNIX_SEC] [--until UNIX_SEC]
+ * 
+ * The ring is in time order (the writer holds a record's time at the
+ * previous one's if the clock steps back), so the start of a time range is
+ * found by binary search rather than a full scan.
+ * 
+ * (c) 2024 Phoenix Nest LLC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pn_discovery.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <arpa/inet.h>
+#endif
+
+static FILE *fp;
+static pn_history_header_t hdr;
+
+/* Read logical record n (0 = first ever written) */
+static int read_record(uint64_t n, pn_history_record_t *r) {
+    long off = (long)sizeof(hdr) + (long)(n % hdr.capacity) * (long)sizeof(*r);
+    if (fseek(fp, off, SEEK_SET) != 0) return -1;
+    return fread(r, sizeof(*r), 1, fp) == 1 ? 0 : -1;
+}
+
+/* First logical record in [lo, hi) with ts_ms >= since_ms */
+static uint64_t lower_bound(uint64_t lo, uint64_t hi, uint64_t since_ms) {
+    pn_history_record_t r;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (read_record(mid, &r) < 0) break;
+        if (r.ts_ms < since_ms) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static const char *event_name(int type) {
+    switch (type) {
+        case PN_EVENT_ADDED:   return "ADDED";
+        case PN_EVENT_UPDATED: return "UPDATED";
+        case PN_EVENT_REMOVED: return "REMOVED";
+        case PN_EVENT_EVICTED: return "EVICTED";
+        case PN_EVENT_EXPIRED: return "EXPIRED";
+        default:               return "?";
+    }
+}
+
+static void print_fields(uint16_t changed) {
+    static const struct { uint16_t bit; const char *name; } fields[] = {
+        { PN_FIELD_SERVICE, "service" }, { PN_FIELD_IP, "ip" },
+        { PN_FIELD_PORTS, "ports" },     { PN_FIELD_CAPS, "caps" },
+        { PN_FIELD_INCARNATION, "inc" }, { PN_FIELD_SLOTS, "slots" },
+    };
+    const char *sep = " [";
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (changed & fields[i].bit) {
+            printf("%s%s", sep, fields[i].name);
+            sep = ",";
+        }
+    }
+    if (changed) printf("]");
+}
+
+static void print_record(const pn_history_record_t *r) {
+    time_t sec = (time_t)(r->ts_ms / 1000);
+    struct tm *tm = gmtime(&sec);
+    char when[32] = "?";
+    if (tm) strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", tm);
+    
+    struct in_addr a;
+    a.s_addr = r->src_ip;
+    
+    printf("%s.%03u  %-7s  %s  from %s:%u", when, (unsigned)(r->ts_ms % 1000),
+           event_name(r->type), r->id, inet_ntoa(a), (unsigned)r->src_port);
+    if (r->slots >= 0) printf("  slots=%d", r->slots);
+    print_fields(r->changed);
+    printf("\n");
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s <file> [--id ID] [--since UNIX_SEC] [--until UNIX_SEC]\n", prog);
+    printf("Times are printed in UTC.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *id = NULL;
+    uint64_t since_ms = 0, until_ms = UINT64_MAX;
+    
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--id") == 0 && i + 1 < argc) {
+            id = argv[++i];
+        } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+            since_ms = strtoull(argv[++i], NULL, 10) * 1000;
+        } else if (strcmp(argv[i], "--until") == 0 && i + 1 < argc) {
+            until_ms = strtoull(argv[++i], NULL, 10) * 1000 + 999;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "pn_history: cannot open %s\n", argv[1]);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != PN_HISTORY_MAGIC ||
+        hdr.version != PN_HISTORY_VERSION || hdr.record_size != sizeof(pn_history_record_t) ||
+        hdr.capacity == 0) {
+        fprintf(stderr, "pn_history: %s is not a history file\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+    
+    uint64_t total = hdr.total;
+    uint64_t first = (total > hdr.capacity) ? total - hdr.capacity : 0;
+    uint32_t handle = id ? pn_history_id_handle(id) : 0;
+    
+    pn_history_record_t r;
+    for (uint64_t n = lower_bound(first, total, since_ms); n < total; n++) {
+        if (read_record(n, &r) < 0) break;
+        if (r.ts_ms > until_ms) break;
+        if (id && (r.id_handle != handle ||
+                   strncmp(r.id, id, PN_HISTORY_ID_LEN - 1) != 0)) continue;
+        r.id[PN_HISTORY_ID_LEN - 1] = '\0';
+        print_record(&r);
+    }
+    
+    fclose(fp);
+    return 0;
+}